@@ -12,9 +12,199 @@
  */
 
 #include "vabackend.h"
+#include <stdlib.h>
 #include <string.h>
 
 /*
  * Additional buffer utility functions can be added here.
  * The main buffer management is in vabackend.c for now.
  */
+
+/*
+ * Two-pass NAL gather
+ *
+ * Broadcast and 8K streams carry 32 to 128 slices per picture, and
+ * appending them one by one cost two bitstream_append calls each, every
+ * one with its own capacity check. H.264 and HEVC now first list the
+ * NALs of a slice data buffer, parameter sets included, which fixes
+ * where each one lands; the bitstream then grows once and the copies go
+ * straight to their places.
+ */
+
+static const uint8_t START_CODE[] = { 0x00, 0x00, 0x01 };
+
+void nal_list_reset(V4L2NalList *list)
+{
+    list->count = 0;
+    list->bytes = 0;
+}
+
+/* Returns -1 if the list cannot grow */
+int nal_list_add(V4L2NalList *list, const void *data, size_t size)
+{
+    if (list->count == list->allocated) {
+        int n = list->allocated ? list->allocated * 2 : 64;
+        V4L2NalRef *nals = realloc(list->nals, n * sizeof(*nals));
+        if (nals == NULL)
+            return -1;
+        list->nals = nals;
+        size_t *offsets = realloc(list->offsets, n * sizeof(*offsets));
+        if (offsets == NULL)
+            return -1;
+        list->offsets = offsets;
+        list->allocated = n;
+    }
+
+    list->nals[list->count].data = data;
+    list->nals[list->count].size = size;
+    list->offsets[list->count] = list->bytes;
+    list->count++;
+    list->bytes += sizeof(START_CODE) + size;
+    return 0;
+}
+
+/*
+ * Append every listed NAL to the bitstream behind a start code, then
+ * empty the list
+ */
+void nal_list_gather(V4L2NalList *list, BitstreamBuffer *bb)
+{
+    if (list->count == 0)
+        return;
+
+    if (bitstream_reserve(bb, list->bytes) < 0) {
+        LOG("Cannot grow bitstream by %zu bytes, dropping %d NALs", list->bytes, list->count);
+        nal_list_reset(list);
+        return;
+    }
+
+    uint8_t *dst = (uint8_t *)bb->data + bb->size;
+    for (int i = 0; i < list->count; i++) {
+        uint8_t *out = dst + list->offsets[i];
+        memcpy(out, START_CODE, sizeof(START_CODE));
+        memcpy(out + sizeof(START_CODE), list->nals[i].data, list->nals[i].size);
+    }
+
+    bb->size += list->bytes;
+    nal_list_reset(list);
+}
+
+void nal_list_free(V4L2NalList *list)
+{
+    free(list->nals);
+    free(list->offsets);
+    list->nals = NULL;
+    list->offsets = NULL;
+    list->count = 0;
+    list->allocated = 0;
+    list->bytes = 0;
+}
+
+/*
+ * Buffer recycling
+ *
+ * Every picture creates and destroys a handful of VA buffers (picture and
+ * slice parameters, slice data, often an image), and each used to be a
+ * calloc for the wrapper plus a malloc for its data. Destroyed buffers
+ * now go to a list of up to SPARE_BUFFERS spares that keep their data
+ * allocation; the next buffer takes the spare whose allocation fits best,
+ * and buffers without data (images) take only spares without one.
+ * Allocations grow with headroom, so once a stream has shown its largest
+ * slice data, decoding it allocates nothing. Images keep their memory in
+ * the image pool, not here.
+ */
+
+#define SPARE_MIN_CAPACITY      4096
+
+/*
+ * A cleared buffer with room for size bytes of data (no data if size is
+ * 0). NULL if out of memory.
+ */
+V4L2Buffer *buffer_get(V4L2Device *dev, size_t size)
+{
+    V4L2Buffer *buffer = NULL;
+    int best = -1;
+    bool best_fits = false;
+
+    pthread_mutex_lock(&dev->spare_mutex);
+    for (int i = 0; i < dev->num_spare_buffers; i++) {
+        size_t cap = dev->spare_buffers[i]->data_capacity;
+        bool fits = cap >= size;
+
+        /* Images bring their own memory; dropping a spare's would only regrow it later */
+        if (size == 0 && cap > 0)
+            continue;
+        size_t best_cap = best < 0 ? 0 : dev->spare_buffers[best]->data_capacity;
+
+        /* The smallest that fits, else the largest to grow */
+        if (best < 0 || (fits && (!best_fits || cap < best_cap)) ||
+            (!fits && !best_fits && cap > best_cap)) {
+            best = i;
+            best_fits = fits;
+        }
+    }
+    if (best >= 0) {
+        buffer = dev->spare_buffers[best];
+        dev->spare_buffers[best] = dev->spare_buffers[--dev->num_spare_buffers];
+        dev->buffers_reused++;
+    } else {
+        dev->buffers_allocated++;
+    }
+    pthread_mutex_unlock(&dev->spare_mutex);
+
+    void *data = buffer ? buffer->data : NULL;
+    size_t capacity = buffer ? buffer->data_capacity : 0;
+
+    if (buffer == NULL) {
+        buffer = malloc(sizeof(*buffer));
+        if (buffer == NULL)
+            return NULL;
+    }
+    memset(buffer, 0, sizeof(*buffer));
+
+    if (size == 0)
+        return buffer;
+
+    if (capacity < size) {
+        size_t want = size < SPARE_MIN_CAPACITY ? SPARE_MIN_CAPACITY : size + size / 2;
+        void *grown = realloc(data, want);
+        if (grown == NULL) {
+            free(data);
+            free(buffer);
+            return NULL;
+        }
+        data = grown;
+        capacity = want;
+    }
+    buffer->data = data;
+    buffer->data_capacity = capacity;
+    return buffer;
+}
+
+/*
+ * Keep a destroyed buffer for buffer_get. Its data must be its own
+ * allocation (data_capacity bytes) or NULL.
+ */
+void buffer_put(V4L2Device *dev, V4L2Buffer *buffer)
+{
+    pthread_mutex_lock(&dev->spare_mutex);
+    if (dev->num_spare_buffers < SPARE_BUFFERS && !mem_pressure(dev)) {
+        dev->spare_buffers[dev->num_spare_buffers++] = buffer;
+        pthread_mutex_unlock(&dev->spare_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&dev->spare_mutex);
+
+    free(buffer->data);
+    free(buffer);
+}
+
+void buffer_spares_free(V4L2Device *dev)
+{
+    LOG("Buffers: %u allocated, %u reused", dev->buffers_allocated, dev->buffers_reused);
+    for (int i = 0; i < dev->num_spare_buffers; i++) {
+        free(dev->spare_buffers[i]->data);
+        free(dev->spare_buffers[i]);
+    }
+    dev->num_spare_buffers = 0;
+}
@@ -0,0 +1,308 @@
+/*
+ * Decoded frame checksums for VA-API to V4L2 stateful backend
+ *
+ * When V4L2VA_CHECKSUM=crc32|md5 is set, the visible region of every
+ * CAPTURE buffer is hashed as soon as it is dequeued. Rows are hashed at
+ * their visible width, so the result does not depend on the decoder's
+ * stride or alignment padding. With md5 and NV12 output the hash matches
+ * FFmpeg's "-f framemd5 -pix_fmt nv12" for the same frame.
+ *
+ * Output goes to V4L2VA_CHECKSUM_FILE (default: the driver log), one line
+ * per frame in framemd5 column layout: stream, dts, pts, duration, size, hash.
+ *
+ * CRC32 uses the ARMv8 CRC32 instructions when the CPU has them (same
+ * polynomial as zlib's crc32()) and a table-driven version otherwise.
+ */
+
+#define _GNU_SOURCE
+#include "vabackend.h"
+
+#include <stdio.h>
+#include <linux/dma-buf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+static FILE *checksum_output = NULL;
+static pthread_mutex_t checksum_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+static _Atomic unsigned int checksum_streams = 0;
+
+/*
+ * CRC32 (IEEE 802.3, reflected, poly 0xEDB88320)
+ */
+static uint32_t crc32_table[256];
+static uint32_t (*crc32_update)(uint32_t crc, const uint8_t *data, size_t size);
+
+static uint32_t crc32_update_table(uint32_t crc, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        crc = crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32_update_arm(uint32_t crc, const uint8_t *data, size_t size)
+{
+    while (size > 0 && ((uintptr_t)data & 7)) {
+        crc = __crc32b(crc, *data++);
+        size--;
+    }
+    while (size >= 32) {
+        uint64_t v[4];
+        memcpy(v, data, sizeof(v));
+        crc = __crc32d(crc, v[0]);
+        crc = __crc32d(crc, v[1]);
+        crc = __crc32d(crc, v[2]);
+        crc = __crc32d(crc, v[3]);
+        data += 32;
+        size -= 32;
+    }
+    while (size >= 8) {
+        uint64_t v;
+        memcpy(&v, data, sizeof(v));
+        crc = __crc32d(crc, v);
+        data += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = __crc32b(crc, *data++);
+        size--;
+    }
+    return crc;
+}
+#endif
+
+/*
+ * MD5 (RFC 1321)
+ */
+typedef struct {
+    uint32_t    state[4];
+    uint64_t    length;
+    uint8_t     block[64];
+    size_t      used;
+} Md5Context;
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_init(Md5Context *md5)
+{
+    md5->state[0] = 0x67452301;
+    md5->state[1] = 0xefcdab89;
+    md5->state[2] = 0x98badcfe;
+    md5->state[3] = 0x10325476;
+    md5->length = 0;
+    md5->used = 0;
+}
+
+static void md5_transform(uint32_t state[4], const uint8_t block[64])
+{
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = (uint32_t)block[i * 4] | ((uint32_t)block[i * 4 + 1] << 8) |
+               ((uint32_t)block[i * 4 + 2] << 16) | ((uint32_t)block[i * 4 + 3] << 24);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        uint32_t tmp = d;
+        d = c;
+        c = b;
+        uint32_t x = a + f + md5_k[i] + m[g];
+        b = b + ((x << md5_r[i]) | (x >> (32 - md5_r[i])));
+        a = tmp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static void md5_update(Md5Context *md5, const uint8_t *data, size_t size)
+{
+    md5->length += size;
+
+    if (md5->used > 0) {
+        size_t n = 64 - md5->used < size ? 64 - md5->used : size;
+        memcpy(md5->block + md5->used, data, n);
+        md5->used += n;
+        data += n;
+        size -= n;
+        if (md5->used < 64)
+            return;
+        md5_transform(md5->state, md5->block);
+        md5->used = 0;
+    }
+
+    while (size >= 64) {
+        md5_transform(md5->state, data);
+        data += 64;
+        size -= 64;
+    }
+
+    memcpy(md5->block, data, size);
+    md5->used = size;
+}
+
+static void md5_final(Md5Context *md5, uint8_t digest[16])
+{
+    uint64_t bits = md5->length * 8;
+    uint8_t pad = 0x80;
+
+    md5_update(md5, &pad, 1);
+    pad = 0;
+    while (md5->used != 56)
+        md5_update(md5, &pad, 1);
+
+    uint8_t len[8];
+    for (int i = 0; i < 8; i++)
+        len[i] = (bits >> (8 * i)) & 0xff;
+    md5_update(md5, len, 8);
+
+    for (int i = 0; i < 4; i++) {
+        digest[i * 4] = md5->state[i] & 0xff;
+        digest[i * 4 + 1] = (md5->state[i] >> 8) & 0xff;
+        digest[i * 4 + 2] = (md5->state[i] >> 16) & 0xff;
+        digest[i * 4 + 3] = (md5->state[i] >> 24) & 0xff;
+    }
+}
+
+static void checksum_setup(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc32_table[i] = c;
+    }
+    crc32_update = crc32_update_table;
+
+#if defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        crc32_update = crc32_update_arm;
+#endif
+
+    const char *path = v4l2va_options.checksum_file;
+    if (path != NULL) {
+        checksum_output = fopen(path, "a");
+        if (checksum_output == NULL)
+            LOG("Checksum: failed to open %s, using log", path);
+        else
+            setvbuf(checksum_output, NULL, _IOLBF, 0);
+    }
+
+    if (checksum_output != NULL) {
+        fprintf(checksum_output, "#format: frame checksums\n#version: 2\n#hash: %s\n",
+                v4l2va_options.checksum == CHECKSUM_MD5 ? "MD5" : "CRC32");
+        fprintf(checksum_output, "#stream#, dts,        pts, duration,     size, hash\n");
+    }
+}
+
+/*
+ * Assign this context its stream number in the checksum output
+ */
+void checksum_init_context(V4L2Context *ctx)
+{
+    if (v4l2va_options.checksum == CHECKSUM_NONE)
+        return;
+
+    pthread_once(&checksum_once, checksum_setup);
+    ctx->checksum.stream = atomic_fetch_add(&checksum_streams, 1);
+    ctx->checksum.frames = 0;
+}
+
+/*
+ * Hash the visible region of a freshly dequeued CAPTURE buffer
+ */
+void checksum_frame(V4L2Context *ctx, int capture_idx)
+{
+    V4L2FrameLayout layout;
+    if (surface_frame_layout(ctx, capture_idx, &layout) < 0) {
+        LOG("Checksum: unsupported CAPTURE layout for buffer %d", capture_idx);
+        return;
+    }
+
+    char hash[33];
+    size_t size = 0;
+
+    v4l2_capture_begin_cpu(ctx, capture_idx, DMA_BUF_SYNC_READ);
+
+    if (v4l2va_options.checksum == CHECKSUM_MD5) {
+        Md5Context md5;
+        uint8_t digest[16];
+        md5_init(&md5);
+        for (int p = 0; p < layout.num_planes; p++) {
+            for (uint32_t y = 0; y < layout.height[p]; y++)
+                md5_update(&md5, layout.data[p] + (size_t)y * layout.pitch[p], layout.width[p]);
+            size += (size_t)layout.width[p] * layout.height[p];
+        }
+        md5_final(&md5, digest);
+        for (int i = 0; i < 16; i++)
+            snprintf(hash + i * 2, 3, "%02x", digest[i]);
+    } else {
+        uint32_t crc = 0xffffffff;
+        for (int p = 0; p < layout.num_planes; p++) {
+            for (uint32_t y = 0; y < layout.height[p]; y++)
+                crc = crc32_update(crc, layout.data[p] + (size_t)y * layout.pitch[p], layout.width[p]);
+            size += (size_t)layout.width[p] * layout.height[p];
+        }
+        snprintf(hash, sizeof(hash), "%08x", crc ^ 0xffffffff);
+    }
+
+    v4l2_capture_end_cpu(ctx, capture_idx, DMA_BUF_SYNC_READ);
+
+    uint64_t n = ctx->checksum.frames++;
+
+    if (checksum_output == NULL) {
+        LOG("Checksum: stream %u frame %llu size %zu %s", ctx->checksum.stream,
+            (unsigned long long)n, size, hash);
+        return;
+    }
+
+    pthread_mutex_lock(&checksum_mutex);
+    fprintf(checksum_output, "%u, %10llu, %10llu, %8d, %8zu, %s\n", ctx->checksum.stream,
+            (unsigned long long)n, (unsigned long long)n, 1, size, hash);
+    pthread_mutex_unlock(&checksum_mutex);
+}
@@ -0,0 +1,181 @@
+/*
+ * Tiled CAPTURE readback for VA-API to V4L2 stateful backend
+ *
+ * Many VPUs decode fastest into a tiled layout: the frame is cut into
+ * fixed-size tiles stored one after the other in raster order, each tile
+ * holding its rows back to back. Copy consumers still want linear images,
+ * so CPU readback (vaGetImage, user-pointer surfaces, frame cache hits)
+ * detiles on the way out instead of asking the decoder for a slower
+ * linear layout.
+ *
+ * The kernels move whole tile rows with NEON loads and stores where the
+ * tile width allows (16 and 32 byte rows, and 4x4 tiles four at a time
+ * through a de-interleaving load); partial tiles at the right and bottom
+ * edges fall back to memcpy.
+ *
+ * Whether copy consumers get a tiled layout at all is V4L2VA_DETILE: by
+ * default only from DETILE_AUTO_PIXELS up, where decode time dominates
+ * and the detile pass costs about as much as the plain copy it replaces.
+ */
+
+#include "vabackend.h"
+
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define DETILE_AUTO_PIXELS      (1920 * 1080)
+
+/* Tiled layouts in raster tile order, both planes tiled alike */
+static const struct {
+    uint32_t        pixfmt;
+    uint32_t        tile_w;         /* Pixels */
+    uint32_t        tile_h;         /* Rows */
+    uint32_t        bpp;            /* Bytes per sample */
+} tilings[] = {
+    { V4L2_PIX_FMT_NV12_4L4,     4,  4,  1 },
+    { V4L2_PIX_FMT_P010_4L4,     4,  4,  2 },
+    { V4L2_PIX_FMT_NV12_16L16,   16, 16, 1 },
+    { V4L2_PIX_FMT_NV12_32L32,   32, 32, 1 },
+    { V4L2_PIX_FMT_NV12MT_16X16, 16, 16, 1 },
+};
+
+#define NUM_TILINGS (int)(sizeof(tilings) / sizeof(tilings[0]))
+
+static int tiling_index(uint32_t pixfmt)
+{
+    for (int i = 0; i < NUM_TILINGS; i++) {
+        if (tilings[i].pixfmt == pixfmt)
+            return i;
+    }
+    return -1;
+}
+
+/* Bytes per sample of a tiled layout we can read back, 0 if not one */
+uint32_t detile_bpp(uint32_t pixfmt)
+{
+    int t = tiling_index(pixfmt);
+    return t < 0 ? 0 : tilings[t].bpp;
+}
+
+/* Should a copy consumer take a tiled layout for frames of this size? */
+bool detile_preferred(uint32_t width, uint32_t height)
+{
+    switch (v4l2va_options.detile) {
+    case DETILE_ALWAYS:
+        return true;
+    case DETILE_NEVER:
+        return false;
+    default:
+        return (uint64_t)width * height >= DETILE_AUTO_PIXELS;
+    }
+}
+
+/* One full tile of tw bytes by th rows */
+static inline void copy_tile(uint8_t *dst, uint32_t dst_pitch, const uint8_t *tile,
+                             uint32_t tw, uint32_t th)
+{
+#if defined(__ARM_NEON)
+    if (tw == 16) {
+        for (uint32_t r = 0; r < th; r++)
+            vst1q_u8(dst + (size_t)r * dst_pitch, vld1q_u8(tile + r * 16));
+        return;
+    }
+    if (tw == 32) {
+        for (uint32_t r = 0; r < th; r++) {
+            vst1q_u8(dst + (size_t)r * dst_pitch, vld1q_u8(tile + r * 32));
+            vst1q_u8(dst + (size_t)r * dst_pitch + 16, vld1q_u8(tile + r * 32 + 16));
+        }
+        return;
+    }
+#endif
+    for (uint32_t r = 0; r < th; r++)
+        memcpy(dst + (size_t)r * dst_pitch, tile + r * tw, tw);
+}
+
+/*
+ * Detile one plane. src_pitch is the V4L2 bytesperline: a row of tiles
+ * takes src_pitch * tile rows bytes. width is in bytes.
+ */
+static void detile_plane(uint8_t *dst, uint32_t dst_pitch, const uint8_t *src, uint32_t src_pitch,
+                         uint32_t width, uint32_t rows, uint32_t tw, uint32_t th)
+{
+    uint32_t full_w = width - width % tw;
+
+    for (uint32_t y = 0; y < rows; y += th) {
+        const uint8_t *tile_row = src + (size_t)y * src_pitch;
+        uint8_t *out = dst + (size_t)y * dst_pitch;
+        uint32_t h = rows - y < th ? rows - y : th;
+        uint32_t x = 0;
+
+        if (h == th) {
+#if defined(__ARM_NEON)
+            /* 4x4 tiles of 8-bit samples: one load takes row r of four tiles */
+            if (tw == 4 && th == 4) {
+                for (; x + 16 <= full_w; x += 16) {
+                    uint32x4x4_t t = vld4q_u32((const uint32_t *)(tile_row + (size_t)x * th));
+                    for (int r = 0; r < 4; r++)
+                        vst1q_u32((uint32_t *)(out + (size_t)r * dst_pitch + x), t.val[r]);
+                }
+            }
+#endif
+            for (; x < full_w; x += tw)
+                copy_tile(out + x, dst_pitch, tile_row + (size_t)x * th, tw, th);
+        }
+
+        /* Edge tiles: only the visible part */
+        for (; x < width; x += tw) {
+            uint32_t w = width - x < tw ? width - x : tw;
+            const uint8_t *tile = tile_row + (size_t)x * th;
+            for (uint32_t r = 0; r < h; r++)
+                memcpy(out + (size_t)r * dst_pitch + x, tile + r * tw, w);
+        }
+    }
+}
+
+/*
+ * surface_copy_frame for tiled CAPTURE layouts: detile into a two-plane
+ * NV12 or P010 image. Returns -1 if the format is not tiled or the image
+ * is too small.
+ */
+int detile_frame(V4L2Context *ctx, uint8_t *base0, uint8_t *base1, uint8_t *dst,
+                 const uint32_t pitches[2], const uint32_t offsets[2],
+                 size_t size, uint32_t height)
+{
+    const struct v4l2_pix_format_mplane *fmt = &ctx->capture_fmt;
+    int t = tiling_index(fmt->pixelformat);
+
+    if (t < 0 || dst == NULL || base0 == NULL)
+        return -1;
+
+    uint32_t tw = tilings[t].tile_w * tilings[t].bpp;
+    uint32_t th = tilings[t].tile_h;
+    uint32_t pitch0 = fmt->plane_fmt[0].bytesperline;
+    uint32_t aligned_h = (fmt->height + th - 1) / th * th;
+    const uint8_t *src[2] = {
+        base0,
+        (fmt->num_planes > 1 && base1) ? base1 : base0 + (size_t)pitch0 * aligned_h,
+    };
+    uint32_t src_pitch[2] = {
+        pitch0,
+        fmt->num_planes > 1 ? fmt->plane_fmt[1].bytesperline : pitch0,
+    };
+    uint32_t w = ctx->visible_width;
+    uint32_t width[2] = { w * tilings[t].bpp, ((w + 1) / 2) * 2 * tilings[t].bpp };
+    uint32_t h = height < ctx->visible_height ? height : ctx->visible_height;
+    uint32_t rows[2] = { h, (h + 1) / 2 };
+
+    for (int p = 0; p < 2; p++) {
+        if (width[p] > pitches[p])
+            width[p] = pitches[p];
+        if (offsets[p] + (size_t)pitches[p] * (rows[p] ? rows[p] - 1 : 0) + width[p] > size)
+            return -1;
+    }
+
+    for (int p = 0; p < 2; p++)
+        detile_plane(dst + offsets[p], pitches[p], src[p], src_pitch[p], width[p], rows[p], tw, th);
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Overload frame dropping for VA-API to V4L2 stateful backend
+ *
+ * A player that cannot keep up at least wants the frames it does show to
+ * be on time. When V4L2VA_DROP is set, pictures nothing else refers to are
+ * skipped before they reach the decoder while the context is overloaded:
+ *
+ *   queue - the decoder still holds half or more of the OUTPUT buffers
+ *   hint  - the app polled a surface of this context that was not ready
+ *           within the last DROP_HINT_WINDOW_MS
+ *
+ * Only pictures the codec marks as non-reference are dropped (H.264
+ * nal_ref_idc == 0, HEVC sub-layer non-reference NAL types in the highest
+ * temporal layer, VP8/VP9 frames that refresh neither reference slots nor
+ * persistent probabilities), so the pictures after them decode exactly as
+ * before. A dropped picture's surface is reported done, without output
+ * and without an error. Slice-streaming contexts are left alone: part of
+ * a picture may already be queued by the time it is complete.
+ */
+
+#define _GNU_SOURCE
+#include "vabackend.h"
+
+#include <string.h>
+#include <time.h>
+
+#define DROP_HINT_WINDOW_MS     100
+#define DROP_MIN_BACKLOG        2
+
+static bool drop_overloaded(V4L2Context *ctx)
+{
+    unsigned int policy = v4l2va_options.drop_policy;
+
+    if ((policy & DROP_ON_HINT) && ctx->drop.hinted &&
+        ms_since(&ctx->drop.last_hint) < DROP_HINT_WINDOW_MS)
+        return true;
+
+    if ((policy & DROP_ON_QUEUE) && ctx->streaming_output) {
+        int limit = ctx->num_output_buffers / 2;
+        if (limit < DROP_MIN_BACKLOG)
+            limit = DROP_MIN_BACKLOG;
+        if (v4l2_output_backlog(ctx) >= limit)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Decide whether to skip the current picture. Called with ctx->mutex held
+ * once the picture is complete; on true the render target is already
+ * marked done.
+ */
+bool drop_picture(V4L2Context *ctx)
+{
+    if (v4l2va_options.drop_policy == 0 || ctx->reference || ctx->keyframe)
+        return false;
+
+    /* Slice streaming may already have handed part of the picture over */
+    if (ctx->slice_streaming && ctx->streaming_output)
+        return false;
+
+    if (!drop_overloaded(ctx))
+        return false;
+
+    if (ctx->render_target) {
+        ctx->render_target->decoded = true;
+        ctx->render_target->no_output = true;
+    }
+
+    if ((++ctx->drop.dropped & 63) == 1)
+        LOG("Drop: %s decoder overloaded, %u non-reference pictures skipped",
+            ctx->codec->name, ctx->drop.dropped);
+    return true;
+}
+
+/*
+ * The app asked about a surface of this context that is still rendering
+ */
+void drop_hint(V4L2Context *ctx)
+{
+    if (!(v4l2va_options.drop_policy & DROP_ON_HINT))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ctx->drop.last_hint);
+    ctx->drop.hinted = true;
+}
@@ -0,0 +1,421 @@
+/*
+ * Elementary stream dump for VA-API to V4L2 stateful backend
+ *
+ * When V4L2VA_DUMP=<directory> is set, every buffer that
+ * v4l2_queue_bitstream() hands to the decoder is also written to a
+ * per-context file: raw Annex-B (.h264/.hevc) or IVF (.ivf) for VP8/VP9.
+ * The files can be replayed with ffmpeg to tell reconstructed parameter
+ * sets apart from application slice data when hardware decode fails.
+ *
+ * The decode thread never touches the file descriptor. Each stream owns a
+ * single-producer/single-consumer byte ring; the producer (the context,
+ * always under ctx->mutex) copies into it and publishes with a release
+ * store. One background writer drains all rings with large sequential
+ * write() calls. If a ring is full the whole picture is dropped and
+ * counted rather than blocking decode.
+ */
+
+#define _GNU_SOURCE
+#include "vabackend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#define DUMP_RING_SIZE      (8 * 1024 * 1024)   /* Must be a power of two */
+#define DUMP_WRITE_CHUNK    (256 * 1024)        /* Batch writes at least this large */
+#define DUMP_FLUSH_MS       100                 /* ... unless data has waited this long */
+#define DUMP_POLL_MS        20
+
+#define IVF_HEADER_SIZE         32
+#define IVF_FRAME_HEADER_SIZE   12
+
+typedef struct V4L2Dump {
+    int                 fd;
+    char                path[256];
+    bool                ivf;
+
+    uint8_t             *ring;
+    _Atomic size_t      head;           /* Written by producer */
+    _Atomic size_t      tail;           /* Written by writer thread */
+    _Atomic bool        closing;
+
+    /* Producer-only counters (read by the writer after closing is set) */
+    uint64_t            frames;
+    uint64_t            dropped;
+
+    bool                failed;         /* Writer-only: stop writing after an I/O error */
+    struct timespec     last_write;     /* Writer-only */
+    struct V4L2Dump     *next;
+} V4L2Dump;
+
+static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
+static V4L2Dump *dump_list = NULL;
+static pthread_t dump_thread;
+static bool dump_thread_running = false;
+static bool dump_stop = false;
+static _Atomic unsigned int dump_seq = 0;
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/*
+ * Write out whatever is pending in the ring. Returns true if data was written.
+ * Small amounts are held back until they reach DUMP_WRITE_CHUNK or have
+ * waited DUMP_FLUSH_MS, so the file is written in large sequential pieces.
+ */
+static bool dump_drain(V4L2Dump *d, bool force)
+{
+    size_t tail = atomic_load_explicit(&d->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&d->head, memory_order_acquire);
+    size_t pending = head - tail;
+
+    if (pending == 0)
+        return false;
+    if (!force && pending < DUMP_WRITE_CHUNK && ms_since(&d->last_write) < DUMP_FLUSH_MS)
+        return false;
+
+    size_t off = tail & (DUMP_RING_SIZE - 1);
+    size_t first = pending < DUMP_RING_SIZE - off ? pending : DUMP_RING_SIZE - off;
+
+    if (!d->failed) {
+        if (!write_all(d->fd, d->ring + off, first) ||
+            !write_all(d->fd, d->ring, pending - first)) {
+            LOG("Dump: write to %s failed: %s, disabling", d->path, strerror(errno));
+            d->failed = true;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &d->last_write);
+    atomic_store_explicit(&d->tail, head, memory_order_release);
+    return true;
+}
+
+static void dump_finalize(V4L2Dump *d)
+{
+    dump_drain(d, true);
+
+    if (d->ivf && !d->failed) {
+        /* Patch the frame count now that it is known */
+        uint8_t count[4];
+        put_le32(count, (uint32_t)d->frames);
+        if (pwrite(d->fd, count, sizeof(count), 24) != sizeof(count))
+            LOG("Dump: failed to update IVF frame count in %s", d->path);
+    }
+
+    LOG("Dump: closed %s (%llu frames, %llu dropped)", d->path,
+        (unsigned long long)d->frames, (unsigned long long)d->dropped);
+
+    close(d->fd);
+    free(d->ring);
+    free(d);
+}
+
+/*
+ * Unlink the streams whose context is gone and return them as a list.
+ * Called with dump_mutex held.
+ */
+static V4L2Dump *dump_take_closing(void)
+{
+    V4L2Dump *closing = NULL;
+    V4L2Dump **link = &dump_list;
+
+    while (*link) {
+        V4L2Dump *d = *link;
+        if (atomic_load_explicit(&d->closing, memory_order_acquire)) {
+            *link = d->next;
+            d->next = closing;
+            closing = d;
+        } else {
+            link = &d->next;
+        }
+    }
+    return closing;
+}
+
+static void dump_finalize_list(V4L2Dump *d)
+{
+    while (d != NULL) {
+        V4L2Dump *next = d->next;
+        dump_finalize(d);
+        d = next;
+    }
+}
+
+static void *dump_writer_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&dump_mutex);
+    while (1) {
+        bool stop = dump_stop;
+        V4L2Dump *closing = dump_take_closing();
+        V4L2Dump *live = dump_list;
+
+        /*
+         * write() may block on slow storage, and dump_open/dump_close take
+         * dump_mutex under ctx->mutex, so the files are written unlocked.
+         * The live streams can't go away meanwhile: only this thread
+         * unlinks them, and dump_open only adds in front of the snapshot.
+         */
+        pthread_mutex_unlock(&dump_mutex);
+
+        /* On shutdown live streams are only flushed, their contexts still use them */
+        for (V4L2Dump *d = live; d != NULL; d = d->next)
+            dump_drain(d, stop);
+        dump_finalize_list(closing);
+
+        pthread_mutex_lock(&dump_mutex);
+        if (stop)
+            break;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += DUMP_POLL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&dump_cond, &dump_mutex, &ts);
+    }
+    pthread_mutex_unlock(&dump_mutex);
+
+    return NULL;
+}
+
+/*
+ * Reserve and fill ring space for one submission. Header and payload are
+ * published together so the writer never sees a partial picture. Returns
+ * false if the ring had no room and the submission was dropped.
+ */
+static bool dump_push(V4L2Dump *d, const uint8_t *hdr, size_t hdr_size,
+                      const void *data, size_t size)
+{
+    size_t head = atomic_load_explicit(&d->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&d->tail, memory_order_acquire);
+
+    if (hdr_size + size > DUMP_RING_SIZE - (head - tail)) {
+        d->dropped++;
+        return false;
+    }
+
+    const uint8_t *parts[2] = { hdr, data };
+    size_t sizes[2] = { hdr_size, size };
+
+    for (int p = 0; p < 2; p++) {
+        const uint8_t *src = parts[p];
+        size_t left = sizes[p];
+        while (left > 0) {
+            size_t off = head & (DUMP_RING_SIZE - 1);
+            size_t n = left < DUMP_RING_SIZE - off ? left : DUMP_RING_SIZE - off;
+            memcpy(d->ring + off, src, n);
+            src += n;
+            head += n;
+            left -= n;
+        }
+    }
+
+    atomic_store_explicit(&d->head, head, memory_order_release);
+    return true;
+}
+
+/*
+ * Open a dump stream for a context. Returns NULL if dumping is disabled
+ * or the file cannot be created (decode continues either way).
+ */
+V4L2Dump *dump_open(const V4L2Context *ctx)
+{
+    const char *ext;
+    const char *ivf_fourcc = NULL;
+
+    if (v4l2va_options.dump_dir == NULL)
+        return NULL;
+
+    switch (ctx->codec->v4l2_pixfmt) {
+    case V4L2_PIX_FMT_H264:
+        ext = "h264";
+        break;
+    case V4L2_PIX_FMT_HEVC:
+        ext = "hevc";
+        break;
+    case V4L2_PIX_FMT_VP8:
+        ext = "ivf";
+        ivf_fourcc = "VP80";
+        break;
+    case V4L2_PIX_FMT_VP9:
+        ext = "ivf";
+        ivf_fourcc = "VP90";
+        break;
+    default:
+        ext = "bin";
+        break;
+    }
+
+    V4L2Dump *d = calloc(1, sizeof(V4L2Dump));
+    if (d == NULL)
+        return NULL;
+
+    d->ring = malloc(DUMP_RING_SIZE);
+    if (d->ring == NULL) {
+        free(d);
+        return NULL;
+    }
+
+    snprintf(d->path, sizeof(d->path), "%s/v4l2va-%d-%u.%s",
+             v4l2va_options.dump_dir, getpid(),
+             atomic_fetch_add(&dump_seq, 1), ext);
+
+    d->fd = open(d->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (d->fd < 0) {
+        LOG("Dump: failed to create %s: %s", d->path, strerror(errno));
+        free(d->ring);
+        free(d);
+        return NULL;
+    }
+
+    if (ivf_fourcc) {
+        uint8_t hdr[IVF_HEADER_SIZE];
+        memset(hdr, 0, sizeof(hdr));
+        memcpy(hdr, "DKIF", 4);
+        put_le16(hdr + 4, 0);                   /* version */
+        put_le16(hdr + 6, IVF_HEADER_SIZE);
+        memcpy(hdr + 8, ivf_fourcc, 4);
+        put_le16(hdr + 12, ctx->width);
+        put_le16(hdr + 14, ctx->height);
+        put_le32(hdr + 16, 30);                 /* timebase denominator */
+        put_le32(hdr + 20, 1);                  /* timebase numerator */
+        put_le32(hdr + 24, 0);                  /* frame count, patched on close */
+        d->ivf = true;
+        dump_push(d, hdr, sizeof(hdr), NULL, 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &d->last_write);
+
+    pthread_mutex_lock(&dump_mutex);
+    if (!dump_thread_running) {
+        dump_stop = false;
+        if (pthread_create(&dump_thread, NULL, dump_writer_thread, NULL) != 0) {
+            pthread_mutex_unlock(&dump_mutex);
+            LOG("Dump: failed to start writer thread");
+            close(d->fd);
+            free(d->ring);
+            free(d);
+            return NULL;
+        }
+        dump_thread_running = true;
+    }
+    d->next = dump_list;
+    dump_list = d;
+    pthread_mutex_unlock(&dump_mutex);
+
+    LOG("Dump: writing %s bitstream to %s", ctx->codec->name, d->path);
+    return d;
+}
+
+/*
+ * Record one submitted OUTPUT buffer. Never blocks. Dropped buffers leave
+ * no gap in the IVF frame count or timestamps.
+ */
+void dump_write(V4L2Dump *d, const void *data, size_t size)
+{
+    bool pushed;
+
+    if (d == NULL)
+        return;
+
+    if (d->ivf) {
+        uint8_t hdr[IVF_FRAME_HEADER_SIZE];
+        put_le32(hdr, (uint32_t)size);
+        put_le64(hdr + 4, d->frames);
+        pushed = dump_push(d, hdr, sizeof(hdr), data, size);
+    } else {
+        pushed = dump_push(d, NULL, 0, data, size);
+    }
+    if (pushed)
+        d->frames++;
+}
+
+/*
+ * Hand the stream to the writer for final drain and close, or close it
+ * here once the writer has stopped.
+ */
+void dump_close(V4L2Dump *d)
+{
+    V4L2Dump *closing = NULL;
+
+    if (d == NULL)
+        return;
+
+    pthread_mutex_lock(&dump_mutex);
+    atomic_store_explicit(&d->closing, true, memory_order_release);
+    if (dump_thread_running)
+        pthread_cond_signal(&dump_cond);
+    else
+        closing = dump_take_closing();
+    pthread_mutex_unlock(&dump_mutex);
+
+    dump_finalize_list(closing);
+}
+
+/*
+ * Stop the writer (library unload). Streams already closed are finished;
+ * open ones are flushed and stay with their contexts, which may still be
+ * decoding, until dump_close.
+ */
+void dump_shutdown(void)
+{
+    pthread_mutex_lock(&dump_mutex);
+    if (!dump_thread_running) {
+        pthread_mutex_unlock(&dump_mutex);
+        return;
+    }
+    dump_stop = true;
+    pthread_cond_signal(&dump_cond);
+    pthread_mutex_unlock(&dump_mutex);
+
+    pthread_join(dump_thread, NULL);
+
+    /* Closed after the writer's last pass */
+    pthread_mutex_lock(&dump_mutex);
+    dump_thread_running = false;
+    V4L2Dump *closing = dump_take_closing();
+    pthread_mutex_unlock(&dump_mutex);
+
+    dump_finalize_list(closing);
+}
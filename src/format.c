@@ -0,0 +1,255 @@
+/*
+ * CAPTURE pixel format negotiation for VA-API to V4L2 stateful backend
+ *
+ * After SOURCE_CHANGE the decoder proposes a CAPTURE format and lists the
+ * ones it can produce for the stream. Which is best depends on who reads
+ * the frames:
+ *
+ *   copy    vaGetImage, vaDeriveImage and user-pointer surfaces walk the
+ *           frame on the CPU. Contiguous NV12 maps as one buffer and
+ *           matches the image layout row for row.
+ *   export  vaExportSurfaceHandle hands the planes to a GPU or display.
+ *           NV12M gives each plane its own dma-buf, which importers that
+ *           allocate per plane take as is.
+ *
+ * 10-bit streams get P010 for both. Planar YUV420 comes last, since every
+ * consumer has to interleave its chroma. A context is a copy consumer
+ * unless its render targets were created with a display or export usage
+ * hint; exporting from a copy context switches it at the next negotiation.
+ *
+ * Tiled and compressed (AFBC) layouts go to export consumers only, and
+ * only if the importer listed their DRM format modifier when it created
+ * the render targets (VASurfaceAttribDRMFormatModifiers). They beat every
+ * linear layout, in the importer's order of preference. Copy consumers
+ * get a linear layout, or a tiled one that readback detiles (detile.c)
+ * when V4L2VA_DETILE says the frames are large enough to be worth it.
+ */
+
+#include "vabackend.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <drm_fourcc.h>
+
+#define MAX_CAPTURE_FORMATS     32
+
+/* AFBC output of the Arm Mali-V (Linlon) VPU, as named by its mvx driver */
+#ifndef V4L2_PIX_FMT_YUV420_AFBC_8
+#define V4L2_PIX_FMT_YUV420_AFBC_8      v4l2_fourcc('Y', '0', 'A', '8')
+#endif
+#ifndef V4L2_PIX_FMT_YUV420_AFBC_10
+#define V4L2_PIX_FMT_YUV420_AFBC_10     v4l2_fourcc('Y', '0', 'A', 'A')
+#endif
+
+#define MVX_AFBC_MODIFIER \
+    DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE)
+
+/* CAPTURE layouts only an importer that knows their modifier can read */
+static const struct {
+    uint32_t        pixfmt;
+    bool            ten_bit;
+    V4L2ExportFormat export;
+} modified_formats[] = {
+    { V4L2_PIX_FMT_YUV420_AFBC_8,  false,
+      { VA_FOURCC_NV12, MVX_AFBC_MODIFIER, DRM_FORMAT_YUV420_8BIT, true } },
+    { V4L2_PIX_FMT_YUV420_AFBC_10, true,
+      { VA_FOURCC_P010, MVX_AFBC_MODIFIER, DRM_FORMAT_YUV420_10BIT, true } },
+    { V4L2_PIX_FMT_NV12MT,         false,
+      { VA_FOURCC_NV12, DRM_FORMAT_MOD_SAMSUNG_64_32_TILE, DRM_FORMAT_NV12, false } },
+    { V4L2_PIX_FMT_NV12MT_16X16,   false,
+      { VA_FOURCC_NV12, DRM_FORMAT_MOD_SAMSUNG_16_16_TILE, DRM_FORMAT_NV12, false } },
+    { V4L2_PIX_FMT_NV12_32L32,     false,
+      { VA_FOURCC_NV12, DRM_FORMAT_MOD_ALLWINNER_TILED, DRM_FORMAT_NV12, false } },
+};
+
+#define NUM_MODIFIED_FORMATS (int)(sizeof(modified_formats) / sizeof(modified_formats[0]))
+
+static int modified_format_index(uint32_t pixfmt)
+{
+    for (int i = 0; i < NUM_MODIFIED_FORMATS; i++) {
+        if (modified_formats[i].pixfmt == pixfmt)
+            return i;
+    }
+    return -1;
+}
+
+/* Position of a modifier in the importer's list, -1 if it was not listed */
+static int modifier_preference(const V4L2Context *ctx, uint64_t modifier)
+{
+    for (int i = 0; i < ctx->num_modifiers; i++) {
+        if (ctx->modifiers[i] == modifier)
+            return i;
+    }
+    return -1;
+}
+
+/* Formats every readback and export path can describe, best first */
+static const uint32_t copy_rank[] = {
+    V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_NV12M, V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_P010,
+};
+static const uint32_t export_rank[] = {
+    V4L2_PIX_FMT_NV12M, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_P010,
+};
+
+/* Lower is better; -1 if no path can handle the format */
+static int format_rank(const V4L2Context *ctx, bool ten_bit, uint32_t pixfmt,
+                       uint32_t width, uint32_t height)
+{
+    V4L2Consumer consumer = ctx->consumer;
+    const uint32_t *rank = consumer == CONSUMER_EXPORT ? export_rank : copy_rank;
+    int n = consumer == CONSUMER_EXPORT ? (int)(sizeof(export_rank) / sizeof(export_rank[0])) :
+                                          (int)(sizeof(copy_rank) / sizeof(copy_rank[0]));
+
+    /* Tiled layouts readback can detile: ahead of linear, or last */
+    uint32_t tiled_bpp = detile_bpp(pixfmt);
+    if (consumer == CONSUMER_COPY && tiled_bpp) {
+        if ((tiled_bpp == 2) != ten_bit)
+            return -1;
+        return detile_preferred(width, height) ? MAX_MODIFIERS - 1 : MAX_MODIFIERS + 2 * n;
+    }
+
+    int m = modified_format_index(pixfmt);
+    if (m >= 0) {
+        if (consumer != CONSUMER_EXPORT || modified_formats[m].ten_bit != ten_bit)
+            return -1;
+        return modifier_preference(ctx, modified_formats[m].export.modifier);
+    }
+
+    /* Linear layouts come after anything the importer asked for */
+    int base = MAX_MODIFIERS;
+
+    /* Never truncate 10-bit output, never pad 8-bit output */
+    if (pixfmt == V4L2_PIX_FMT_P010)
+        return base + (ten_bit ? 0 : n);
+
+    for (int i = 0; i < n; i++) {
+        if (rank[i] == pixfmt)
+            return base + (ten_bit ? n + i : i + 1);
+    }
+    return -1;
+}
+
+static bool profile_is_10bit(VAProfile profile)
+{
+    return profile == VAProfileHEVCMain10 || profile == VAProfileVP9Profile2;
+}
+
+/*
+ * Pick the CAPTURE format for the stream. fmt holds the decoder's proposal
+ * (G_FMT after SOURCE_CHANGE) and is updated to what was set.
+ */
+void format_negotiate(V4L2Context *ctx, struct v4l2_format *fmt)
+{
+    uint32_t current = fmt->fmt.pix_mp.pixelformat;
+    bool ten_bit = format_bpp(current) == 2 || profile_is_10bit(ctx->profile);
+    uint32_t best = 0;
+    int best_rank = -1;
+
+    for (int i = 0; i < MAX_CAPTURE_FORMATS; i++) {
+        struct v4l2_fmtdesc desc;
+        memset(&desc, 0, sizeof(desc));
+        desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        desc.index = i;
+        if (ioctl(ctx->v4l2_fd, VIDIOC_ENUM_FMT, &desc) < 0)
+            break;
+
+        int rank = format_rank(ctx, ten_bit, desc.pixelformat,
+                               fmt->fmt.pix_mp.width, fmt->fmt.pix_mp.height);
+        LOG("CAPTURE format %.4s offered (rank %d)", (char *)&desc.pixelformat, rank);
+        if (rank >= 0 && (best_rank < 0 || rank < best_rank)) {
+            best = desc.pixelformat;
+            best_rank = rank;
+        }
+    }
+
+    if (best_rank >= MAX_MODIFIERS && ctx->num_modifiers > 0 &&
+        modifier_preference(ctx, DRM_FORMAT_MOD_LINEAR) < 0)
+        LOG("No CAPTURE format matches the importer's modifiers, exporting linear");
+
+    if (best == 0 || best == current)
+        return;
+
+    struct v4l2_format try = *fmt;
+    try.fmt.pix_mp.pixelformat = best;
+    try.fmt.pix_mp.num_planes = 0;
+    memset(try.fmt.pix_mp.plane_fmt, 0, sizeof(try.fmt.pix_mp.plane_fmt));
+    if (ioctl(ctx->v4l2_fd, VIDIOC_S_FMT, &try) == 0 && try.fmt.pix_mp.pixelformat == best) {
+        LOG("CAPTURE format %.4s for %s", (char *)&best,
+            ctx->consumer == CONSUMER_EXPORT ? "export" : "copy");
+        *fmt = try;
+        return;
+    }
+
+    /* Whatever S_FMT left behind is what the decoder will produce */
+    LOG("Cannot switch CAPTURE format to %.4s: %s", (char *)&best, strerror(errno));
+    ioctl(ctx->v4l2_fd, VIDIOC_G_FMT, fmt);
+}
+
+/* VA fourcc of the images a CAPTURE format reads back as; 0 if none */
+uint32_t format_va_fourcc(uint32_t pixfmt)
+{
+    switch (pixfmt) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+        return VA_FOURCC_NV12;
+    case V4L2_PIX_FMT_P010:
+        return VA_FOURCC_P010;
+    case V4L2_PIX_FMT_YUV420:
+        return VA_FOURCC_I420;
+    default:
+        return 0;
+    }
+}
+
+/* Bytes per sample of a CAPTURE format, tiled layouts included */
+uint32_t format_bpp(uint32_t pixfmt)
+{
+    if (pixfmt == V4L2_PIX_FMT_P010)
+        return 2;
+    uint32_t tiled = detile_bpp(pixfmt);
+    return tiled ? tiled : 1;
+}
+
+/*
+ * Describe a CAPTURE format for export. Returns -1 if no importer could
+ * make sense of it.
+ */
+int format_export_info(uint32_t pixfmt, V4L2ExportFormat *info)
+{
+    int m = modified_format_index(pixfmt);
+    if (m >= 0) {
+        *info = modified_formats[m].export;
+        return 0;
+    }
+
+    info->va_fourcc = format_va_fourcc(pixfmt);
+    info->modifier = DRM_FORMAT_MOD_LINEAR;
+    info->compressed = false;
+    switch (info->va_fourcc) {
+    case VA_FOURCC_NV12:
+        info->drm_format = DRM_FORMAT_NV12;
+        return 0;
+    case VA_FOURCC_P010:
+        info->drm_format = DRM_FORMAT_P010;
+        return 0;
+    case VA_FOURCC_I420:
+        info->drm_format = DRM_FORMAT_YUV420;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Record how a context's frames are being used. The CAPTURE queue is not
+ * reallocated under frames the application holds; the new ranking applies
+ * the next time the queue is set up (resolution change, idle resume).
+ */
+void format_set_consumer(V4L2Context *ctx, V4L2Consumer consumer)
+{
+    if (ctx->consumer == consumer)
+        return;
+    ctx->consumer = consumer;
+    LOG("Context frames are now used for %s", consumer == CONSUMER_EXPORT ? "export" : "copy");
+}
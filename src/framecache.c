@@ -0,0 +1,344 @@
+/*
+ * Decoded-frame cache for VA-API to V4L2 stateful backend
+ *
+ * Editors that scrub backwards or step frames re-send the GOP from its
+ * keyframe for every step, and every step used to decode all of it again.
+ * With V4L2VA_FRAME_CACHE=N each context keeps its last N decoded frames in
+ * system memory and recognises pictures it has already decoded.
+ *
+ * A picture is identified by a hash chained over its bitstream and every
+ * picture since the previous keyframe, which pins down both its content
+ * and its stream position: the same bits after the same history decode to
+ * the same frame. A picture found in the cache is not submitted; its
+ * surface reads the stored copy. The decoder falls behind while that
+ * happens, so the bitstreams it skipped are kept, and the first miss that
+ * is not a keyframe replays them (discarding their frames) before the
+ * picture itself is queued.
+ *
+ * Eviction is tuned for reverse playback, which walks back through a GOP
+ * one frame at a time: frames from other GOPs go first, least recently
+ * used first, then the frames of the current GOP furthest from its
+ * keyframe, which a backwards walk never asks for again.
+ *
+ * Only CPU readback (vaGetImage) is served from the cache; cached surfaces
+ * have no CAPTURE buffer to derive or export. User-pointer surfaces get the
+ * stored copy written into their memory. Slice-streaming and packing
+ * contexts never see a picture's bitstream whole and are left out.
+ */
+
+#include "vabackend.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <linux/dma-buf.h>
+
+#define FRAMECACHE_MAX_FRAMES   64
+
+#define FNV_OFFSET_BASIS        0xcbf29ce484222325ULL
+#define FNV_PRIME               0x100000001b3ULL
+
+typedef struct V4L2CachedFrame {
+    uint64_t        key;            /* Chain hash up to and including this picture */
+    uint64_t        gop;            /* Chain hash of its keyframe */
+    unsigned int    pos;            /* Pictures since that keyframe */
+    uint64_t        last_used;
+    atomic_int      refs;           /* Surfaces showing it, plus the replay list */
+    bool            valid;
+    bool            has_frame;      /* Decoded frame stored */
+    bool            hidden;         /* show_frame = 0: never produces a frame */
+    void            *bitstream;
+    size_t          bitstream_size;
+    size_t          bitstream_alloc;
+    void            *planes[2];
+    size_t          lens[2];
+} V4L2CachedFrame;
+
+struct V4L2FrameCache {
+    V4L2CachedFrame entries[FRAMECACHE_MAX_FRAMES];
+    int             num_entries;
+    uint64_t        chain;
+    uint64_t        gop;
+    unsigned int    pos;
+    uint64_t        tick;
+
+    /* Served from the cache but never seen by the decoder, in stream order */
+    V4L2CachedFrame *skipped[FRAMECACHE_MAX_FRAMES];
+    int             num_skipped;
+    int             discard;        /* Replayed frames still to come out */
+
+    unsigned int    hits;
+    unsigned int    misses;
+};
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * FNV_PRIME;
+    return hash;
+}
+
+/*
+ * Set up the cache for a new context (no-op if disabled)
+ */
+void framecache_init_context(V4L2Context *ctx)
+{
+    int frames = v4l2va_options.frame_cache;
+
+    if (frames <= 0)
+        return;
+
+    if (ctx->slice_streaming || ctx->pack.max_pictures > 0) {
+        LOG("Frame cache: not available with slice streaming or packing");
+        return;
+    }
+
+    ctx->framecache = calloc(1, sizeof(struct V4L2FrameCache));
+    if (ctx->framecache == NULL)
+        return;
+
+    ctx->framecache->num_entries = frames < FRAMECACHE_MAX_FRAMES ? frames : FRAMECACHE_MAX_FRAMES;
+    LOG("Frame cache: keeping up to %d decoded %s frames", ctx->framecache->num_entries,
+        ctx->codec->name);
+}
+
+void framecache_destroy(V4L2Context *ctx)
+{
+    struct V4L2FrameCache *fc = ctx->framecache;
+
+    if (fc == NULL)
+        return;
+
+    LOG("Frame cache: %u hits, %u misses", fc->hits, fc->misses);
+    for (int i = 0; i < fc->num_entries; i++) {
+        free(fc->entries[i].bitstream);
+        free(fc->entries[i].planes[0]);
+        free(fc->entries[i].planes[1]);
+    }
+    free(fc);
+    ctx->framecache = NULL;
+}
+
+static V4L2CachedFrame *framecache_find(struct V4L2FrameCache *fc, uint64_t key)
+{
+    for (int i = 0; i < fc->num_entries; i++) {
+        if (fc->entries[i].valid && fc->entries[i].key == key)
+            return &fc->entries[i];
+    }
+    return NULL;
+}
+
+/* Pick a slot for a new picture; NULL if every frame is in use */
+static V4L2CachedFrame *framecache_evict(struct V4L2FrameCache *fc)
+{
+    V4L2CachedFrame *victim = NULL;
+
+    for (int i = 0; i < fc->num_entries; i++) {
+        V4L2CachedFrame *e = &fc->entries[i];
+        if (!e->valid)
+            return e;
+        if (atomic_load(&e->refs) > 0)
+            continue;
+
+        if (victim == NULL) {
+            victim = e;
+        } else if ((e->gop != fc->gop) != (victim->gop != fc->gop)) {
+            if (e->gop != fc->gop)
+                victim = e;                 /* Other GOPs before the current one */
+        } else if (e->gop != fc->gop) {
+            if (e->last_used < victim->last_used)
+                victim = e;
+        } else if (e->pos > victim->pos) {
+            victim = e;
+        }
+    }
+
+    if (victim)
+        victim->valid = false;
+    return victim;
+}
+
+static void framecache_unpin_skipped(struct V4L2FrameCache *fc)
+{
+    for (int i = 0; i < fc->num_skipped; i++)
+        atomic_fetch_sub(&fc->skipped[i]->refs, 1);
+    fc->num_skipped = 0;
+}
+
+/* Bring the decoder up to date with the pictures served from the cache */
+static void framecache_replay(V4L2Context *ctx)
+{
+    struct V4L2FrameCache *fc = ctx->framecache;
+
+    for (int i = 0; i < fc->num_skipped; i++) {
+        V4L2CachedFrame *e = fc->skipped[i];
+        if (v4l2_queue_bitstream(ctx, e->bitstream, e->bitstream_size, ctx->picture_seq) == 0 &&
+            !e->hidden)
+            fc->discard++;
+
+        /* Keep CAPTURE buffers flowing so the decoder never waits on us */
+        while (v4l2_dequeue_frame(ctx, NULL, 0) == 0)
+            ;
+    }
+
+    if (fc->num_skipped > 0)
+        LOG("Frame cache: replayed %d pictures to resume decoding", fc->num_skipped);
+    framecache_unpin_skipped(fc);
+}
+
+/*
+ * Look up the current picture (ctx->bitstream) before it is submitted.
+ * Returns true if the render target was served from the cache and the
+ * picture must not be queued. Called with ctx->mutex held.
+ */
+bool framecache_lookup(V4L2Context *ctx, V4L2Surface *surface)
+{
+    struct V4L2FrameCache *fc = ctx->framecache;
+
+    if (fc == NULL || surface == NULL)
+        return false;
+
+    if (ctx->keyframe) {
+        fc->chain = FNV_OFFSET_BASIS;
+        fc->pos = 0;
+    } else {
+        fc->pos++;
+    }
+    /* Parameter sets only go out once per stream; leave them out of the key */
+    fc->chain = fnv1a(fc->chain, (uint8_t *)ctx->bitstream.data + ctx->param_sets_size,
+                      ctx->bitstream.size - ctx->param_sets_size);
+    if (ctx->keyframe)
+        fc->gop = fc->chain;
+    surface->cache_key = fc->chain;
+
+    /* Nothing before a keyframe matters to the decoder any more */
+    if (ctx->keyframe)
+        framecache_unpin_skipped(fc);
+
+    V4L2CachedFrame *entry = framecache_find(fc, fc->chain);
+    if (entry && (entry->has_frame || entry->hidden) &&
+        fc->num_skipped < FRAMECACHE_MAX_FRAMES) {
+        entry->last_used = ++fc->tick;
+        atomic_fetch_add(&entry->refs, 1);
+        fc->skipped[fc->num_skipped++] = entry;
+
+        surface->decoded = true;
+        if (entry->hidden) {
+            surface->no_output = true;
+        } else {
+            atomic_fetch_add(&entry->refs, 1);
+            surface->cached_frame = entry;
+            if (surface->user_ptr)
+                surface_write_user(ctx, surface, entry->planes[0], entry->planes[1]);
+        }
+        fc->hits++;
+        return true;
+    }
+
+    fc->misses++;
+    framecache_replay(ctx);
+
+    if (entry == NULL)
+        entry = framecache_evict(fc);
+    if (entry == NULL)
+        return false;
+
+    if (entry->bitstream_alloc < ctx->bitstream.size) {
+        void *p = realloc(entry->bitstream, ctx->bitstream.size);
+        if (p == NULL) {
+            entry->valid = false;
+            return false;
+        }
+        entry->bitstream = p;
+        entry->bitstream_alloc = ctx->bitstream.size;
+    }
+    memcpy(entry->bitstream, ctx->bitstream.data, ctx->bitstream.size);
+    entry->bitstream_size = ctx->bitstream.size;
+    entry->key = fc->chain;
+    entry->gop = fc->gop;
+    entry->pos = fc->pos;
+    entry->last_used = ++fc->tick;
+    entry->has_frame = false;
+    entry->hidden = !ctx->show_frame;
+    entry->valid = true;
+    return false;
+}
+
+/*
+ * A frame came out for this surface; keep a copy. Called from the dequeue
+ * path with ctx->mutex held.
+ */
+void framecache_store(V4L2Context *ctx, V4L2Surface *surface, int capture_idx)
+{
+    struct V4L2FrameCache *fc = ctx->framecache;
+
+    if (fc == NULL || surface->decode_status != VA_STATUS_SUCCESS)
+        return;
+
+    V4L2CachedFrame *entry = framecache_find(fc, surface->cache_key);
+    if (entry == NULL || entry->has_frame || v4l2_map_capture(ctx, capture_idx) < 0)
+        return;
+
+    V4L2MmapBuffer *cap_buf = &ctx->capture_buffers[capture_idx];
+    const void *src[2] = { cap_buf->plane0_ptr, cap_buf->plane1_ptr };
+    size_t lens[2] = { cap_buf->plane0_len, cap_buf->plane1_len };
+
+    for (int i = 0; i < 2; i++) {
+        if (entry->lens[i] != lens[i]) {
+            free(entry->planes[i]);
+            entry->planes[i] = lens[i] ? malloc(lens[i]) : NULL;
+            entry->lens[i] = entry->planes[i] ? lens[i] : 0;
+            if (lens[i] && entry->planes[i] == NULL)
+                return;
+        }
+    }
+
+    v4l2_capture_begin_cpu(ctx, capture_idx, DMA_BUF_SYNC_READ);
+    for (int i = 0; i < 2; i++) {
+        if (lens[i])
+            memcpy(entry->planes[i], src[i], lens[i]);
+    }
+    v4l2_capture_end_cpu(ctx, capture_idx, DMA_BUF_SYNC_READ);
+    entry->has_frame = true;
+}
+
+/*
+ * True if this CAPTURE frame belongs to a replayed picture and should be
+ * returned to the decoder unseen
+ */
+bool framecache_discard(V4L2Context *ctx)
+{
+    if (ctx->framecache == NULL || ctx->framecache->discard == 0)
+        return false;
+    ctx->framecache->discard--;
+    return true;
+}
+
+/*
+ * Stored frame a surface shows instead of a CAPTURE buffer. Returns -1 if
+ * the surface was decoded normally.
+ */
+int framecache_planes(const V4L2Surface *surface, void *planes[2], size_t lens[2])
+{
+    const V4L2CachedFrame *entry = surface->cached_frame;
+
+    if (entry == NULL)
+        return -1;
+
+    for (int i = 0; i < 2; i++) {
+        planes[i] = entry->planes[i];
+        lens[i] = entry->lens[i];
+    }
+    return 0;
+}
+
+/*
+ * The surface is about to be rendered again or destroyed
+ */
+void framecache_release(V4L2Surface *surface)
+{
+    if (surface->cached_frame == NULL)
+        return;
+    atomic_fetch_sub(&surface->cached_frame->refs, 1);
+    surface->cached_frame = NULL;
+}
@@ -11,8 +11,6 @@
 #include <string.h>
 #include <stdbool.h>
 
-static const uint8_t NAL_START_CODE[] = { 0x00, 0x00, 0x01 };
-
 /*
  * Simple bit writer for generating NAL units
  */
@@ -293,42 +291,54 @@ static void h264_handle_picture_params(V4L2Context *ctx, V4L2Buffer *buf)
 static void h264_handle_slice_data(V4L2Context *ctx, V4L2Buffer *buf)
 {
     VASliceParameterBufferH264 *slice_params = ctx->last_slice_params;
+    V4L2NalList *list = &ctx->nal_list;
 
     if (!slice_params) {
         LOG("H.264: No slice params available!");
         return;
     }
 
+    nal_list_reset(list);
+
     for (unsigned int i = 0; i < ctx->last_slice_count; i++) {
         VASliceParameterBufferH264 *sp = &slice_params[i];
         uint8_t *slice_data = (uint8_t *)buf->data + sp->slice_data_offset;
 
+        if (nal_filter_drop(ctx, slice_data, sp->slice_data_size))
+            continue;
+
         /* Check NAL unit type from first byte */
         uint8_t nal_type = slice_data[0] & 0x1f;
 
+        if (nal_type == 5)
+            ctx->keyframe = true;
+        else if (ctx->keyframe_only)
+            continue;   /* Never submitted, don't bother copying it */
+
+        /* nal_ref_idc is the same for every slice of a picture */
+        ctx->reference = (slice_data[0] >> 5) & 3;
+
         /* For IDR slices (type 5), prepend SPS/PPS */
         if (nal_type == 5 && !ctx->h264.sps_pps_sent) {
-            /* Append SPS */
             if (ctx->h264.last_sps_size > 0) {
-                bitstream_append(&ctx->bitstream, NAL_START_CODE, sizeof(NAL_START_CODE));
-                bitstream_append(&ctx->bitstream, ctx->h264.last_sps, ctx->h264.last_sps_size);
+                nal_list_add(list, ctx->h264.last_sps, ctx->h264.last_sps_size);
                 LOG("H.264: Prepended SPS (%zu bytes)", ctx->h264.last_sps_size);
             }
-
-            /* Append PPS */
             if (ctx->h264.last_pps_size > 0) {
-                bitstream_append(&ctx->bitstream, NAL_START_CODE, sizeof(NAL_START_CODE));
-                bitstream_append(&ctx->bitstream, ctx->h264.last_pps, ctx->h264.last_pps_size);
+                nal_list_add(list, ctx->h264.last_pps, ctx->h264.last_pps_size);
                 LOG("H.264: Prepended PPS (%zu bytes)", ctx->h264.last_pps_size);
             }
 
             ctx->h264.sps_pps_sent = true;
+            ctx->param_sets_size = ctx->bitstream.size + list->bytes;
         }
 
-        /* Prepend NAL start code and append slice data */
-        bitstream_append(&ctx->bitstream, NAL_START_CODE, sizeof(NAL_START_CODE));
-        bitstream_append(&ctx->bitstream, slice_data, sp->slice_data_size);
+        if (nal_list_add(list, slice_data, sp->slice_data_size) < 0)
+            LOG("H.264: Cannot list slice %u, dropping it", i);
     }
+
+    /* Grow the bitstream once and copy every NAL to its place */
+    nal_list_gather(list, &ctx->bitstream);
 }
 
 /*
@@ -12,9 +12,9 @@
 #include <string.h>
 #include <stdbool.h>
 
-static const uint8_t NAL_START_CODE[] = { 0x00, 0x00, 0x01 };
-
 /* HEVC NAL unit types */
+#define HEVC_NAL_RSV_VCL_N14    14
+#define HEVC_NAL_BLA_W_LP       16
 #define HEVC_NAL_IDR_W_RADL     19
 #define HEVC_NAL_IDR_N_LP       20
 #define HEVC_NAL_CRA_NUT        21
@@ -670,25 +670,14 @@ static size_t hevc_generate_pps(VAPictureParameterBufferHEVC *pic, uint8_t *buf,
  * Prepend VPS/SPS/PPS to bitstream
  * Uses reconstructed parameter sets from VA-API params.
  */
-static void hevc_prepend_parameter_sets(V4L2Context *ctx)
+static void hevc_prepend_parameter_sets(V4L2Context *ctx, V4L2NalList *list)
 {
-    /* VPS */
-    if (ctx->hevc.last_vps_size > 0) {
-        bitstream_append(&ctx->bitstream, NAL_START_CODE, sizeof(NAL_START_CODE));
-        bitstream_append(&ctx->bitstream, ctx->hevc.last_vps, ctx->hevc.last_vps_size);
-    }
-
-    /* SPS */
-    if (ctx->hevc.last_sps_size > 0) {
-        bitstream_append(&ctx->bitstream, NAL_START_CODE, sizeof(NAL_START_CODE));
-        bitstream_append(&ctx->bitstream, ctx->hevc.last_sps, ctx->hevc.last_sps_size);
-    }
-
-    /* PPS */
-    if (ctx->hevc.last_pps_size > 0) {
-        bitstream_append(&ctx->bitstream, NAL_START_CODE, sizeof(NAL_START_CODE));
-        bitstream_append(&ctx->bitstream, ctx->hevc.last_pps, ctx->hevc.last_pps_size);
-    }
+    if (ctx->hevc.last_vps_size > 0)
+        nal_list_add(list, ctx->hevc.last_vps, ctx->hevc.last_vps_size);
+    if (ctx->hevc.last_sps_size > 0)
+        nal_list_add(list, ctx->hevc.last_sps, ctx->hevc.last_sps_size);
+    if (ctx->hevc.last_pps_size > 0)
+        nal_list_add(list, ctx->hevc.last_pps, ctx->hevc.last_pps_size);
 }
 
 /* Cache key for detecting parameter changes */
@@ -741,12 +730,15 @@ static void hevc_handle_picture_params(V4L2Context *ctx, V4L2Buffer *buf)
 static void hevc_handle_slice_data(V4L2Context *ctx, V4L2Buffer *buf)
 {
     VASliceParameterBufferHEVC *slice_params = ctx->last_slice_params;
+    V4L2NalList *list = &ctx->nal_list;
 
     if (!slice_params) {
         LOG("HEVC: No slice params available!");
         return;
     }
 
+    nal_list_reset(list);
+
     /*
      * NOTE: NAL scanning for original VPS/SPS/PPS is disabled for performance.
      * VA-API parsed streams from MP4/MKV containers never contain parameter sets
@@ -760,6 +752,9 @@ static void hevc_handle_slice_data(V4L2Context *ctx, V4L2Buffer *buf)
         VASliceParameterBufferHEVC *sp = &slice_params[i];
         uint8_t *slice_data = (uint8_t *)buf->data + sp->slice_data_offset;
 
+        if (nal_filter_drop(ctx, slice_data, sp->slice_data_size))
+            continue;
+
         /* Get NAL type from slice data (first 2 bytes are NAL header) */
         uint8_t nal_type = (slice_data[0] >> 1) & 0x3f;
 
@@ -768,17 +763,37 @@ static void hevc_handle_slice_data(V4L2Context *ctx, V4L2Buffer *buf)
             continue;
         }
 
+        /*
+         * Sub-layer non-reference pictures (even types up to RSV_VCL_N14)
+         * can still be referenced from higher temporal layers, so only
+         * those in the highest layer seen so far count as droppable.
+         */
+        int temporal_id = (slice_data[1] & 7) - 1;
+        if (temporal_id > ctx->hevc.max_temporal_id)
+            ctx->hevc.max_temporal_id = temporal_id;
+        ctx->reference = nal_type > HEVC_NAL_RSV_VCL_N14 || (nal_type & 1) ||
+                         temporal_id < ctx->hevc.max_temporal_id;
+
+        /* BLA/IDR/CRA pictures are random access points */
+        if (nal_type >= HEVC_NAL_BLA_W_LP && nal_type <= HEVC_NAL_CRA_NUT)
+            ctx->keyframe = true;
+        else if (ctx->keyframe_only)
+            continue;   /* Never submitted, don't bother copying it */
+
         /* For IDR/CRA slices, prepend VPS/SPS/PPS */
         if ((nal_type >= HEVC_NAL_IDR_W_RADL && nal_type <= HEVC_NAL_CRA_NUT) &&
             !ctx->hevc.params_sent) {
-            hevc_prepend_parameter_sets(ctx);
+            hevc_prepend_parameter_sets(ctx, list);
             ctx->hevc.params_sent = true;
+            ctx->param_sets_size = ctx->bitstream.size + list->bytes;
         }
 
-        /* Prepend NAL start code and append slice data */
-        bitstream_append(&ctx->bitstream, NAL_START_CODE, sizeof(NAL_START_CODE));
-        bitstream_append(&ctx->bitstream, slice_data, sp->slice_data_size);
+        if (nal_list_add(list, slice_data, sp->slice_data_size) < 0)
+            LOG("HEVC: Cannot list slice %u, dropping it", i);
     }
+
+    /* Grow the bitstream once and copy every NAL to its place */
+    nal_list_gather(list, &ctx->bitstream);
 }
 
 /*
@@ -0,0 +1,199 @@
+/*
+ * Idle power management for VA-API to V4L2 stateful backend
+ *
+ * A paused player keeps its VA context, and with it both streaming queues:
+ * MAX_OUTPUT_BUFFERS bitstream buffers and a full set of CAPTURE buffers in
+ * CMA, plus a streaming VPU instance. When V4L2VA_IDLE_TIMEOUT_MS is set, a
+ * background thread looks for contexts that have not started a picture for
+ * that long and suspends them. Under a memory budget (memory.c) they are
+ * also suspended after a short idle spell whenever the budget runs short.
+ *
+ * Suspending never takes a frame from the application. While any surface
+ * still holds a frame of the context (the picture on screen, references),
+ * only the OUTPUT queue is stopped and freed; the CAPTURE buffers, and
+ * the surfaces decoded into them, stay as they are. Only a context no
+ * surface refers to any more gives up its CAPTURE queue as well. Contexts
+ * with a picture still decoding or an image copy still reading a frame are
+ * left for the next round.
+ *
+ * The device fd, event subscriptions and OUTPUT format stay in place, so
+ * resuming on the next BeginPicture only re-allocates OUTPUT buffers; a
+ * released CAPTURE queue is rebuilt after SOURCE_CHANGE exactly as for a
+ * new stream. Restarting the OUTPUT queue makes the decoder look for a
+ * resume point, so decoding continues through the error-recovery path:
+ * pictures up to the next keyframe are reported skipped, and the keyframe
+ * goes out with fresh parameter sets.
+ */
+
+#define _GNU_SOURCE
+#include "vabackend.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#define IDLE_MIN_POLL_MS    100
+
+/*
+ * Can ctx be suspended without waiting for anything? Sets *held if a
+ * surface still refers to its frames. Called with drv->mutex and ctx->mutex
+ * held.
+ */
+static bool idle_suspendable(V4L2Driver *drv, V4L2Context *ctx, bool *held)
+{
+    *held = false;
+    for (int i = 0; i < MAX_SURFACES; i++) {
+        V4L2Surface *surface = drv->surfaces[i];
+        if (surface && surface->context == ctx) {
+            if (!surface->decoded)
+                return false;
+            *held = true;
+        }
+    }
+    /* Copies reading its frames would have to be waited for under drv->mutex */
+    return readback_done(drv->dev, ctx->readback_seq);
+}
+
+/*
+ * Release a context's V4L2 buffers, all of them or, with surfaces still
+ * holding its frames, just the OUTPUT queue. Called with drv->mutex and
+ * ctx->mutex held, after idle_suspendable.
+ */
+static void idle_suspend(V4L2Context *ctx, bool held)
+{
+    if (held) {
+        v4l2_release_output_queue(ctx);
+    } else {
+        v4l2_release_queues(ctx);
+
+        /* Drop stale SOURCE_CHANGE/EOS events so resume waits for fresh ones */
+        struct v4l2_event ev;
+        memset(&ev, 0, sizeof(ev));
+        while (ioctl(ctx->v4l2_fd, VIDIOC_DQEVENT, &ev) == 0)
+            memset(&ev, 0, sizeof(ev));
+    }
+
+    /* The decoder restarts at a resume point; send it a keyframe */
+    ctx->h264.sps_pps_sent = false;
+    ctx->hevc.params_sent = false;
+    ctx->recovery.resync = true;
+    ctx->recovery.skipped = 0;
+
+    ctx->render_target = NULL;
+    ctx->suspended = true;
+
+    LOG("Idle: suspended %s context after %ld ms without decoding%s",
+        ctx->codec->name, ms_since(&ctx->last_activity),
+        held ? ", frames kept" : "");
+}
+
+static void *idle_thread(void *arg)
+{
+    V4L2Driver *drv = arg;
+    long timeout = v4l2va_options.idle_timeout_ms;
+    long period = timeout / 2 > IDLE_MIN_POLL_MS ? timeout / 2 : IDLE_MIN_POLL_MS;
+
+    /* Under a memory budget, look often enough to free memory when it runs short */
+    if (drv->dev->mem_budget && period > MEM_PRESSURE_IDLE_MS / 2)
+        period = MEM_PRESSURE_IDLE_MS / 2;
+
+    pthread_mutex_lock(&drv->mutex);
+    while (!drv->idle_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += period / 1000;
+        ts.tv_nsec += (period % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&drv->idle_cond, &drv->mutex, &ts);
+        if (drv->idle_stop)
+            break;
+
+        for (int i = 0; i < MAX_CONTEXTS; i++) {
+            V4L2Context *ctx = drv->contexts[i];
+            if (ctx == NULL)
+                continue;
+
+            /* A context busy decoding is by definition not idle */
+            if (pthread_mutex_trylock(&ctx->mutex) != 0)
+                continue;
+
+            long idle = ms_since(&ctx->last_activity);
+            bool held;
+            if (!ctx->suspended && ctx->num_output_buffers > 0 &&
+                (idle >= timeout ||
+                 (idle >= MEM_PRESSURE_IDLE_MS && mem_pressure(drv->dev))) &&
+                idle_suspendable(drv, ctx, &held))
+                idle_suspend(ctx, held);
+
+            pthread_mutex_unlock(&ctx->mutex);
+        }
+    }
+    pthread_mutex_unlock(&drv->mutex);
+
+    return NULL;
+}
+
+/*
+ * Start the idle reaper for this driver instance (no-op if disabled)
+ */
+void idle_start(V4L2Driver *drv)
+{
+    /* Suspending, under memory pressure too, needs V4L2VA_IDLE_TIMEOUT_MS */
+    if (v4l2va_options.idle_timeout_ms == 0)
+        return;
+
+    pthread_cond_init(&drv->idle_cond, NULL);
+    drv->idle_stop = false;
+    if (pthread_create(&drv->idle_thread, NULL, idle_thread, drv) != 0) {
+        LOG("Idle: failed to start reaper thread");
+        pthread_cond_destroy(&drv->idle_cond);
+        return;
+    }
+    drv->idle_running = true;
+
+    LOG("Idle: suspending contexts after %u ms without decoding",
+        v4l2va_options.idle_timeout_ms);
+}
+
+void idle_stop(V4L2Driver *drv)
+{
+    if (!drv->idle_running)
+        return;
+
+    pthread_mutex_lock(&drv->mutex);
+    drv->idle_stop = true;
+    pthread_cond_signal(&drv->idle_cond);
+    pthread_mutex_unlock(&drv->mutex);
+
+    pthread_join(drv->idle_thread, NULL);
+    pthread_cond_destroy(&drv->idle_cond);
+    drv->idle_running = false;
+}
+
+/*
+ * Record decode activity and bring a suspended context back.
+ * Called with ctx->mutex held at the start of every picture.
+ */
+int idle_resume(V4L2Context *ctx)
+{
+    clock_gettime(CLOCK_MONOTONIC, &ctx->last_activity);
+
+    if (!ctx->suspended)
+        return 0;
+
+    /* A CAPTURE queue kept through the suspend still has its format set */
+    int ret = ctx->streaming_capture ? v4l2_alloc_output_buffers(ctx) :
+                                       v4l2_setup_output_queue(ctx);
+    if (ret < 0) {
+        LOG("Idle: failed to restore OUTPUT queue");
+        return -1;
+    }
+
+    ctx->suspended = false;
+    LOG("Idle: resumed %s context", ctx->codec->name);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Image memory pool for VA-API to V4L2 stateful backend
+ *
+ * Players create a VA image per frame or per resize (mpv's readback, the
+ * FFmpeg vaapi hwcontext's transfer path) and destroy it right after, so
+ * every vaCreateImage used to allocate a whole frame afresh. Image memory
+ * now comes from a small pool shared by the displays of the process:
+ * vaDestroyImage hands it back, and the next image of the same format and
+ * size picks it up again.
+ *
+ * Images of IMAGE_HUGEPAGE_MIN and up are mapped rather than malloc'd, as
+ * anonymous memory marked for transparent huge pages. A 4K frame then
+ * spans a handful of TLB entries instead of thousands while vaGetImage
+ * writes all of it. The kernel picks the huge page size (2 MiB, or 512
+ * MiB with 64K base pages) and falls back to small pages by itself; the
+ * hugetlbfs pool is left to the applications that reserved it.
+ *
+ * Idle pool memory stays charged to the memory budget (memory.c). Under
+ * pressure images are freed on destroy instead of being kept.
+ */
+
+#define _GNU_SOURCE
+#include "vabackend.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define IMAGE_POOL_SIZE         8
+#define IMAGE_HUGEPAGE_MIN      (2 * 1024 * 1024)
+
+typedef struct {
+    void            *data;          /* NULL: slot free */
+    size_t          size;           /* Image bytes */
+    size_t          mapped;         /* mmap length, 0 if malloc'd */
+    uint32_t        fourcc;
+    uint32_t        width;
+    uint32_t        height;
+    uint64_t        last_used;
+} V4L2PooledImage;
+
+struct V4L2ImagePool {
+    V4L2PooledImage idle[IMAGE_POOL_SIZE];
+    uint64_t        tick;
+    unsigned int    hits;
+    unsigned int    misses;
+    pthread_mutex_t mutex;
+};
+
+void image_pool_init(V4L2Device *dev)
+{
+    dev->image_pool = calloc(1, sizeof(struct V4L2ImagePool));
+    if (dev->image_pool)
+        pthread_mutex_init(&dev->image_pool->mutex, NULL);
+}
+
+/* Fresh image memory; transparent huge pages for large images */
+static void *image_alloc(size_t size, size_t *mapped)
+{
+    *mapped = 0;
+    if (size < IMAGE_HUGEPAGE_MIN)
+        return malloc(size);
+
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+    *mapped = size;
+    return p;
+}
+
+static void image_free(V4L2Device *dev, void *data, size_t size, size_t mapped)
+{
+    if (mapped)
+        munmap(data, mapped);
+    else
+        free(data);
+    mem_uncharge(dev, size);
+}
+
+/*
+ * Give an image buffer its memory: an idle image of the same format and
+ * size if there is one. buffer->fourcc, width, height and element_size
+ * must be set. Returns -1 if out of memory.
+ */
+int image_pool_get(V4L2Device *dev, V4L2Buffer *buffer)
+{
+    struct V4L2ImagePool *pool = dev->image_pool;
+    size_t size = buffer->element_size;
+
+    if (pool) {
+        pthread_mutex_lock(&pool->mutex);
+        for (int i = 0; i < IMAGE_POOL_SIZE; i++) {
+            V4L2PooledImage *e = &pool->idle[i];
+            if (e->data && e->size == size && e->fourcc == buffer->fourcc &&
+                e->width == buffer->width && e->height == buffer->height) {
+                buffer->data = e->data;
+                buffer->data_mapped = e->mapped;
+                buffer->pooled = true;
+                e->data = NULL;
+                pool->hits++;
+                pthread_mutex_unlock(&pool->mutex);
+                return 0;
+            }
+        }
+        pool->misses++;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    buffer->data = image_alloc(size, &buffer->data_mapped);
+    if (buffer->data == NULL)
+        return -1;
+    buffer->pooled = true;
+    mem_charge(dev, size);
+    return 0;
+}
+
+/*
+ * Take back the memory of a destroyed image. The least recently returned
+ * idle image makes room if the pool is full.
+ */
+void image_pool_put(V4L2Device *dev, V4L2Buffer *buffer)
+{
+    struct V4L2ImagePool *pool = dev->image_pool;
+    void *data = buffer->data;
+    size_t size = buffer->element_size;
+    size_t mapped = buffer->data_mapped;
+
+    buffer->data = NULL;
+    buffer->pooled = false;
+    if (data == NULL)
+        return;
+
+    if (pool == NULL || mem_pressure(dev)) {
+        image_free(dev, data, size, mapped);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    V4L2PooledImage *slot = &pool->idle[0];
+    for (int i = 0; i < IMAGE_POOL_SIZE; i++) {
+        V4L2PooledImage *e = &pool->idle[i];
+        if (e->data == NULL) {
+            slot = e;
+            break;
+        }
+        if (e->last_used < slot->last_used)
+            slot = e;
+    }
+    V4L2PooledImage old = *slot;
+    slot->data = data;
+    slot->size = size;
+    slot->mapped = mapped;
+    slot->fourcc = buffer->fourcc;
+    slot->width = buffer->width;
+    slot->height = buffer->height;
+    slot->last_used = ++pool->tick;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (old.data)
+        image_free(dev, old.data, old.size, old.mapped);
+}
+
+void image_pool_destroy(V4L2Device *dev)
+{
+    struct V4L2ImagePool *pool = dev->image_pool;
+
+    if (pool == NULL)
+        return;
+
+    LOG("Image pool: %u hits, %u misses", pool->hits, pool->misses);
+    for (int i = 0; i < IMAGE_POOL_SIZE; i++) {
+        if (pool->idle[i].data)
+            image_free(dev, pool->idle[i].data, pool->idle[i].size, pool->idle[i].mapped);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+    dev->image_pool = NULL;
+}
@@ -0,0 +1,186 @@
+/*
+ * Decode latency prediction for VA-API to V4L2 stateful backend
+ *
+ * Waiting for a frame with a plain poll() costs a scheduler wakeup after
+ * the decoder interrupt, which on a loaded system adds a jittery fraction
+ * of a millisecond to every sync. Each context instead learns how long its
+ * pictures take, from OUTPUT queueing to CAPTURE dequeue, as an EWMA with
+ * a mean deviation per picture type (keyframe or not). The model starts
+ * over when the stream resolution changes.
+ *
+ * Once warm, a wait sleeps until LATENCY_SPIN_US before the predicted
+ * completion of the oldest picture in flight, spins on a zero-timeout
+ * poll() for POLLIN through the predicted moment, and only then blocks.
+ * The blocking timeout comes from the prediction as well (prediction plus
+ * four deviations), capped by the caller's.
+ */
+
+#define _GNU_SOURCE
+#include "vabackend.h"
+
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#define LATENCY_WARMUP          8       /* Samples before predictions are trusted */
+#define LATENCY_SPIN_US         200     /* Spin this long before the prediction */
+#define LATENCY_SPIN_MAX_US     1000    /* Never spin longer than this per wait */
+#define LATENCY_MIN_TIMEOUT_MS  5
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(int64_t us)
+{
+    struct timespec ts = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (us % 1000000) * 1000,
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+}
+
+/* How long a picture may take before it counts as lost */
+static int64_t latency_budget_us(const struct V4L2LatencyModel *m)
+{
+    return m->mean_us + 4 * m->dev_us + LATENCY_MIN_TIMEOUT_MS * 1000;
+}
+
+/*
+ * A picture with this OUTPUT timestamp was queued. Only its first buffer
+ * counts; slice groups of one picture share the timestamp.
+ */
+void latency_submitted(V4L2Context *ctx, uint64_t ts)
+{
+    int slot = 0;
+
+    /* Hidden pictures never produce a frame to wait for */
+    if (!ctx->show_frame)
+        return;
+
+    for (int i = 0; i < LATENCY_HISTORY; i++) {
+        if (ctx->latency.inflight[i].valid && ctx->latency.inflight[i].ts == ts)
+            return;
+        if (!ctx->latency.inflight[i].valid)
+            slot = i;
+        else if (ctx->latency.inflight[slot].valid &&
+                 ctx->latency.inflight[i].queued_us < ctx->latency.inflight[slot].queued_us)
+            slot = i;       /* Full: reuse the oldest, its frame is long overdue */
+    }
+
+    ctx->latency.inflight[slot].valid = true;
+    ctx->latency.inflight[slot].ts = ts;
+    ctx->latency.inflight[slot].queued_us = now_us();
+    ctx->latency.inflight[slot].keyframe = ctx->keyframe;
+}
+
+/*
+ * A frame carrying this OUTPUT timestamp came out; feed the model
+ */
+void latency_completed(V4L2Context *ctx, uint64_t ts)
+{
+    for (int i = 0; i < LATENCY_HISTORY; i++) {
+        if (!ctx->latency.inflight[i].valid || ctx->latency.inflight[i].ts != ts)
+            continue;
+
+        ctx->latency.inflight[i].valid = false;
+
+        if (ctx->latency.width != ctx->visible_width ||
+            ctx->latency.height != ctx->visible_height) {
+            memset(ctx->latency.model, 0, sizeof(ctx->latency.model));
+            ctx->latency.width = ctx->visible_width;
+            ctx->latency.height = ctx->visible_height;
+        }
+
+        int64_t sample = now_us() - ctx->latency.inflight[i].queued_us;
+        struct V4L2LatencyModel *m = &ctx->latency.model[ctx->latency.inflight[i].keyframe];
+        if (m->samples == 0) {
+            m->mean_us = sample;
+            m->dev_us = sample / 4;
+        } else {
+            int64_t err = sample - m->mean_us;
+            m->mean_us += err / 8;
+            m->dev_us += ((err < 0 ? -err : err) - m->dev_us) / 4;
+        }
+        m->samples++;
+        return;
+    }
+}
+
+/* The decoder dropped everything in flight */
+void latency_reset(V4L2Context *ctx)
+{
+    for (int i = 0; i < LATENCY_HISTORY; i++)
+        ctx->latency.inflight[i].valid = false;
+}
+
+/*
+ * poll() for the next frame, timed by the model. Returns like poll().
+ */
+int latency_poll(V4L2Context *ctx, struct pollfd *pfd, int timeout_ms)
+{
+    if (timeout_ms <= 0)
+        return poll(pfd, 1, timeout_ms);
+
+    /* A frame that is already there needs no prediction */
+    int ready = poll(pfd, 1, 0);
+    if (ready != 0)
+        return ready;
+
+    /*
+     * The next frame out belongs to the oldest picture still in flight.
+     * Pictures well past their predicted completion were lost (decoder
+     * errors, frames the decoder never outputs) and stop counting.
+     */
+    int64_t start = now_us();
+    int oldest = -1;
+    for (int i = 0; i < LATENCY_HISTORY; i++) {
+        if (!ctx->latency.inflight[i].valid)
+            continue;
+        const struct V4L2LatencyModel *m = &ctx->latency.model[ctx->latency.inflight[i].keyframe];
+        if (m->samples >= LATENCY_WARMUP &&
+            start > ctx->latency.inflight[i].queued_us + latency_budget_us(m)) {
+            ctx->latency.inflight[i].valid = false;
+            continue;
+        }
+        if (oldest < 0 || ctx->latency.inflight[i].queued_us < ctx->latency.inflight[oldest].queued_us)
+            oldest = i;
+    }
+    if (oldest < 0)
+        return poll(pfd, 1, timeout_ms);
+
+    const struct V4L2LatencyModel *m = &ctx->latency.model[ctx->latency.inflight[oldest].keyframe];
+    if (m->samples < LATENCY_WARMUP)
+        return poll(pfd, 1, timeout_ms);
+
+    int64_t due = ctx->latency.inflight[oldest].queued_us + m->mean_us;
+    int64_t limit = start + (int64_t)timeout_ms * 1000;
+    int64_t deadline = ctx->latency.inflight[oldest].queued_us + latency_budget_us(m);
+    if (deadline > limit)
+        deadline = limit;
+
+    /* Sleep through most of the decode, never past the caller's timeout */
+    int64_t wake = due - LATENCY_SPIN_US;
+    if (wake > limit)
+        wake = limit;
+    if (wake > start)
+        sleep_us(wake - start);
+
+    /* Then watch for the interrupt without giving up the CPU */
+    int64_t spin_end = due + LATENCY_SPIN_US;
+    if (spin_end > now_us() + LATENCY_SPIN_MAX_US)
+        spin_end = now_us() + LATENCY_SPIN_MAX_US;
+    if (spin_end > limit)
+        spin_end = limit;
+    while (now_us() < spin_end) {
+        int ret = poll(pfd, 1, 0);
+        if (ret != 0)
+            return ret;
+    }
+
+    int64_t remaining = deadline - now_us();
+    return poll(pfd, 1, remaining > 0 ? (int)((remaining + 999) / 1000) : 0);
+}
@@ -0,0 +1,119 @@
+/*
+ * Driver-wide memory governor for VA-API to V4L2 stateful backend
+ *
+ * Every context used to size its queues on its own: MAX_OUTPUT_BUFFERS
+ * bitstream buffers and MAX_CAPTURE_BUFFERS frames, all in CMA, plus its
+ * staging buffer and whatever images the application creates. A few video
+ * tabs on a 4 GB board exhaust CMA and the next context fails outright.
+ *
+ * All of that is now charged against one budget per process (registry.c):
+ * V4L2VA_MEM_BUDGET_MB if set (0 turns the governor off), otherwise three
+ * quarters of the CMA pool, or a quarter of RAM on systems without one.
+ * Queues are sized to what is left of the budget, down to what the
+ * decoder needs to make progress, and REQBUFS failing for lack of memory
+ * is retried with fewer buffers rather than failing the context. With
+ * V4L2VA_IDLE_TIMEOUT_MS set, the idle reaper also suspends contexts that
+ * have not decoded for MEM_PRESSURE_IDLE_MS once MEM_PRESSURE_PERCENT of
+ * the budget is used, ahead of their timeout. Without it, the budget only
+ * sizes queues: a paused player keeps its frames.
+ */
+
+#include "vabackend.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MEM_PRESSURE_PERCENT    90
+
+/* A /proc/meminfo field in bytes, 0 if missing */
+static size_t meminfo_bytes(const char *field)
+{
+    FILE *f = fopen("/proc/meminfo", "r");
+    char line[128];
+    size_t len = strlen(field);
+    unsigned long long kb = 0;
+
+    if (f == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            sscanf(line + len + 1, "%llu", &kb);
+            break;
+        }
+    }
+    fclose(f);
+    return (size_t)kb * 1024;
+}
+
+/*
+ * Work out the budget for the decoder, shared by every display in the process
+ */
+void mem_init(V4L2Device *dev)
+{
+    atomic_store(&dev->mem_charged, 0);
+
+    if (v4l2va_options.mem_budget_set) {
+        dev->mem_budget = (size_t)v4l2va_options.mem_budget_mb * 1024 * 1024;
+    } else {
+        size_t cma = meminfo_bytes("CmaTotal");
+        dev->mem_budget = cma ? cma / 4 * 3 : meminfo_bytes("MemTotal") / 4;
+    }
+
+    if (dev->mem_budget)
+        LOG("Memory: budget %zu MB for decoder buffers", dev->mem_budget / (1024 * 1024));
+}
+
+void mem_charge(V4L2Device *dev, size_t bytes)
+{
+    atomic_fetch_add(&dev->mem_charged, bytes);
+}
+
+void mem_uncharge(V4L2Device *dev, size_t bytes)
+{
+    atomic_fetch_sub(&dev->mem_charged, bytes);
+}
+
+/* True once the budget is nearly used up */
+bool mem_pressure(V4L2Device *dev)
+{
+    return dev->mem_budget &&
+           atomic_load(&dev->mem_charged) >= dev->mem_budget / 100 * MEM_PRESSURE_PERCENT;
+}
+
+/*
+ * How many buffers of each bytes to allocate: wanted if the budget has
+ * room, fewer if not, never less than minimum.
+ */
+int mem_fit(V4L2Context *ctx, const char *queue, int wanted, int minimum, size_t each)
+{
+    V4L2Device *dev = ctx->drv->dev;
+
+    if (dev->mem_budget == 0 || each == 0 || wanted <= minimum)
+        return wanted;
+
+    size_t charged = atomic_load(&dev->mem_charged);
+    size_t left = charged < dev->mem_budget ? dev->mem_budget - charged : 0;
+    int count = left / each < (size_t)wanted ? (int)(left / each) : wanted;
+
+    if (count < minimum)
+        count = minimum;
+    if (count < wanted)
+        LOG("Memory: %s queue cut to %d of %d buffers (%zu KB of budget left)",
+            queue, count, wanted, left / 1024);
+    return count;
+}
+
+/*
+ * Charge staging buffer growth since the last call. Called with
+ * ctx->mutex held once a picture's bitstream is complete.
+ */
+void mem_track_staging(V4L2Context *ctx)
+{
+    size_t now = ctx->bitstream.allocated + ctx->pack.data.allocated;
+
+    if (now > ctx->mem_staging) {
+        mem_charge(ctx->drv->dev, now - ctx->mem_staging);
+        ctx->mem_staging = now;
+    }
+}
@@ -0,0 +1,180 @@
+/*
+ * NAL filtering for VA-API to V4L2 stateful backend
+ *
+ * H.264 and HEVC slice data buffers are forwarded NAL by NAL, and some
+ * applications hand over whole access units: access unit delimiters,
+ * filler data, SEI with closed captions or HDR10+ metadata, in-band
+ * parameter sets repeated before every keyframe. None of it changes the
+ * decoded picture, yet all of it was copied into OUTPUT buffers and
+ * parsed by the firmware.
+ *
+ * These NALs are now left out of the bitstream:
+ *   - access unit delimiters and filler data
+ *   - SEI NALs whose every message has a payload type in V4L2VA_DROP_SEI
+ *     (default NAL_FILTER_DEFAULT_SEI: user data, registered and not,
+ *     which carries captions and dynamic HDR metadata)
+ *   - H.264 SPS/PPS identical to the ones the driver already sends
+ *
+ * SEI NALs with any other message go through whole, so mastering display
+ * and content light level information still reaches the decoder.
+ * V4L2VA_NAL_FILTER=0 forwards everything as before.
+ */
+
+#include "vabackend.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NAL_FILTER_DEFAULT_SEI  "4,5"
+
+/* H.264 NAL unit types */
+#define H264_NAL_SEI            6
+#define H264_NAL_SPS            7
+#define H264_NAL_PPS            8
+#define H264_NAL_AUD            9
+#define H264_NAL_FILLER         12
+
+/* HEVC NAL unit types */
+#define HEVC_NAL_AUD            35
+#define HEVC_NAL_FD             38
+#define HEVC_NAL_SEI_PREFIX     39
+#define HEVC_NAL_SEI_SUFFIX     40
+
+/* Reads RBSP bytes, skipping emulation prevention bytes */
+typedef struct {
+    const uint8_t   *p;
+    const uint8_t   *end;
+    int             zeros;
+} RbspReader;
+
+static int rbsp_byte(RbspReader *r)
+{
+    if (r->p >= r->end)
+        return -1;
+
+    uint8_t b = *r->p++;
+    if (r->zeros >= 2 && b == 0x03) {
+        r->zeros = 0;
+        if (r->p >= r->end)
+            return -1;
+        b = *r->p++;
+    }
+    r->zeros = b == 0 ? r->zeros + 1 : 0;
+    return b;
+}
+
+/* ff_byte-coded payload type or size, -1 past the end */
+static long sei_value(RbspReader *r)
+{
+    long value = 0;
+    int b;
+
+    while ((b = rbsp_byte(r)) == 0xff)
+        value += 255;
+    return b < 0 ? -1 : value + b;
+}
+
+/*
+ * Set the SEI payload types to drop from a comma-separated list. Called
+ * once at load with V4L2VA_DROP_SEI, or the default list if unset.
+ */
+void nal_filter_set_sei(const char *list)
+{
+    const char *p = list ? list : NAL_FILTER_DEFAULT_SEI;
+
+    memset(v4l2va_options.drop_sei, 0, sizeof(v4l2va_options.drop_sei));
+    while (*p) {
+        char *end;
+        unsigned long type = strtoul(p, &end, 10);
+        if (end == p)
+            break;
+        if (type < 256)
+            v4l2va_options.drop_sei[type / 64] |= 1ULL << (type % 64);
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+static bool sei_type_dropped(long type)
+{
+    return type >= 0 && type < 256 &&
+           (v4l2va_options.drop_sei[type / 64] >> (type % 64)) & 1;
+}
+
+/* True if every message of the SEI NAL is one we drop */
+static bool sei_droppable(const uint8_t *nal, size_t size, size_t header)
+{
+    RbspReader r = { nal + header, nal + size, 0 };
+    int messages = 0;
+
+    /* Stop at the rbsp_trailing_bits */
+    while (r.end - r.p > 1 || (r.p < r.end && *r.p != 0x80)) {
+        long type = sei_value(&r);
+        long payload = sei_value(&r);
+        if (type < 0 || payload < 0 || !sei_type_dropped(type))
+            return false;
+        for (long i = 0; i < payload; i++) {
+            if (rbsp_byte(&r) < 0)
+                return false;
+        }
+        messages++;
+    }
+    return messages > 0;
+}
+
+static bool h264_droppable(V4L2Context *ctx, const uint8_t *nal, size_t size)
+{
+    switch (nal[0] & 0x1f) {
+    case H264_NAL_AUD:
+    case H264_NAL_FILLER:
+        return true;
+    case H264_NAL_SEI:
+        return sei_droppable(nal, size, 1);
+    case H264_NAL_SPS:
+        return size == ctx->h264.last_sps_size && memcmp(nal, ctx->h264.last_sps, size) == 0;
+    case H264_NAL_PPS:
+        return size == ctx->h264.last_pps_size && memcmp(nal, ctx->h264.last_pps, size) == 0;
+    default:
+        return false;
+    }
+}
+
+static bool hevc_droppable(const uint8_t *nal, size_t size)
+{
+    if (size < 2)
+        return false;
+
+    switch ((nal[0] >> 1) & 0x3f) {
+    case HEVC_NAL_AUD:
+    case HEVC_NAL_FD:
+        return true;
+    case HEVC_NAL_SEI_PREFIX:
+    case HEVC_NAL_SEI_SUFFIX:
+        return sei_droppable(nal, size, 2);
+    default:
+        return false;
+    }
+}
+
+/*
+ * Should this NAL of a slice data buffer stay out of the bitstream?
+ * Called by the H.264 and HEVC slice handlers before looking at it.
+ */
+bool nal_filter_drop(V4L2Context *ctx, const uint8_t *nal, size_t size)
+{
+    if (v4l2va_options.nal_filter_off || size == 0)
+        return false;
+
+    bool drop = ctx->codec == &hevc_codec ? hevc_droppable(nal, size) :
+                                            h264_droppable(ctx, nal, size);
+    if (drop) {
+        ctx->nal_dropped++;
+        ctx->nal_dropped_bytes += size;
+    }
+    return drop;
+}
+
+void nal_filter_report(V4L2Context *ctx)
+{
+    if (ctx->nal_dropped > 0)
+        LOG("NAL filter: dropped %u NALs, %zu bytes", ctx->nal_dropped, ctx->nal_dropped_bytes);
+}
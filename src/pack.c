@@ -0,0 +1,211 @@
+/*
+ * Multi-picture OUTPUT buffers for VA-API to V4L2 stateful backend
+ *
+ * Small pictures (thumbnails, high frame-rate screen capture) spend more
+ * time in QBUF/DQBUF/poll than in the decoder. When V4L2VA_PACK_FRAMES=N
+ * is set and the decoder parses a continuous bytestream, up to N
+ * consecutive pictures are concatenated into one OUTPUT buffer. A batch is
+ * queued when it is full, when it reaches PACK_MAX_BYTES, when its oldest
+ * picture has waited PACK_MAX_DELAY_MS, or as soon as one of its surfaces
+ * is synced.
+ *
+ * The decoder stamps every frame decoded from a buffer with that buffer's
+ * timestamp, so each batch remembers its surfaces in submission order and
+ * hands them out one per CAPTURE frame. That is only valid without frame
+ * reordering, so packing is limited to VP8 and VP9; pictures that are not
+ * shown (show_frame = 0) produce no CAPTURE frame and are left out.
+ */
+
+#define _GNU_SOURCE
+#include "vabackend.h"
+
+#include <string.h>
+#include <time.h>
+
+#define PACK_MAX_BYTES      (1024 * 1024)
+#define PACK_MAX_DELAY_MS   16
+
+/* A surface whose frame will never arrive: ready, but damaged */
+static void pack_fail_surface(V4L2Surface *surface)
+{
+    if (surface == NULL)
+        return;
+    surface->decoded = true;
+    surface->no_output = true;
+    surface_set_error(surface, VADecodeSliceMissing);
+}
+
+/*
+ * Decide whether a new context packs pictures
+ */
+void pack_init_context(V4L2Context *ctx)
+{
+    uint32_t pixfmt = ctx->codec->v4l2_pixfmt;
+
+    if (v4l2va_options.pack_frames < 2)
+        return;
+
+    if (pixfmt != V4L2_PIX_FMT_VP8 && pixfmt != V4L2_PIX_FMT_VP9) {
+        LOG("Pack: %s may reorder frames, packing disabled", ctx->codec->name);
+        return;
+    }
+
+    if (!(v4l2_format_flags(ctx->drv, pixfmt) & V4L2_FMT_FLAG_CONTINUOUS_BYTESTREAM)) {
+        LOG("Pack: %s decoder needs one frame per buffer, packing disabled", ctx->codec->name);
+        return;
+    }
+
+    ctx->pack.max_pictures = v4l2va_options.pack_frames < PACK_MAX_PICTURES ?
+                             v4l2va_options.pack_frames : PACK_MAX_PICTURES;
+    LOG("Pack: up to %d %s pictures per OUTPUT buffer", ctx->pack.max_pictures,
+        ctx->codec->name);
+}
+
+/*
+ * Queue the pictures collected so far as one OUTPUT buffer
+ */
+int pack_flush(V4L2Context *ctx)
+{
+    if (ctx->pack.num_pending == 0 && ctx->pack.data.size == 0)
+        return 0;
+
+    /* Find a free in-flight slot; if the decoder sits on too many, give up the oldest */
+    int slot = -1;
+    int oldest = 0;
+    for (int i = 0; i < PACK_MAX_BATCHES; i++) {
+        if (ctx->pack.inflight[i].next >= ctx->pack.inflight[i].count) {
+            slot = i;
+            break;
+        }
+        if (ctx->pack.inflight[i].ts < ctx->pack.inflight[oldest].ts)
+            oldest = i;
+    }
+    if (slot < 0) {
+        slot = oldest;
+        for (int i = ctx->pack.inflight[slot].next; i < ctx->pack.inflight[slot].count; i++)
+            pack_fail_surface(ctx->pack.inflight[slot].surfaces[i]);
+        LOG("Pack: dropped stale batch %llu", (unsigned long long)ctx->pack.inflight[slot].ts);
+    }
+
+    int ret = 0;
+    bool queued = false;
+    if (ctx->pack.data.size > 0) {
+        ret = v4l2_queue_bitstream(ctx, ctx->pack.data.data, ctx->pack.data.size,
+                                   ctx->pack.pending_ts);
+        queued = ret == 0;
+    }
+
+    if (!queued) {
+        for (int i = 0; i < ctx->pack.num_pending; i++)
+            pack_fail_surface(ctx->pack.pending[i]);
+        ctx->pack.inflight[slot].count = 0;
+        ctx->pack.inflight[slot].next = 0;
+    } else {
+        memcpy(ctx->pack.inflight[slot].surfaces, ctx->pack.pending,
+               ctx->pack.num_pending * sizeof(V4L2Surface *));
+        ctx->pack.inflight[slot].count = ctx->pack.num_pending;
+        ctx->pack.inflight[slot].next = 0;
+        ctx->pack.inflight[slot].ts = ctx->pack.pending_ts;
+    }
+
+    bitstream_reset(&ctx->pack.data);
+    ctx->pack.num_pending = 0;
+    return ret;
+}
+
+/*
+ * Add the current picture (ctx->bitstream) to the open batch, queueing the
+ * batch once it hits one of its limits
+ */
+int pack_add(V4L2Context *ctx, V4L2Surface *surface)
+{
+    /* Stream start needs a buffer queued to get SOURCE_CHANGE; send it alone */
+    bool start = !ctx->streaming_output;
+
+    if (ctx->pack.num_pending == 0 && ctx->pack.data.size == 0) {
+        ctx->pack.pending_ts = ctx->picture_seq;
+        clock_gettime(CLOCK_MONOTONIC, &ctx->pack.first);
+    }
+
+    if (ctx->bitstream.size > 0)
+        bitstream_append(&ctx->pack.data, ctx->bitstream.data, ctx->bitstream.size);
+
+    if (surface != NULL) {
+        if (ctx->show_frame) {
+            ctx->pack.pending[ctx->pack.num_pending++] = surface;
+        } else {
+            /* Hidden frame: decoded as a reference, never output */
+            surface->decoded = true;
+            surface->no_output = true;
+        }
+    }
+
+    if (start || ctx->pack.num_pending >= ctx->pack.max_pictures ||
+        ctx->pack.data.size >= PACK_MAX_BYTES ||
+        ms_since(&ctx->pack.first) >= PACK_MAX_DELAY_MS)
+        return pack_flush(ctx);
+
+    return 0;
+}
+
+/*
+ * True if the surface's picture is still waiting in the open batch
+ */
+bool pack_pending(const V4L2Context *ctx, const V4L2Surface *surface)
+{
+    for (int i = 0; i < ctx->pack.num_pending; i++) {
+        if (ctx->pack.pending[i] == surface)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Surface for the next CAPTURE frame carrying this OUTPUT timestamp.
+ * Returns NULL if the frame belongs to no known picture.
+ */
+V4L2Surface *pack_take(V4L2Context *ctx, uint64_t ts)
+{
+    for (int i = 0; i < PACK_MAX_BATCHES; i++) {
+        if (ctx->pack.inflight[i].next < ctx->pack.inflight[i].count &&
+            ctx->pack.inflight[i].ts == ts)
+            return ctx->pack.inflight[i].surfaces[ctx->pack.inflight[i].next++];
+    }
+    return NULL;
+}
+
+/*
+ * A surface is being destroyed; make sure no batch points at it
+ */
+void pack_forget(V4L2Context *ctx, const V4L2Surface *surface)
+{
+    for (int i = 0; i < ctx->pack.num_pending; i++) {
+        if (ctx->pack.pending[i] == surface)
+            ctx->pack.pending[i] = NULL;
+    }
+    for (int i = 0; i < PACK_MAX_BATCHES; i++) {
+        for (int j = 0; j < ctx->pack.inflight[i].count; j++) {
+            if (ctx->pack.inflight[i].surfaces[j] == surface)
+                ctx->pack.inflight[i].surfaces[j] = NULL;
+        }
+    }
+}
+
+/*
+ * The decoder dropped everything in flight (flush, suspend, teardown).
+ * Pictures still waiting on it will never come out.
+ */
+void pack_reset(V4L2Context *ctx)
+{
+    for (int i = 0; i < ctx->pack.num_pending; i++)
+        pack_fail_surface(ctx->pack.pending[i]);
+    ctx->pack.num_pending = 0;
+    bitstream_reset(&ctx->pack.data);
+
+    for (int i = 0; i < PACK_MAX_BATCHES; i++) {
+        for (int j = ctx->pack.inflight[i].next; j < ctx->pack.inflight[i].count; j++)
+            pack_fail_surface(ctx->pack.inflight[i].surfaces[j]);
+        ctx->pack.inflight[i].count = 0;
+        ctx->pack.inflight[i].next = 0;
+    }
+}
@@ -0,0 +1,213 @@
+/*
+ * Asynchronous image readback for VA-API to V4L2 stateful backend
+ *
+ * vaGetImage copies a whole frame on the caller's thread, and a player
+ * that decodes and reads back on one thread waits for that copy before it
+ * can submit the next picture: the VPU sits idle while the CPU copies.
+ *
+ * With V4L2VA_ASYNC_GETIMAGE=1, vaGetImage only queues the copy for a
+ * driver worker and returns. The copy has finished once vaSyncBuffer on
+ * the image's buffer returns, and vaMapBuffer, vaDestroyImage and reading
+ * the image through any other call wait for it implicitly.
+ *
+ * The frame being read must stay put until the copy is done, so rendering
+ * into the surface again, destroying it and releasing its context's
+ * queues all wait for the surface's pending copies. Jobs run in
+ * submission order; each has a sequence number, and waiting for a job
+ * means waiting until the completed count has passed it.
+ */
+
+#define _GNU_SOURCE
+#include "vabackend.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/dma-buf.h>
+
+#define READBACK_QUEUE_DEPTH    8
+
+typedef struct {
+    V4L2Context     *ctx;
+    V4L2Buffer      *image;
+    uint8_t         *base0;
+    uint8_t         *base1;
+    int             capture_idx;    /* -1: copying from the frame cache */
+    uint32_t        pitches[2];
+    uint32_t        offsets[2];
+} V4L2ReadbackJob;
+
+struct V4L2Readback {
+    V4L2ReadbackJob jobs[READBACK_QUEUE_DEPTH];
+    uint64_t        submitted;      /* Sequence number of the last job queued */
+    uint64_t        completed;      /* Sequence number of the last job done */
+    bool            stop;
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;           /* Jobs queued, jobs done, or stop */
+};
+
+static void *readback_thread(void *arg)
+{
+    struct V4L2Readback *rb = arg;
+
+    pthread_mutex_lock(&rb->mutex);
+    for (;;) {
+        while (rb->completed == rb->submitted && !rb->stop)
+            pthread_cond_wait(&rb->cond, &rb->mutex);
+        if (rb->completed == rb->submitted)
+            break;
+
+        V4L2ReadbackJob job = rb->jobs[(rb->completed + 1) % READBACK_QUEUE_DEPTH];
+        pthread_mutex_unlock(&rb->mutex);
+
+        if (job.capture_idx >= 0)
+            v4l2_capture_begin_cpu(job.ctx, job.capture_idx, DMA_BUF_SYNC_READ);
+        int ret = surface_copy_frame(job.ctx, job.base0, job.base1, job.image->data,
+                                     job.pitches, job.offsets,
+                                     job.image->element_size, job.image->height);
+        if (job.capture_idx >= 0)
+            v4l2_capture_end_cpu(job.ctx, job.capture_idx, DMA_BUF_SYNC_READ);
+        if (ret < 0)
+            LOG("Readback: cannot copy CAPTURE format %.4s",
+                (char *)&job.ctx->capture_fmt.pixelformat);
+
+        pthread_mutex_lock(&rb->mutex);
+        job.image->readback_status = ret < 0 ? VA_STATUS_ERROR_OPERATION_FAILED : VA_STATUS_SUCCESS;
+        rb->completed++;
+        pthread_cond_broadcast(&rb->cond);
+    }
+    pthread_mutex_unlock(&rb->mutex);
+    return NULL;
+}
+
+/*
+ * Start the readback worker (no-op unless V4L2VA_ASYNC_GETIMAGE is set)
+ */
+void readback_start(V4L2Device *dev)
+{
+    if (!v4l2va_options.async_getimage)
+        return;
+
+    struct V4L2Readback *rb = calloc(1, sizeof(*rb));
+    if (rb == NULL)
+        return;
+
+    pthread_mutex_init(&rb->mutex, NULL);
+    pthread_cond_init(&rb->cond, NULL);
+    if (pthread_create(&rb->thread, NULL, readback_thread, rb) != 0) {
+        LOG("Readback: cannot start worker thread, vaGetImage stays synchronous");
+        pthread_cond_destroy(&rb->cond);
+        pthread_mutex_destroy(&rb->mutex);
+        free(rb);
+        return;
+    }
+    dev->readback = rb;
+    LOG("Readback: vaGetImage copies asynchronously");
+}
+
+/* Finish the queued copies and stop the worker */
+void readback_stop(V4L2Device *dev)
+{
+    struct V4L2Readback *rb = dev->readback;
+
+    if (rb == NULL)
+        return;
+
+    pthread_mutex_lock(&rb->mutex);
+    rb->stop = true;
+    pthread_cond_broadcast(&rb->cond);
+    pthread_mutex_unlock(&rb->mutex);
+
+    pthread_join(rb->thread, NULL);
+    pthread_cond_destroy(&rb->cond);
+    pthread_mutex_destroy(&rb->mutex);
+    free(rb);
+    dev->readback = NULL;
+}
+
+/*
+ * Queue a copy of a decoded frame into an image. The sequence number is
+ * recorded in the image, the surface and the context, for readback_wait.
+ * Waits for room if READBACK_QUEUE_DEPTH copies are already queued.
+ */
+void readback_queue(V4L2Device *dev, V4L2Context *ctx, V4L2Surface *surface,
+                    V4L2Buffer *image, uint8_t *base0, uint8_t *base1, int capture_idx,
+                    const uint32_t pitches[2], const uint32_t offsets[2])
+{
+    struct V4L2Readback *rb = dev->readback;
+
+    pthread_mutex_lock(&rb->mutex);
+    while (rb->submitted - rb->completed >= READBACK_QUEUE_DEPTH)
+        pthread_cond_wait(&rb->cond, &rb->mutex);
+
+    uint64_t seq = ++rb->submitted;
+    V4L2ReadbackJob *job = &rb->jobs[seq % READBACK_QUEUE_DEPTH];
+    job->ctx = ctx;
+    job->image = image;
+    job->base0 = base0;
+    job->base1 = base1;
+    job->capture_idx = capture_idx;
+    for (int p = 0; p < 2; p++) {
+        job->pitches[p] = pitches[p];
+        job->offsets[p] = offsets[p];
+    }
+
+    image->readback_seq = seq;
+    image->readback_status = VA_STATUS_SUCCESS;
+    surface->readback_seq = seq;
+    ctx->readback_seq = seq;
+
+    pthread_cond_broadcast(&rb->cond);
+    pthread_mutex_unlock(&rb->mutex);
+}
+
+/*
+ * Wait until the copy with this sequence number (and every one before it)
+ * is done. timeout_ns is VA_TIMEOUT_INFINITE or a limit for vaSyncBuffer.
+ */
+VAStatus readback_wait(V4L2Device *dev, uint64_t seq, uint64_t timeout_ns)
+{
+    struct V4L2Readback *rb = dev->readback;
+    VAStatus status = VA_STATUS_SUCCESS;
+
+    if (rb == NULL || seq == 0)
+        return VA_STATUS_SUCCESS;
+
+    struct timespec deadline;
+    if (timeout_ns != VA_TIMEOUT_INFINITE) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ns / 1000000000;
+        deadline.tv_nsec += timeout_ns % 1000000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&rb->mutex);
+    while (rb->completed < seq) {
+        if (timeout_ns == VA_TIMEOUT_INFINITE) {
+            pthread_cond_wait(&rb->cond, &rb->mutex);
+        } else if (pthread_cond_timedwait(&rb->cond, &rb->mutex, &deadline) == ETIMEDOUT) {
+            status = VA_STATUS_ERROR_TIMEDOUT;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rb->mutex);
+    return status;
+}
+
+/* Has the copy with this sequence number finished? Never waits. */
+bool readback_done(V4L2Device *dev, uint64_t seq)
+{
+    struct V4L2Readback *rb = dev->readback;
+
+    if (rb == NULL || seq == 0)
+        return true;
+
+    pthread_mutex_lock(&rb->mutex);
+    bool done = rb->completed >= seq;
+    pthread_mutex_unlock(&rb->mutex);
+    return done;
+}
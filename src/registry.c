@@ -0,0 +1,117 @@
+/*
+ * Process-wide device registry for VA-API to V4L2 stateful backend
+ *
+ * libva runs __vaDriverInit_1_0 with a fresh V4L2Driver for every
+ * vaInitialize, and processes that open many displays (a browser GPU
+ * process, a GStreamer pipeline with several vaapi elements, a service
+ * with a display per stream) used to probe the decoder, size a memory
+ * budget and build image and buffer pools once per display.
+ *
+ * All of that now lives in one V4L2Device per process. The first display
+ * probes the decoder and sets up the shared state; later displays take a
+ * reference and copy the probe results; the last one to terminate tears
+ * it down. The memory budget therefore covers every display, as the CMA
+ * pool it protects does. Configs, contexts, surfaces and buffers stay in
+ * each display's own tables and IDs.
+ */
+
+#include "vabackend.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static V4L2Device *registry_device;
+
+static void copy_probe(V4L2Driver *drv, const V4L2Device *dev)
+{
+    memcpy(drv->v4l2_device, dev->v4l2_device, sizeof(drv->v4l2_device));
+    memcpy(drv->supported_profiles, dev->supported_profiles, sizeof(drv->supported_profiles));
+    drv->num_supported_profiles = dev->num_supported_profiles;
+    memcpy(drv->output_formats, dev->output_formats, sizeof(drv->output_formats));
+    drv->num_output_formats = dev->num_output_formats;
+}
+
+/* Probe the decoder through drv and set up the shared state; NULL on failure */
+static V4L2Device *device_create(V4L2Driver *drv)
+{
+    int fd = v4l2_open_device(drv);
+    if (fd < 0)
+        return NULL;
+
+    v4l2_probe_capabilities(drv, fd);
+    v4l2_close_device(drv, fd);
+
+    if (drv->num_supported_profiles == 0) {
+        LOG("No supported profiles found");
+        return NULL;
+    }
+
+    V4L2Device *dev = calloc(1, sizeof(V4L2Device));
+    if (dev == NULL)
+        return NULL;
+
+    memcpy(dev->v4l2_device, drv->v4l2_device, sizeof(dev->v4l2_device));
+    memcpy(dev->supported_profiles, drv->supported_profiles, sizeof(dev->supported_profiles));
+    dev->num_supported_profiles = drv->num_supported_profiles;
+    memcpy(dev->output_formats, drv->output_formats, sizeof(dev->output_formats));
+    dev->num_output_formats = drv->num_output_formats;
+
+    pthread_mutex_init(&dev->spare_mutex, NULL);
+    mem_init(dev);
+    image_pool_init(dev);
+    readback_start(dev);
+    return dev;
+}
+
+static void device_destroy(V4L2Device *dev)
+{
+    readback_stop(dev);
+    image_pool_destroy(dev);
+    buffer_spares_free(dev);
+    pthread_mutex_destroy(&dev->spare_mutex);
+    free(dev);
+}
+
+/*
+ * Attach a new display to the process-wide device, creating it for the
+ * first one. Returns -1 if there is no usable decoder.
+ */
+int registry_acquire(V4L2Driver *drv)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (registry_device == NULL) {
+        registry_device = device_create(drv);
+        if (registry_device == NULL) {
+            pthread_mutex_unlock(&registry_lock);
+            return -1;
+        }
+    } else {
+        copy_probe(drv, registry_device);
+        LOG("Registry: sharing %s with %d other display(s)",
+            registry_device->v4l2_device, registry_device->refs);
+    }
+    registry_device->refs++;
+    drv->dev = registry_device;
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+
+/*
+ * Detach a terminating display. Its objects must be gone already.
+ */
+void registry_release(V4L2Driver *drv)
+{
+    V4L2Device *dev = drv->dev;
+
+    if (dev == NULL)
+        return;
+
+    pthread_mutex_lock(&registry_lock);
+    if (--dev->refs == 0) {
+        device_destroy(dev);
+        registry_device = NULL;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    drv->dev = NULL;
+}
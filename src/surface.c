@@ -8,8 +8,181 @@
 
 #include "vabackend.h"
 #include <string.h>
+#include <linux/dma-buf.h>
 
 /*
- * Additional surface utility functions can be added here.
- * The main surface management is in vabackend.c for now.
+ * Per-surface decode error state, reported through vaQuerySurfaceError.
+ * V4L2 does not tell us which macroblocks were damaged, so an error
+ * always covers the whole picture.
  */
+void surface_clear_error(V4L2Surface *surface)
+{
+    surface->decode_status = VA_STATUS_SUCCESS;
+    memset(surface->mb_errors, 0, sizeof(surface->mb_errors));
+    surface->mb_errors[0].status = -1;
+}
+
+void surface_set_error(V4L2Surface *surface, VADecodeErrorType type)
+{
+    uint32_t num_mb = ((surface->width + 15) / 16) * ((surface->height + 15) / 16);
+
+    surface->decode_status = VA_STATUS_ERROR_DECODING_ERROR;
+    memset(surface->mb_errors, 0, sizeof(surface->mb_errors));
+    surface->mb_errors[0].status = 1;
+    surface->mb_errors[0].start_mb = 0;
+    surface->mb_errors[0].end_mb = num_mb ? num_mb - 1 : 0;
+    surface->mb_errors[0].decode_error_type = type;
+    surface->mb_errors[0].num_mb = num_mb;
+    surface->mb_errors[1].status = -1;
+}
+
+/* Plane layout of a frame in the CAPTURE format, wherever its planes live */
+static int frame_layout(const V4L2Context *ctx, uint8_t *base0, uint8_t *base1,
+                        V4L2FrameLayout *layout)
+{
+    const struct v4l2_pix_format_mplane *fmt = &ctx->capture_fmt;
+    uint32_t pitch0 = fmt->plane_fmt[0].bytesperline;
+    uint32_t pitch1 = fmt->num_planes > 1 ? fmt->plane_fmt[1].bytesperline : pitch0;
+    uint32_t w = ctx->visible_width;
+    uint32_t h = ctx->visible_height;
+
+    memset(layout, 0, sizeof(*layout));
+    layout->fourcc = fmt->pixelformat;
+
+    switch (fmt->pixelformat) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+    case V4L2_PIX_FMT_P010:
+        {
+            uint32_t bpp = fmt->pixelformat == V4L2_PIX_FMT_P010 ? 2 : 1;
+            layout->num_planes = 2;
+            layout->data[0] = base0;
+            layout->pitch[0] = pitch0;
+            layout->width[0] = w * bpp;
+            layout->height[0] = h;
+            /* Contiguous formats keep interleaved chroma after the full luma plane */
+            layout->data[1] = (fmt->num_planes > 1 && base1) ? base1 :
+                              base0 + (size_t)pitch0 * fmt->height;
+            layout->pitch[1] = pitch1;
+            layout->width[1] = ((w + 1) / 2) * 2 * bpp;
+            layout->height[1] = (h + 1) / 2;
+        }
+        break;
+    case V4L2_PIX_FMT_YUV420:
+        {
+            uint32_t cpitch = pitch0 / 2;
+            uint8_t *u = base0 + (size_t)pitch0 * fmt->height;
+            layout->num_planes = 3;
+            layout->data[0] = base0;
+            layout->pitch[0] = pitch0;
+            layout->width[0] = w;
+            layout->height[0] = h;
+            layout->data[1] = u;
+            layout->data[2] = u + (size_t)cpitch * ((fmt->height + 1) / 2);
+            for (int p = 1; p < 3; p++) {
+                layout->pitch[p] = cpitch;
+                layout->width[p] = (w + 1) / 2;
+                layout->height[p] = (h + 1) / 2;
+            }
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Describe the visible part of a decoded frame in a CAPTURE buffer as
+ * colour planes the CPU can walk row by row. Maps the buffer if needed.
+ * Returns -1 for unmappable buffers or pixel formats we cannot describe.
+ */
+int surface_frame_layout(V4L2Context *ctx, int capture_idx, V4L2FrameLayout *layout)
+{
+    if (v4l2_map_capture(ctx, capture_idx) < 0)
+        return -1;
+
+    V4L2MmapBuffer *cap_buf = &ctx->capture_buffers[capture_idx];
+    return frame_layout(ctx, cap_buf->plane0_ptr, cap_buf->plane1_ptr, layout);
+}
+
+/*
+ * Copy a decoded frame, laid out in the CAPTURE format, into a two-plane
+ * NV12 or P010 image (dst of size bytes, with the given pitches and plane
+ * offsets, height rows). Planar YUV420 is interleaved and tiled layouts
+ * are detiled on the way; any other mismatch between the CAPTURE format
+ * and the image is the caller's to reject.
+ */
+int surface_copy_frame(V4L2Context *ctx, uint8_t *base0, uint8_t *base1, uint8_t *dst,
+                       const uint32_t pitches[2], const uint32_t offsets[2],
+                       size_t size, uint32_t height)
+{
+    V4L2FrameLayout layout;
+
+    if (detile_bpp(ctx->capture_fmt.pixelformat))
+        return detile_frame(ctx, base0, base1, dst, pitches, offsets, size, height);
+
+    if (dst == NULL || frame_layout(ctx, base0, base1, &layout) < 0)
+        return -1;
+
+    for (int p = 0; p < 2; p++) {
+        uint8_t *row = dst + offsets[p];
+        uint32_t pitch = pitches[p];
+        uint32_t rows = p == 0 ? height : (height + 1) / 2;
+        uint32_t width = layout.num_planes == 3 && p == 1 ? layout.width[1] * 2 : layout.width[p];
+
+        if (rows > layout.height[p])
+            rows = layout.height[p];
+        if (width > pitch)
+            width = pitch;
+        if (offsets[p] + (size_t)pitch * (rows ? rows - 1 : 0) + width > size)
+            return -1;
+
+        for (uint32_t y = 0; y < rows; y++, row += pitch) {
+            if (layout.num_planes == 2 || p == 0) {
+                memcpy(row, layout.data[p] + (size_t)y * layout.pitch[p], width);
+                continue;
+            }
+            const uint8_t *u = layout.data[1] + (size_t)y * layout.pitch[1];
+            const uint8_t *v = layout.data[2] + (size_t)y * layout.pitch[2];
+            for (uint32_t x = 0; x < width / 2; x++) {
+                row[2 * x] = u[x];
+                row[2 * x + 1] = v[x];
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Same, into the application memory behind a user-pointer surface */
+int surface_write_user(V4L2Context *ctx, V4L2Surface *surface, uint8_t *base0, uint8_t *base1)
+{
+    return surface_copy_frame(ctx, base0, base1, surface->user_ptr, surface->user_pitches,
+                              surface->user_offsets, surface->user_size, surface->height);
+}
+
+/*
+ * A frame came out for a user-pointer surface: copy it out and give the
+ * CAPTURE buffer straight back to the decoder. Called from the dequeue
+ * path with ctx->mutex held.
+ */
+void surface_deliver_user(V4L2Context *ctx, V4L2Surface *surface, int capture_idx)
+{
+    if (v4l2_map_capture(ctx, capture_idx) < 0) {
+        surface_set_error(surface, VADecodeMBError);
+    } else {
+        V4L2MmapBuffer *cap_buf = &ctx->capture_buffers[capture_idx];
+
+        v4l2_capture_begin_cpu(ctx, capture_idx, DMA_BUF_SYNC_READ);
+        if (surface_write_user(ctx, surface, cap_buf->plane0_ptr, cap_buf->plane1_ptr) < 0) {
+            LOG("Cannot copy CAPTURE buffer %d into user surface", capture_idx);
+            surface_set_error(surface, VADecodeMBError);
+        }
+        v4l2_capture_end_cpu(ctx, capture_idx, DMA_BUF_SYNC_READ);
+    }
+
+    surface->capture_idx = -1;
+    v4l2_requeue_capture(ctx, capture_idx);
+}
@@ -21,6 +21,7 @@
 #include <sys/mman.h>
 #include <poll.h>
 #include <linux/videodev2.h>
+#include <linux/dma-buf.h>
 
 /* CIX Sky1 VPU fourcc values */
 #define V4L2_PIX_FMT_AV1  v4l2_fourcc('A', 'V', '0', '1')
@@ -87,7 +88,14 @@ int v4l2_probe_capabilities(V4L2Driver *drv, int fd)
     fmtdesc.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 
     while (ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
-        LOG("Found V4L2 format: %s (0x%08x)", fmtdesc.description, fmtdesc.pixelformat);
+        LOG("Found V4L2 format: %s (0x%08x, flags 0x%x)", fmtdesc.description,
+            fmtdesc.pixelformat, fmtdesc.flags);
+
+        if (drv->num_output_formats < MAX_PROFILES) {
+            drv->output_formats[drv->num_output_formats].pixfmt = fmtdesc.pixelformat;
+            drv->output_formats[drv->num_output_formats].flags = fmtdesc.flags;
+            drv->num_output_formats++;
+        }
 
         /* Map V4L2 formats to VA-API profiles */
         switch (fmtdesc.pixelformat) {
@@ -129,6 +137,74 @@ int v4l2_probe_capabilities(V4L2Driver *drv, int fd)
     return 0;
 }
 
+/*
+ * V4L2_FMT_FLAG_* the decoder reported for a compressed format (0 if unknown)
+ */
+uint32_t v4l2_format_flags(const V4L2Driver *drv, uint32_t pixfmt)
+{
+    for (int i = 0; i < drv->num_output_formats; i++) {
+        if (drv->output_formats[i].pixfmt == pixfmt)
+            return drv->output_formats[i].flags;
+    }
+    return 0;
+}
+
+/*
+ * Ask the decoder to output every frame as soon as it is decoded instead of
+ * holding it back for display reordering. Uses the generic controls and
+ * falls back to the older MFC-style H.264 ones.
+ */
+static void v4l2_set_low_latency(V4L2Context *ctx)
+{
+    static const uint32_t cids[][2] = {
+        { V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY_ENABLE, V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY },
+        { V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY_ENABLE,
+          V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY },
+    };
+
+    for (size_t i = 0; i < sizeof(cids) / sizeof(cids[0]); i++) {
+        struct v4l2_control ctrl;
+        memset(&ctrl, 0, sizeof(ctrl));
+        ctrl.id = cids[i][0];
+        ctrl.value = 1;
+        if (ioctl(ctx->v4l2_fd, VIDIOC_S_CTRL, &ctrl) < 0)
+            continue;
+
+        ctrl.id = cids[i][1];
+        ctrl.value = 0;
+        if (ioctl(ctx->v4l2_fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+            LOG("Failed to set display delay: %s", strerror(errno));
+            continue;
+        }
+
+        LOG("Low latency: display delay disabled (decode-order output)");
+        return;
+    }
+
+    LOG("Low latency: decoder has no display delay control, using shallow queues only");
+}
+
+/*
+ * REQBUFS, retrying with fewer buffers while the allocator (usually CMA)
+ * is out of memory; a smaller queue beats a context that fails to start.
+ */
+static int v4l2_reqbufs(V4L2Context *ctx, struct v4l2_requestbuffers *reqbufs,
+                        unsigned int minimum)
+{
+    uint32_t flags = reqbufs->flags;
+
+    while (ioctl(ctx->v4l2_fd, VIDIOC_REQBUFS, reqbufs) < 0) {
+        if (errno != ENOMEM || reqbufs->count <= minimum)
+            return -1;
+
+        unsigned int count = (reqbufs->count + minimum) / 2;
+        LOG("Out of memory for %u buffers, retrying with %u", reqbufs->count, count);
+        reqbufs->count = count;
+        reqbufs->flags = flags;
+    }
+    return 0;
+}
+
 /*
  * Setup OUTPUT queue (compressed bitstream input)
  */
@@ -175,19 +251,43 @@ int v4l2_setup_output_queue(V4L2Context *ctx)
 
     LOG("OUTPUT format set successfully");
 
-    /* Request OUTPUT buffers */
+    if (ctx->low_latency)
+        v4l2_set_low_latency(ctx);
+
+    return v4l2_alloc_output_buffers(ctx);
+}
+
+/*
+ * Allocate and map OUTPUT buffers for the format already set, as many as
+ * the memory budget allows. Also brings the queue back after
+ * v4l2_release_output_queue.
+ */
+int v4l2_alloc_output_buffers(V4L2Context *ctx)
+{
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    if (ioctl(ctx->v4l2_fd, VIDIOC_G_FMT, &fmt) < 0) {
+        LOG("Failed to get OUTPUT format: %s", strerror(errno));
+        return -1;
+    }
+
+    size_t output_size = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+    int output_count = ctx->low_latency ? LOW_LATENCY_OUTPUT_BUFFERS : MAX_OUTPUT_BUFFERS;
     struct v4l2_requestbuffers reqbufs;
     memset(&reqbufs, 0, sizeof(reqbufs));
-    reqbufs.count = MAX_OUTPUT_BUFFERS;
+    reqbufs.count = mem_fit(ctx, "OUTPUT", output_count, LOW_LATENCY_OUTPUT_BUFFERS, output_size);
     reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
     reqbufs.memory = V4L2_MEMORY_MMAP;
 
-    if (ioctl(ctx->v4l2_fd, VIDIOC_REQBUFS, &reqbufs) < 0) {
+    if (v4l2_reqbufs(ctx, &reqbufs, 1) < 0) {
         LOG("Failed to request OUTPUT buffers: %s", strerror(errno));
         return -1;
     }
 
     ctx->num_output_buffers = reqbufs.count;
+    ctx->mem_output = (size_t)reqbufs.count * output_size;
+    mem_charge(ctx->drv->dev, ctx->mem_output);
     LOG("Allocated %d OUTPUT buffers", ctx->num_output_buffers);
 
     /* mmap OUTPUT buffers */
@@ -217,13 +317,29 @@ int v4l2_setup_output_queue(V4L2Context *ctx)
 
         if (ctx->output_buffers[i].start == MAP_FAILED) {
             LOG("Failed to mmap OUTPUT buffer %d: %s", i, strerror(errno));
+            ctx->output_buffers[i].start = NULL;
             return -1;
         }
+        atomic_fetch_add(&ctx->drv->mapped_bytes, ctx->output_buffers[i].length);
     }
 
     return 0;
 }
 
+/*
+ * Non-coherent CAPTURE buffers skip the kernel's cache maintenance on every
+ * QBUF/DQBUF: the CPU never writes them, and readers invalidate just the
+ * buffers they touch (v4l2_capture_begin_cpu).
+ */
+static uint32_t v4l2_capture_qbuf_flags(const V4L2Context *ctx)
+{
+#ifdef V4L2_MEMORY_FLAG_NON_COHERENT
+    if (ctx->capture_noncoherent)
+        return V4L2_BUF_FLAG_NO_CACHE_INVALIDATE | V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+#endif
+    return 0;
+}
+
 /*
  * Setup CAPTURE queue (decoded frame output)
  */
@@ -249,23 +365,85 @@ int v4l2_setup_capture_queue(V4L2Context *ctx)
     } else {
         LOG("Got CAPTURE format: %dx%d pixfmt=0x%08x",
             fmt.fmt.pix_mp.width, fmt.fmt.pix_mp.height, fmt.fmt.pix_mp.pixelformat);
+        format_negotiate(ctx, &fmt);
+    }
+
+    ctx->capture_fmt = fmt.fmt.pix_mp;
+
+    /* Visible rectangle inside the (aligned) coded frame */
+    struct v4l2_selection sel;
+    memset(&sel, 0, sizeof(sel));
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_COMPOSE;
+    if (ioctl(ctx->v4l2_fd, VIDIOC_G_SELECTION, &sel) == 0 &&
+        sel.r.width > 0 && sel.r.height > 0) {
+        ctx->visible_width = sel.r.width;
+        ctx->visible_height = sel.r.height;
+    } else {
+        ctx->visible_width = ctx->width;
+        ctx->visible_height = ctx->height;
     }
+    if (ctx->visible_width > ctx->capture_fmt.width)
+        ctx->visible_width = ctx->capture_fmt.width;
+    if (ctx->visible_height > ctx->capture_fmt.height)
+        ctx->visible_height = ctx->capture_fmt.height;
+
+    /* The decoder's references plus one frame for the application */
+    int capture_min = CAPTURE_MIN_BUFFERS;
+    struct v4l2_control ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.id = V4L2_CID_MIN_BUFFERS_FOR_CAPTURE;
+    bool have_min = ioctl(ctx->v4l2_fd, VIDIOC_G_CTRL, &ctrl) == 0 && ctrl.value > 0 &&
+                    ctrl.value < MAX_CAPTURE_BUFFERS;
+    if (have_min)
+        capture_min = ctrl.value + 1;
+
+    /* Low latency: only what the decoder needs plus a few held by the application */
+    int capture_count = MAX_CAPTURE_BUFFERS;
+    if (ctx->low_latency && have_min &&
+        ctrl.value + LOW_LATENCY_CAPTURE_EXTRA < MAX_CAPTURE_BUFFERS) {
+        capture_count = ctrl.value + LOW_LATENCY_CAPTURE_EXTRA;
+        LOG("Low latency: %d CAPTURE buffers (decoder minimum %d)",
+            capture_count, ctrl.value);
+    }
+
+    size_t capture_size = 0;
+    for (int p = 0; p < ctx->capture_fmt.num_planes && p < VIDEO_MAX_PLANES; p++)
+        capture_size += ctx->capture_fmt.plane_fmt[p].sizeimage;
+    capture_count = mem_fit(ctx, "CAPTURE", capture_count, capture_min, capture_size);
 
     /* Request CAPTURE buffers with DMABUF export */
     struct v4l2_requestbuffers reqbufs;
     memset(&reqbufs, 0, sizeof(reqbufs));
-    reqbufs.count = MAX_CAPTURE_BUFFERS;
+    reqbufs.count = capture_count;
     reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
     reqbufs.memory = V4L2_MEMORY_MMAP;
+#ifdef V4L2_MEMORY_FLAG_NON_COHERENT
+    if (v4l2va_options.cached_capture)
+        reqbufs.flags = V4L2_MEMORY_FLAG_NON_COHERENT;
+#endif
 
-    if (ioctl(ctx->v4l2_fd, VIDIOC_REQBUFS, &reqbufs) < 0) {
+    if (v4l2_reqbufs(ctx, &reqbufs, capture_min) < 0) {
         LOG("Failed to request CAPTURE buffers: %s", strerror(errno));
         return -1;
     }
 
     ctx->num_capture_buffers = reqbufs.count;
+    ctx->mem_capture = (size_t)reqbufs.count * capture_size;
+    mem_charge(ctx->drv->dev, ctx->mem_capture);
     LOG("Allocated %d CAPTURE buffers", ctx->num_capture_buffers);
 
+    /* The flag comes back cleared if the queue cannot honour it */
+    ctx->capture_noncoherent = false;
+#ifdef V4L2_MEMORY_FLAG_NON_COHERENT
+    if (v4l2va_options.cached_capture) {
+        ctx->capture_noncoherent = (reqbufs.capabilities & V4L2_BUF_CAP_SUPPORTS_MMAP_CACHE_HINTS) &&
+                                   (reqbufs.flags & V4L2_MEMORY_FLAG_NON_COHERENT);
+        LOG("CAPTURE buffers are %s", ctx->capture_noncoherent ?
+            "non-coherent, CPU access is cached" : "coherent (cache hints not supported)");
+    }
+#endif
+
     /* Queue all CAPTURE buffers */
     for (int i = 0; i < ctx->num_capture_buffers; i++) {
         struct v4l2_buffer buf;
@@ -286,10 +464,12 @@ int v4l2_setup_capture_queue(V4L2Context *ctx)
 
         ctx->capture_buffers[i].index = i;
         ctx->capture_buffers[i].fd = -1;
+        ctx->capture_buffers[i].plane1_fd = -1;
         ctx->capture_buffers[i].queued = false;
 
         /* Queue the buffer */
         buf.index = i;
+        buf.flags = v4l2_capture_qbuf_flags(ctx);
         if (ioctl(ctx->v4l2_fd, VIDIOC_QBUF, &buf) < 0) {
             LOG("Failed to queue CAPTURE buffer %d: %s", i, strerror(errno));
         } else {
@@ -334,10 +514,25 @@ static void v4l2_reclaim_output_buffers(V4L2Context *ctx)
     }
 }
 
+/*
+ * Number of OUTPUT buffers the decoder has not consumed yet
+ */
+int v4l2_output_backlog(V4L2Context *ctx)
+{
+    int queued = 0;
+
+    v4l2_reclaim_output_buffers(ctx);
+    for (int i = 0; i < ctx->num_output_buffers; i++) {
+        if (ctx->output_buffers[i].queued)
+            queued++;
+    }
+    return queued;
+}
+
 /*
  * Queue bitstream data for decoding
  */
-int v4l2_queue_bitstream(V4L2Context *ctx, void *data, size_t size)
+int v4l2_queue_bitstream(V4L2Context *ctx, void *data, size_t size, uint64_t timestamp)
 {
     /* First try to reclaim any completed OUTPUT buffers */
     v4l2_reclaim_output_buffers(ctx);
@@ -413,12 +608,18 @@ int v4l2_queue_bitstream(V4L2Context *ctx, void *data, size_t size)
     buf.m.planes = planes;
     planes[0].bytesused = size;
 
+    /* Every buffer of a picture carries the same timestamp, which the decoder copies to CAPTURE */
+    buf.timestamp.tv_sec = timestamp / 1000000;
+    buf.timestamp.tv_usec = timestamp % 1000000;
+
     if (ioctl(ctx->v4l2_fd, VIDIOC_QBUF, &buf) < 0) {
         LOG("Failed to queue OUTPUT buffer: %s", strerror(errno));
         return -1;
     }
 
     outbuf->queued = true;
+    latency_submitted(ctx, timestamp);
+    dump_write(ctx->dump, data, size);
 
     /* Start OUTPUT streaming if not already */
     if (!ctx->streaming_output) {
@@ -430,6 +631,10 @@ int v4l2_queue_bitstream(V4L2Context *ctx, void *data, size_t size)
         ctx->streaming_output = true;
         LOG("Started OUTPUT streaming");
 
+        /* After an OUTPUT-only suspend the CAPTURE queue kept streaming */
+        if (ctx->streaming_capture)
+            return 0;
+
         /* Wait for SOURCE_CHANGE event to setup CAPTURE queue */
         struct v4l2_event ev;
         int wait_count = 0;
@@ -479,21 +684,22 @@ int v4l2_queue_bitstream(V4L2Context *ctx, void *data, size_t size)
 /*
  * Dequeue decoded frame with poll() for proper waiting
  */
-int v4l2_dequeue_frame(V4L2Context *ctx, V4L2Surface *surface)
+int v4l2_dequeue_frame(V4L2Context *ctx, V4L2Surface *surface, int timeout_ms)
 {
     struct v4l2_buffer buf;
     struct v4l2_plane planes[2];
 
-    /* Use poll() to wait for a decoded frame (up to 500ms) */
+    /* Use poll() to wait for a decoded frame */
     struct pollfd pfd = {
         .fd = ctx->v4l2_fd,
         .events = POLLIN | POLLPRI,
     };
 
-    int ret = poll(&pfd, 1, 500);
+    int ret = latency_poll(ctx, &pfd, timeout_ms);
     if (ret <= 0) {
         if (ret == 0) {
-            LOG("poll() timeout - no frame ready");
+            if (timeout_ms > 0)
+                LOG("poll() timeout - no frame ready");
             return -1;
         }
         LOG("poll() error: %s", strerror(errno));
@@ -515,17 +721,109 @@ int v4l2_dequeue_frame(V4L2Context *ctx, V4L2Surface *surface)
     if (ioctl(ctx->v4l2_fd, VIDIOC_DQBUF, &buf) < 0) {
         if (errno != EAGAIN) {
             LOG("Failed to dequeue CAPTURE buffer: %s", strerror(errno));
+            /* EPIPE is the end-of-stream marker; anything else means a wedged decoder */
+            if (errno != EPIPE)
+                v4l2_resync(ctx, "CAPTURE dequeue failed");
         }
         return -1;
     }
 
+    ctx->capture_buffers[buf.index].queued = false;
+    latency_completed(ctx, (uint64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec);
+
+    /* Frames of pictures replayed from the frame cache were shown already */
+    if (framecache_discard(ctx)) {
+        v4l2_requeue_capture(ctx, buf.index);
+        return v4l2_dequeue_frame(ctx, surface, timeout_ms);
+    }
+
+    /* Packed buffers: the timestamp says which batch, the order which picture */
+    if (ctx->pack.max_pictures > 0) {
+        uint64_t ts = (uint64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+        surface = pack_take(ctx, ts);
+    }
+    if (surface == NULL) {
+        LOG("CAPTURE buffer %d has no surface waiting for it, returning it", buf.index);
+        v4l2_requeue_capture(ctx, buf.index);
+        return -1;
+    }
+
     surface->capture_idx = buf.index;
     surface->decoded = true;
-    ctx->capture_buffers[buf.index].queued = false;
+    ctx->recovery.have_output = true;
+    ctx->recovery.timeouts = 0;
+
+    if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+        LOG("CAPTURE buffer %d flagged as corrupted by decoder", buf.index);
+        surface_set_error(surface, VADecodeMBError);
+    }
+
+    if (v4l2va_options.checksum != CHECKSUM_NONE)
+        checksum_frame(ctx, buf.index);
+    framecache_store(ctx, surface, buf.index);
+    if (surface->user_ptr)
+        surface_deliver_user(ctx, surface, buf.index);
 
     return 0;
 }
 
+/*
+ * mmap a CAPTURE buffer for CPU access (cached in the V4L2MmapBuffer)
+ * Single-plane formats leave plane1_ptr NULL.
+ */
+int v4l2_map_capture(V4L2Context *ctx, int capture_idx)
+{
+    if (capture_idx < 0 || capture_idx >= ctx->num_capture_buffers)
+        return -1;
+
+    V4L2MmapBuffer *cap_buf = &ctx->capture_buffers[capture_idx];
+    if (cap_buf->plane0_ptr != NULL)
+        return 0;
+
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[2];
+    memset(&buf, 0, sizeof(buf));
+    memset(&planes, 0, sizeof(planes));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = capture_idx;
+    buf.length = 2;
+    buf.m.planes = planes;
+
+    if (ioctl(ctx->v4l2_fd, VIDIOC_QUERYBUF, &buf) < 0) {
+        LOG("Failed to query CAPTURE buffer %d: %s", capture_idx, strerror(errno));
+        return -1;
+    }
+
+    void *plane0 = mmap(NULL, planes[0].length, PROT_READ, MAP_SHARED,
+                        ctx->v4l2_fd, planes[0].m.mem_offset);
+    if (plane0 == MAP_FAILED) {
+        LOG("Failed to mmap CAPTURE buffer %d plane 0: %s", capture_idx, strerror(errno));
+        return -1;
+    }
+
+    void *plane1 = NULL;
+    if (buf.length > 1) {
+        plane1 = mmap(NULL, planes[1].length, PROT_READ, MAP_SHARED,
+                      ctx->v4l2_fd, planes[1].m.mem_offset);
+        if (plane1 == MAP_FAILED) {
+            LOG("Failed to mmap CAPTURE buffer %d plane 1: %s", capture_idx, strerror(errno));
+            munmap(plane0, planes[0].length);
+            return -1;
+        }
+    }
+
+    cap_buf->plane0_ptr = plane0;
+    cap_buf->plane0_len = planes[0].length;
+    cap_buf->plane1_ptr = plane1;
+    cap_buf->plane1_len = plane1 ? planes[1].length : 0;
+    atomic_fetch_add(&ctx->drv->mapped_bytes, cap_buf->plane0_len + cap_buf->plane1_len);
+
+    LOG("Cached mmap for CAPTURE buffer %d (planes=%u, %zu + %zu bytes)",
+        capture_idx, buf.length, cap_buf->plane0_len, cap_buf->plane1_len);
+    return 0;
+}
+
 /*
  * Re-queue a CAPTURE buffer after it has been processed
  */
@@ -549,6 +847,7 @@ int v4l2_requeue_capture(V4L2Context *ctx, int capture_idx)
     buf.index = capture_idx;
     buf.length = 2;
     buf.m.planes = planes;
+    buf.flags = v4l2_capture_qbuf_flags(ctx);
 
     if (ioctl(ctx->v4l2_fd, VIDIOC_QBUF, &buf) < 0) {
         LOG("Failed to re-queue CAPTURE buffer %d: %s", capture_idx, strerror(errno));
@@ -561,14 +860,30 @@ int v4l2_requeue_capture(V4L2Context *ctx, int capture_idx)
 
 /*
  * Export CAPTURE buffer as DMABuf
+ * The fd is exported once per buffer and owned by the context; callers that
+ * hand it out must dup() it.
  */
 int v4l2_export_dmabuf(V4L2Context *ctx, int capture_idx)
 {
+    return v4l2_export_plane(ctx, capture_idx, 0);
+}
+
+/* Same for one plane of a multi-planar format (plane 0 or 1) */
+int v4l2_export_plane(V4L2Context *ctx, int capture_idx, int plane)
+{
+    if (capture_idx < 0 || capture_idx >= ctx->num_capture_buffers)
+        return -1;
+
+    V4L2MmapBuffer *cap = &ctx->capture_buffers[capture_idx];
+    int *cached = plane == 0 ? &cap->fd : &cap->plane1_fd;
+    if (*cached >= 0)
+        return *cached;
+
     struct v4l2_exportbuffer expbuf;
     memset(&expbuf, 0, sizeof(expbuf));
     expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
     expbuf.index = capture_idx;
-    expbuf.plane = 0;
+    expbuf.plane = plane;
     expbuf.flags = O_RDONLY | O_CLOEXEC;
 
     if (ioctl(ctx->v4l2_fd, VIDIOC_EXPBUF, &expbuf) < 0) {
@@ -576,24 +891,256 @@ int v4l2_export_dmabuf(V4L2Context *ctx, int capture_idx)
         return -1;
     }
 
-    ctx->capture_buffers[capture_idx].fd = expbuf.fd;
+    *cached = expbuf.fd;
+    atomic_fetch_add(&ctx->drv->exported_fds, 1);
     return expbuf.fd;
 }
 
+/* DMA_BUF_IOCTL_SYNC on every plane of a CAPTURE buffer */
+static void v4l2_capture_sync(V4L2Context *ctx, int capture_idx, uint64_t flags)
+{
+    if (!ctx->capture_noncoherent || capture_idx < 0 || capture_idx >= ctx->num_capture_buffers)
+        return;
+
+    int fds[2] = { v4l2_export_dmabuf(ctx, capture_idx), -1 };
+
+    if (ctx->capture_fmt.num_planes > 1)
+        fds[1] = v4l2_export_plane(ctx, capture_idx, 1);
+
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] < 0)
+            continue;
+        struct dma_buf_sync sync = { .flags = flags };
+        if (ioctl(fds[i], DMA_BUF_IOCTL_SYNC, &sync) < 0)
+            LOG("DMA_BUF_IOCTL_SYNC on CAPTURE buffer %d plane %d failed: %s",
+                capture_idx, i, strerror(errno));
+    }
+}
+
+/*
+ * Bracket CPU access to a CAPTURE buffer. sync_flags is DMA_BUF_SYNC_READ,
+ * _WRITE or _RW; READ alone invalidates on entry and skips the clean on
+ * exit. No-ops for coherent buffers.
+ */
+void v4l2_capture_begin_cpu(V4L2Context *ctx, int capture_idx, uint64_t sync_flags)
+{
+    v4l2_capture_sync(ctx, capture_idx, DMA_BUF_SYNC_START | sync_flags);
+}
+
+void v4l2_capture_end_cpu(V4L2Context *ctx, int capture_idx, uint64_t sync_flags)
+{
+    v4l2_capture_sync(ctx, capture_idx, DMA_BUF_SYNC_END | sync_flags);
+}
+
+/*
+ * Drop everything in flight and restart both queues in place, following the
+ * stateful decoder seek sequence. Buffers stay allocated and mapped; CAPTURE
+ * buffers held by surfaces stay with them until they are re-queued.
+ */
+int v4l2_flush(V4L2Context *ctx)
+{
+    enum v4l2_buf_type type;
+
+    if (!ctx->streaming_output)
+        return 0;
+
+    type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    if (ioctl(ctx->v4l2_fd, VIDIOC_STREAMOFF, &type) < 0) {
+        LOG("Flush: OUTPUT STREAMOFF failed: %s", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < ctx->num_output_buffers; i++)
+        ctx->output_buffers[i].queued = false;
+    pack_reset(ctx);
+    latency_reset(ctx);
+
+    if (ctx->streaming_capture) {
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        if (ioctl(ctx->v4l2_fd, VIDIOC_STREAMOFF, &type) < 0) {
+            LOG("Flush: CAPTURE STREAMOFF failed: %s", strerror(errno));
+            return -1;
+        }
+        if (ioctl(ctx->v4l2_fd, VIDIOC_STREAMON, &type) < 0) {
+            LOG("Flush: CAPTURE STREAMON failed: %s", strerror(errno));
+            ctx->streaming_capture = false;
+            return -1;
+        }
+
+        /* STREAMOFF returned every buffer; give back the ones the decoder owned */
+        for (int i = 0; i < ctx->num_capture_buffers; i++) {
+            if (ctx->capture_buffers[i].queued) {
+                ctx->capture_buffers[i].queued = false;
+                v4l2_requeue_capture(ctx, i);
+            }
+        }
+    }
+
+    type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    if (ioctl(ctx->v4l2_fd, VIDIOC_STREAMON, &type) < 0) {
+        LOG("Flush: OUTPUT STREAMON failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Recover from a decoder error without tearing the context down: flush
+ * both queues and drop pictures until the next keyframe (IDR/IRAP for
+ * H.264/HEVC), which is sent with fresh parameter sets.
+ */
+void v4l2_resync(V4L2Context *ctx, const char *reason)
+{
+    if (ctx->recovery.resync)
+        return;
+
+    LOG("Resync: %s, flushing and waiting for the next keyframe", reason);
+
+    if (v4l2_flush(ctx) < 0)
+        LOG("Resync: in-place flush failed, decoder may stay stalled");
+
+    ctx->h264.sps_pps_sent = false;
+    ctx->hevc.params_sent = false;
+    ctx->recovery.resync = true;
+    ctx->recovery.have_output = false;
+    ctx->recovery.timeouts = 0;
+    ctx->recovery.skipped = 0;
+}
+
+/*
+ * Stop the OUTPUT queue and free its buffers; the CAPTURE queue and the
+ * frames in it stay. Queued bitstream is dropped, so the decoder starts
+ * over at the next resume point once v4l2_alloc_output_buffers has
+ * brought the queue back.
+ */
+void v4l2_release_output_queue(V4L2Context *ctx)
+{
+    V4L2Driver *drv = ctx->drv;
+
+    if (ctx->v4l2_fd >= 0 && ctx->streaming_output) {
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        ioctl(ctx->v4l2_fd, VIDIOC_STREAMOFF, &type);
+    }
+    ctx->streaming_output = false;
+    pack_reset(ctx);
+    latency_reset(ctx);
+
+    for (int i = 0; i < ctx->num_output_buffers; i++) {
+        V4L2MmapBuffer *out = &ctx->output_buffers[i];
+        if (out->start != NULL && out->start != MAP_FAILED) {
+            munmap(out->start, out->length);
+            atomic_fetch_sub(&drv->mapped_bytes, out->length);
+        }
+        out->start = NULL;
+        out->length = 0;
+        out->queued = false;
+    }
+    ctx->num_output_buffers = 0;
+    ctx->output_buf_idx = 0;
+
+    mem_uncharge(drv->dev, ctx->mem_output);
+    ctx->mem_output = 0;
+
+    /* Free the buffer memory itself; the mappings above had to go first */
+    if (ctx->v4l2_fd >= 0) {
+        struct v4l2_requestbuffers reqbufs;
+        memset(&reqbufs, 0, sizeof(reqbufs));
+        reqbufs.count = 0;
+        reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        reqbufs.memory = V4L2_MEMORY_MMAP;
+        ioctl(ctx->v4l2_fd, VIDIOC_REQBUFS, &reqbufs);
+    }
+}
+
+/*
+ * Stop both queues and give back everything mapped or exported from them.
+ * The device fd stays open (the caller closes it, or sets the queues up
+ * again to resume decoding).
+ */
+void v4l2_release_queues(V4L2Context *ctx)
+{
+    V4L2Driver *drv = ctx->drv;
+
+    /* Copies still reading CAPTURE buffers must finish before they go */
+    readback_wait(drv->dev, ctx->readback_seq, VA_TIMEOUT_INFINITE);
+
+    v4l2_release_output_queue(ctx);
+
+    if (ctx->v4l2_fd >= 0 && ctx->streaming_capture) {
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        ioctl(ctx->v4l2_fd, VIDIOC_STREAMOFF, &type);
+    }
+    ctx->streaming_capture = false;
+
+    for (int i = 0; i < ctx->num_capture_buffers; i++) {
+        V4L2MmapBuffer *cap = &ctx->capture_buffers[i];
+        if (cap->plane0_ptr != NULL) {
+            munmap(cap->plane0_ptr, cap->plane0_len);
+            atomic_fetch_sub(&drv->mapped_bytes, cap->plane0_len);
+        }
+        if (cap->plane1_ptr != NULL) {
+            munmap(cap->plane1_ptr, cap->plane1_len);
+            atomic_fetch_sub(&drv->mapped_bytes, cap->plane1_len);
+        }
+        if (cap->fd >= 0) {
+            close(cap->fd);
+            atomic_fetch_sub(&drv->exported_fds, 1);
+        }
+        if (cap->plane1_fd >= 0) {
+            close(cap->plane1_fd);
+            atomic_fetch_sub(&drv->exported_fds, 1);
+        }
+        cap->plane0_ptr = NULL;
+        cap->plane1_ptr = NULL;
+        cap->plane0_len = 0;
+        cap->plane1_len = 0;
+        cap->fd = -1;
+        cap->plane1_fd = -1;
+        cap->queued = false;
+    }
+    ctx->num_capture_buffers = 0;
+    ctx->recovery.have_output = false;
+
+    mem_uncharge(drv->dev, ctx->mem_capture);
+    ctx->mem_capture = 0;
+
+    if (ctx->v4l2_fd >= 0) {
+        struct v4l2_requestbuffers reqbufs;
+        memset(&reqbufs, 0, sizeof(reqbufs));
+        reqbufs.count = 0;
+        reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        reqbufs.memory = V4L2_MEMORY_MMAP;
+        ioctl(ctx->v4l2_fd, VIDIOC_REQBUFS, &reqbufs);
+    }
+}
+
 /*
  * Utility: Append to growable buffer
  */
 void bitstream_append(BitstreamBuffer *bb, const void *data, size_t size)
+{
+    if (bitstream_reserve(bb, size) < 0)
+        return;
+    memcpy((uint8_t *)bb->data + bb->size, data, size);
+    bb->size += size;
+}
+
+/*
+ * Utility: Make room for size more bytes past the current end
+ */
+int bitstream_reserve(BitstreamBuffer *bb, size_t size)
 {
     if (bb->size + size > bb->allocated) {
         size_t new_size = bb->allocated ? bb->allocated * 2 : BITSTREAM_BUFFER_SIZE;
         while (new_size < bb->size + size)
             new_size *= 2;
-        bb->data = realloc(bb->data, new_size);
+        void *data = realloc(bb->data, new_size);
+        if (data == NULL)
+            return -1;
+        bb->data = data;
         bb->allocated = new_size;
     }
-    memcpy((uint8_t *)bb->data + bb->size, data, size);
-    bb->size += size;
+    return 0;
 }
 
 void bitstream_reset(BitstreamBuffer *bb)
@@ -608,3 +1155,13 @@ void bitstream_free(BitstreamBuffer *bb)
     bb->size = 0;
     bb->allocated = 0;
 }
+
+/*
+ * Utility: Milliseconds elapsed since a CLOCK_MONOTONIC timestamp
+ */
+long ms_since(const struct timespec *ts)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - ts->tv_sec) * 1000 + (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
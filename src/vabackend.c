@@ -24,18 +24,111 @@
 #include <time.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <poll.h>
 
 #include <va/va_backend.h>
 #include <va/va_drmcommon.h>
 #include <linux/videodev2.h>
+#include <linux/dma-buf.h>
 #include <drm_fourcc.h>
 
+/* Consecutive SyncSurface timeouts before the decoder is considered wedged */
+#define RECOVERY_MAX_TIMEOUTS 3
+#define SYNC_BACKOFF_US 1000
+
 /* Logging */
 static FILE *log_output = NULL;
 
+V4L2Options v4l2va_options;
+
 __attribute__ ((constructor))
 static void driver_init(void)
 {
+    char *dump_env = getenv("V4L2VA_DUMP");
+    if (dump_env != NULL && dump_env[0] != '\0') {
+        v4l2va_options.dump_dir = dump_env;
+    }
+
+    char *checksum_env = getenv("V4L2VA_CHECKSUM");
+    if (checksum_env != NULL) {
+        if (strcmp(checksum_env, "md5") == 0) {
+            v4l2va_options.checksum = CHECKSUM_MD5;
+        } else if (strcmp(checksum_env, "crc32") == 0 || strcmp(checksum_env, "1") == 0) {
+            v4l2va_options.checksum = CHECKSUM_CRC32;
+        }
+        v4l2va_options.checksum_file = getenv("V4L2VA_CHECKSUM_FILE");
+    }
+
+    char *low_latency_env = getenv("V4L2VA_LOW_LATENCY");
+    if (low_latency_env != NULL && strcmp(low_latency_env, "1") == 0) {
+        v4l2va_options.low_latency = true;
+    }
+
+    char *slice_env = getenv("V4L2VA_SLICE_STREAMING");
+    if (slice_env != NULL && strcmp(slice_env, "1") == 0) {
+        v4l2va_options.slice_streaming = true;
+    }
+
+    char *keyframe_env = getenv("V4L2VA_KEYFRAME_ONLY");
+    if (keyframe_env != NULL && strcmp(keyframe_env, "1") == 0) {
+        v4l2va_options.keyframe_only = true;
+    }
+
+    char *pack_env = getenv("V4L2VA_PACK_FRAMES");
+    if (pack_env != NULL) {
+        v4l2va_options.pack_frames = atoi(pack_env);
+    }
+
+    char *drop_env = getenv("V4L2VA_DROP");
+    if (drop_env != NULL) {
+        if (strcmp(drop_env, "queue") == 0)
+            v4l2va_options.drop_policy = DROP_ON_QUEUE;
+        else if (strcmp(drop_env, "hint") == 0)
+            v4l2va_options.drop_policy = DROP_ON_HINT;
+        else if (strcmp(drop_env, "1") == 0)
+            v4l2va_options.drop_policy = DROP_ON_QUEUE | DROP_ON_HINT;
+    }
+
+    char *cache_env = getenv("V4L2VA_FRAME_CACHE");
+    if (cache_env != NULL) {
+        v4l2va_options.frame_cache = atoi(cache_env);
+    }
+
+    char *cached_env = getenv("V4L2VA_CACHED_CAPTURE");
+    if (cached_env != NULL && strcmp(cached_env, "1") == 0) {
+        v4l2va_options.cached_capture = true;
+    }
+
+    char *detile_env = getenv("V4L2VA_DETILE");
+    if (detile_env != NULL) {
+        if (strcmp(detile_env, "0") == 0)
+            v4l2va_options.detile = DETILE_NEVER;
+        else if (strcmp(detile_env, "1") == 0)
+            v4l2va_options.detile = DETILE_ALWAYS;
+    }
+
+    char *budget_env = getenv("V4L2VA_MEM_BUDGET_MB");
+    if (budget_env != NULL && budget_env[0] != '\0') {
+        v4l2va_options.mem_budget_set = true;
+        v4l2va_options.mem_budget_mb = strtoul(budget_env, NULL, 10);
+    }
+
+    char *nal_env = getenv("V4L2VA_NAL_FILTER");
+    if (nal_env != NULL && strcmp(nal_env, "0") == 0) {
+        v4l2va_options.nal_filter_off = true;
+    }
+    nal_filter_set_sei(getenv("V4L2VA_DROP_SEI"));
+
+    char *async_env = getenv("V4L2VA_ASYNC_GETIMAGE");
+    if (async_env != NULL && strcmp(async_env, "1") == 0) {
+        v4l2va_options.async_getimage = true;
+    }
+
+    char *idle_env = getenv("V4L2VA_IDLE_TIMEOUT_MS");
+    if (idle_env != NULL) {
+        v4l2va_options.idle_timeout_ms = strtoul(idle_env, NULL, 10);
+    }
+
     char *log_env = getenv("V4L2VA_LOG");
     if (log_env != NULL) {
         if (strcmp(log_env, "1") == 0) {
@@ -52,6 +145,9 @@ static void driver_init(void)
 __attribute__ ((destructor))
 static void driver_cleanup(void)
 {
+    /* Flush pending bitstream dumps before the log goes away */
+    dump_shutdown();
+
     if (log_output != NULL && log_output != stderr) {
         fclose(log_output);
     }
@@ -101,63 +197,133 @@ static const V4L2Codec *codec_for_profile(VAProfile profile)
 
 /*
  * Object management - simple ID-based allocation
- * VA-API uses IDs (ints) to reference objects
+ * VA-API uses IDs (ints) to reference objects. The object is stored in its
+ * slot under drv->mutex, so concurrent creators on different threads never
+ * receive the same ID. A full table is logged so that per-process limits
+ * show up as explicit failures rather than silent allocation errors.
  */
-static VAGenericID allocate_config_id(V4L2Driver *drv)
+static VAGenericID allocate_config_id(V4L2Driver *drv, V4L2Config *cfg)
 {
-    for (int i = 0; i < MAX_PROFILES; i++) {
+    VAGenericID id = VA_INVALID_ID;
+
+    pthread_mutex_lock(&drv->mutex);
+    for (int i = 0; i < MAX_CONFIGS; i++) {
         if (drv->configs[i] == NULL) {
-            return i + 1;  /* 1-based IDs */
+            drv->configs[i] = cfg;
+            drv->num_configs++;
+            id = i + 1;  /* 1-based IDs */
+            break;
         }
     }
-    return VA_INVALID_ID;
+    pthread_mutex_unlock(&drv->mutex);
+
+    if (id == VA_INVALID_ID)
+        LOG("Config table full (%d/%d)", drv->num_configs, MAX_CONFIGS);
+    return id;
 }
 
-static VAGenericID allocate_context_id(V4L2Driver *drv)
+static VAGenericID allocate_context_id(V4L2Driver *drv, V4L2Context *context)
 {
-    for (int i = 0; i < MAX_PROFILES; i++) {
+    VAGenericID id = VA_INVALID_ID;
+
+    pthread_mutex_lock(&drv->mutex);
+    for (int i = 0; i < MAX_CONTEXTS; i++) {
         if (drv->contexts[i] == NULL) {
-            return i + 1 + 0x1000;  /* Offset to avoid collision */
+            drv->contexts[i] = context;
+            drv->num_contexts++;
+            id = i + 1 + 0x1000;  /* Offset to avoid collision */
+            break;
         }
     }
-    return VA_INVALID_ID;
+    pthread_mutex_unlock(&drv->mutex);
+
+    if (id == VA_INVALID_ID)
+        LOG("Context table full (%d/%d)", drv->num_contexts, MAX_CONTEXTS);
+    return id;
 }
 
-static VAGenericID allocate_surface_id(V4L2Driver *drv)
+static VAGenericID allocate_surface_id(V4L2Driver *drv, V4L2Surface *surface)
 {
+    VAGenericID id = VA_INVALID_ID;
+
+    pthread_mutex_lock(&drv->mutex);
     for (int i = 0; i < MAX_SURFACES; i++) {
         if (drv->surfaces[i] == NULL) {
-            return i + 1 + 0x2000;
+            drv->surfaces[i] = surface;
+            drv->num_surfaces++;
+            id = i + 1 + 0x2000;
+            break;
         }
     }
-    return VA_INVALID_ID;
+    pthread_mutex_unlock(&drv->mutex);
+
+    if (id == VA_INVALID_ID)
+        LOG("Surface table full (%d/%d)", drv->num_surfaces, MAX_SURFACES);
+    return id;
 }
 
-static VAGenericID allocate_buffer_id(V4L2Driver *drv)
+static VAGenericID allocate_buffer_id(V4L2Driver *drv, V4L2Buffer *buffer)
 {
     VAGenericID id = VA_INVALID_ID;
 
     pthread_mutex_lock(&drv->mutex);
     for (int i = 0; i < MAX_BUFFERS; i++) {
         if (drv->buffers[i] == NULL) {
+            drv->buffers[i] = buffer;
+            drv->num_buffers++;
             id = i + 1 + 0x3000;
             break;
         }
     }
     pthread_mutex_unlock(&drv->mutex);
+
+    if (id == VA_INVALID_ID)
+        LOG("Buffer table full (%d/%d)", drv->num_buffers, MAX_BUFFERS);
+    return id;
+}
+
+static VAGenericID allocate_mf_context_id(V4L2Driver *drv, V4L2MFContext *mf)
+{
+    VAGenericID id = VA_INVALID_ID;
+
+    pthread_mutex_lock(&drv->mutex);
+    for (int i = 0; i < MAX_MF_CONTEXTS; i++) {
+        if (drv->mf_contexts[i] == NULL) {
+            drv->mf_contexts[i] = mf;
+            drv->num_mf_contexts++;
+            id = i + 1 + 0x4000;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&drv->mutex);
+
+    if (id == VA_INVALID_ID)
+        LOG("MF context table full (%d/%d)", drv->num_mf_contexts, MAX_MF_CONTEXTS);
     return id;
 }
 
+/* Log handle-table occupancy and device resources (context churn diagnostics) */
+static void log_resource_usage(V4L2Driver *drv)
+{
+    LOG("Resources: contexts=%d/%d surfaces=%d/%d buffers=%d/%d "
+        "mapped=%zu KB exported_fds=%d budget=%zu/%zu KB",
+        drv->num_contexts, MAX_CONTEXTS, drv->num_surfaces, MAX_SURFACES,
+        drv->num_buffers, MAX_BUFFERS,
+        atomic_load(&drv->mapped_bytes) / 1024, atomic_load(&drv->exported_fds),
+        atomic_load(&drv->dev->mem_charged) / 1024, drv->dev->mem_budget / 1024);
+}
+
 /* Object lookup */
 #define CONFIG_INDEX(id) ((id) - 1)
 #define CONTEXT_INDEX(id) ((id) - 1 - 0x1000)
+#define MF_CONTEXT_INDEX(id) ((id) - 1 - 0x4000)
 #define SURFACE_INDEX(id) ((id) - 1 - 0x2000)
 #define BUFFER_INDEX(id) ((id) - 1 - 0x3000)
 
 static V4L2Config *get_config(V4L2Driver *drv, VAConfigID id)
 {
     int idx = CONFIG_INDEX(id);
-    if (idx >= 0 && idx < MAX_PROFILES)
+    if (idx >= 0 && idx < MAX_CONFIGS)
         return drv->configs[idx];
     return NULL;
 }
@@ -165,7 +331,7 @@ static V4L2Config *get_config(V4L2Driver *drv, VAConfigID id)
 static V4L2Context *get_context(V4L2Driver *drv, VAContextID id)
 {
     int idx = CONTEXT_INDEX(id);
-    if (idx >= 0 && idx < MAX_PROFILES)
+    if (idx >= 0 && idx < MAX_CONTEXTS)
         return drv->contexts[idx];
     return NULL;
 }
@@ -186,9 +352,21 @@ static V4L2Buffer *get_buffer(V4L2Driver *drv, VABufferID id)
     return NULL;
 }
 
+/* Release what a buffer owns and keep it for reuse; the caller drops it from the table */
+static void buffer_free(V4L2Driver *drv, V4L2Buffer *buffer)
+{
+    if (buffer->pooled)
+        image_pool_put(drv->dev, buffer);
+    else if (buffer->data_capacity == 0)
+        buffer->data = NULL;    /* Application memory or a CAPTURE mapping */
+    buffer_put(drv->dev, buffer);
+}
+
 /* Forward declarations for cleanup helpers */
 static VAStatus v4l2_DestroySurfaces(VADriverContextP ctx, VASurfaceID *surface_list, int num_surfaces);
 static VAStatus v4l2_DestroyContext(VADriverContextP ctx, VAContextID context_id);
+static VAStatus v4l2_DestroyBuffer(VADriverContextP ctx, VABufferID buf_id);
+static void mf_submit_pending(V4L2Context *context);
 
 /*
  * VA-API Entry Points
@@ -199,6 +377,9 @@ static VAStatus v4l2_Terminate(VADriverContextP ctx)
     V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
     LOG("Terminating V4L2 VA-API driver");
 
+    /* Stop the idle reaper before contexts start going away */
+    idle_stop(drv);
+
     /* Destroy surfaces first so any held CAPTURE buffers are returned while contexts exist */
     for (int i = 0; i < MAX_SURFACES; i++) {
         if (drv->surfaces[i]) {
@@ -208,7 +389,7 @@ static VAStatus v4l2_Terminate(VADriverContextP ctx)
     }
 
     /* Clean up contexts */
-    for (int i = 0; i < MAX_PROFILES; i++) {
+    for (int i = 0; i < MAX_CONTEXTS; i++) {
         if (drv->contexts[i]) {
             VAContextID id = i + 1 + 0x1000;
             v4l2_DestroyContext(ctx, id);
@@ -218,17 +399,25 @@ static VAStatus v4l2_Terminate(VADriverContextP ctx)
     /* Clean up any remaining buffers */
     for (int i = 0; i < MAX_BUFFERS; i++) {
         if (drv->buffers[i]) {
-            free(drv->buffers[i]->data);
-            free(drv->buffers[i]);
+            readback_wait(drv->dev, drv->buffers[i]->readback_seq, VA_TIMEOUT_INFINITE);
+            buffer_free(drv, drv->buffers[i]);
             drv->buffers[i] = NULL;
         }
     }
 
     /* Clean up configs */
-    for (int i = 0; i < MAX_PROFILES; i++) {
+    for (int i = 0; i < MAX_CONFIGS; i++) {
         free(drv->configs[i]);
     }
 
+    /* MF contexts the application did not destroy */
+    for (int i = 0; i < MAX_MF_CONTEXTS; i++) {
+        free(drv->mf_contexts[i]);
+    }
+
+    /* The last display out takes the shared pools and workers with it */
+    registry_release(drv);
+
     pthread_mutex_destroy(&drv->mutex);
     free(drv);
     ctx->pDriverData = NULL;
@@ -349,10 +538,6 @@ static VAStatus v4l2_CreateConfig(
         return VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
     }
 
-    VAGenericID id = allocate_config_id(drv);
-    if (id == VA_INVALID_ID)
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
-
     V4L2Config *cfg = calloc(1, sizeof(V4L2Config));
     if (cfg == NULL)
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
@@ -362,7 +547,12 @@ static VAStatus v4l2_CreateConfig(
     cfg->v4l2_pixfmt = codec->v4l2_pixfmt;
     cfg->codec = codec;
 
-    drv->configs[CONFIG_INDEX(id)] = cfg;
+    VAGenericID id = allocate_config_id(drv, cfg);
+    if (id == VA_INVALID_ID) {
+        free(cfg);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
     *config_id = id;
 
     LOG("Created config %d for profile %d (%s)", id, profile, codec->name);
@@ -376,11 +566,16 @@ static VAStatus v4l2_DestroyConfig(
     V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
     int idx = CONFIG_INDEX(config_id);
 
-    if (idx < 0 || idx >= MAX_PROFILES || drv->configs[idx] == NULL)
+    pthread_mutex_lock(&drv->mutex);
+    if (idx < 0 || idx >= MAX_CONFIGS || drv->configs[idx] == NULL) {
+        pthread_mutex_unlock(&drv->mutex);
         return VA_STATUS_ERROR_INVALID_CONFIG;
+    }
 
     free(drv->configs[idx]);
     drv->configs[idx] = NULL;
+    drv->num_configs--;
+    pthread_mutex_unlock(&drv->mutex);
 
     return VA_STATUS_SUCCESS;
 }
@@ -396,13 +591,11 @@ static VAStatus v4l2_CreateSurfaces(
     V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
 
     for (int i = 0; i < num_surfaces; i++) {
-        VAGenericID id = allocate_surface_id(drv);
-        if (id == VA_INVALID_ID)
-            return VA_STATUS_ERROR_ALLOCATION_FAILED;
-
         V4L2Surface *surface = calloc(1, sizeof(V4L2Surface));
-        if (surface == NULL)
+        if (surface == NULL) {
+            v4l2_DestroySurfaces(ctx, surfaces, i);
             return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
 
         surface->width = width;
         surface->height = height;
@@ -411,11 +604,19 @@ static VAStatus v4l2_CreateSurfaces(
         surface->dmabuf_fd = -1;
         surface->decoded = false;
         surface->no_output = false;
+        surface_clear_error(surface);
         surface->cached_image = VA_INVALID_ID;
         pthread_mutex_init(&surface->mutex, NULL);
         pthread_cond_init(&surface->cond, NULL);
 
-        drv->surfaces[SURFACE_INDEX(id)] = surface;
+        VAGenericID id = allocate_surface_id(drv, surface);
+        if (id == VA_INVALID_ID) {
+            pthread_mutex_destroy(&surface->mutex);
+            pthread_cond_destroy(&surface->cond);
+            free(surface);
+            v4l2_DestroySurfaces(ctx, surfaces, i);
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
         surfaces[i] = id;
     }
 
@@ -433,8 +634,95 @@ static VAStatus v4l2_CreateSurfaces2(
     VASurfaceAttrib *attrib_list,
     unsigned int num_attribs)
 {
-    /* For now, just delegate to the simpler CreateSurfaces */
-    return v4l2_CreateSurfaces(ctx, width, height, format, num_surfaces, surfaces);
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
+    uint32_t mem_type = VA_SURFACE_ATTRIB_MEM_TYPE_VA;
+    uint32_t usage = VA_SURFACE_ATTRIB_USAGE_HINT_GENERIC;
+    VASurfaceAttribExternalBuffers *ext = NULL;
+#if VA_CHECK_VERSION(1, 12, 0)
+    VADRMFormatModifierList *modifiers = NULL;
+#endif
+
+    for (unsigned int i = 0; i < num_attribs; i++) {
+        if (!(attrib_list[i].flags & VA_SURFACE_ATTRIB_SETTABLE))
+            continue;
+        if (attrib_list[i].type == VASurfaceAttribMemoryType)
+            mem_type = attrib_list[i].value.value.i;
+        else if (attrib_list[i].type == VASurfaceAttribExternalBufferDescriptor)
+            ext = attrib_list[i].value.value.p;
+        else if (attrib_list[i].type == VASurfaceAttribUsageHint)
+            usage = attrib_list[i].value.value.i;
+#if VA_CHECK_VERSION(1, 12, 0)
+        else if (attrib_list[i].type == VASurfaceAttribDRMFormatModifiers)
+            modifiers = attrib_list[i].value.value.p;
+#endif
+    }
+
+    /* Frames headed for a GPU or display pick an export-friendly CAPTURE format */
+    uint32_t export_usage = VA_SURFACE_ATTRIB_USAGE_HINT_DISPLAY;
+#ifdef VA_SURFACE_ATTRIB_USAGE_HINT_EXPORT
+    export_usage |= VA_SURFACE_ATTRIB_USAGE_HINT_EXPORT;
+#endif
+
+    if (mem_type != VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR) {
+        VAStatus status = v4l2_CreateSurfaces(ctx, width, height, format, num_surfaces, surfaces);
+        if (status != VA_STATUS_SUCCESS)
+            return status;
+
+        for (unsigned int i = 0; i < num_surfaces; i++) {
+            V4L2Surface *surface = get_surface(drv, surfaces[i]);
+            surface->export_hint = (usage & export_usage) != 0;
+#if VA_CHECK_VERSION(1, 12, 0)
+            /* An importer naming its modifiers is going to import the frames */
+            if (modifiers && modifiers->modifiers) {
+                surface->export_hint = true;
+                for (uint32_t m = 0; m < modifiers->num_modifiers &&
+                                     surface->num_modifiers < MAX_MODIFIERS; m++)
+                    surface->modifiers[surface->num_modifiers++] = modifiers->modifiers[m];
+            }
+#endif
+        }
+        return VA_STATUS_SUCCESS;
+    }
+
+    /*
+     * Application memory can't be a CAPTURE buffer: a stateful decoder picks
+     * which buffer it writes and keeps reference frames in them, so it would
+     * overwrite frames the application still holds. Frames are decoded into
+     * our own buffers and copied into user memory once, when they come out.
+     */
+    if (ext == NULL || ext->buffers == NULL || ext->num_buffers < num_surfaces ||
+        ext->num_planes != 2 ||
+        (ext->pixel_format != VA_FOURCC_NV12 && ext->pixel_format != VA_FOURCC_P010)) {
+        LOG("CreateSurfaces2: unsupported user pointer descriptor");
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    uint32_t bpp = ext->pixel_format == VA_FOURCC_P010 ? 2 : 1;
+    if (ext->pitches[0] < width * bpp || ext->pitches[1] < ((width + 1) & ~1u) * bpp ||
+        ext->offsets[1] < ext->offsets[0] + ext->pitches[0] * height ||
+        ext->data_size < ext->offsets[1] + ext->pitches[1] * ((height + 1) / 2)) {
+        LOG("CreateSurfaces2: user pointer planes too small for %ux%u", width, height);
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    VAStatus status = v4l2_CreateSurfaces(ctx, width, height, format, num_surfaces, surfaces);
+    if (status != VA_STATUS_SUCCESS)
+        return status;
+
+    for (unsigned int i = 0; i < num_surfaces; i++) {
+        V4L2Surface *surface = get_surface(drv, surfaces[i]);
+        surface->user_ptr = (uint8_t *)ext->buffers[i];
+        surface->user_size = ext->data_size;
+        if (ext->pixel_format == VA_FOURCC_P010)
+            surface->fourcc = V4L2_PIX_FMT_P010;
+        for (int p = 0; p < 2; p++) {
+            surface->user_pitches[p] = ext->pitches[p];
+            surface->user_offsets[p] = ext->offsets[p];
+        }
+    }
+
+    LOG("CreateSurfaces2: %u surfaces backed by user memory", num_surfaces);
+    return VA_STATUS_SUCCESS;
 }
 
 static VAStatus v4l2_DestroySurfaces(
@@ -447,10 +735,35 @@ static VAStatus v4l2_DestroySurfaces(
     for (int i = 0; i < num_surfaces; i++) {
         int idx = SURFACE_INDEX(surface_list[i]);
         if (idx >= 0 && idx < MAX_SURFACES && drv->surfaces[idx]) {
+            pthread_mutex_lock(&drv->mutex);
             V4L2Surface *surface = drv->surfaces[idx];
+            /* Another thread may have destroyed it since the check above */
+            if (surface == NULL) {
+                pthread_mutex_unlock(&drv->mutex);
+                continue;
+            }
+            drv->surfaces[idx] = NULL;
+            drv->num_surfaces--;
+
+            /*
+             * Unlisted, the surface no longer loses its context to
+             * DestroyContext; lock it before drv->mutex is dropped.
+             */
+            V4L2Context *context = surface->context;
+            if (context)
+                pthread_mutex_lock(&context->mutex);
+            pthread_mutex_unlock(&drv->mutex);
+
             /* Return any outstanding CAPTURE buffer to the queue */
-            if (surface->context && surface->capture_idx >= 0) {
-                v4l2_requeue_capture(surface->context, surface->capture_idx);
+            readback_wait(drv->dev, surface->readback_seq, VA_TIMEOUT_INFINITE);
+            if (context) {
+                if (surface->capture_idx >= 0)
+                    v4l2_requeue_capture(context, surface->capture_idx);
+                if (context->pack.max_pictures > 0)
+                    pack_forget(context, surface);
+                /* Without a context the cached frame is already dropped */
+                framecache_release(surface);
+                pthread_mutex_unlock(&context->mutex);
             }
             surface->cached_image = VA_INVALID_ID;
             if (surface->dmabuf_fd >= 0) {
@@ -459,7 +772,6 @@ static VAStatus v4l2_DestroySurfaces(
             pthread_mutex_destroy(&surface->mutex);
             pthread_cond_destroy(&surface->cond);
             free(surface);
-            drv->surfaces[idx] = NULL;
         }
     }
 
@@ -482,10 +794,6 @@ static VAStatus v4l2_CreateContext(
     if (cfg == NULL)
         return VA_STATUS_ERROR_INVALID_CONFIG;
 
-    VAGenericID id = allocate_context_id(drv);
-    if (id == VA_INVALID_ID)
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
-
     V4L2Context *context = calloc(1, sizeof(V4L2Context));
     if (context == NULL)
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
@@ -497,12 +805,49 @@ static VAStatus v4l2_CreateContext(
     context->height = picture_height;
     context->codec = cfg->codec;
     context->v4l2_fd = -1;
+    context->low_latency = v4l2va_options.low_latency;
+
+    for (int i = 0; i < num_render_targets; i++) {
+        V4L2Surface *surface = get_surface(drv, render_targets[i]);
+        if (surface && surface->export_hint)
+            context->consumer = CONSUMER_EXPORT;
+        if (surface && surface->num_modifiers > 0 && context->num_modifiers == 0) {
+            memcpy(context->modifiers, surface->modifiers, sizeof(context->modifiers));
+            context->num_modifiers = surface->num_modifiers;
+        }
+    }
+
+    /*
+     * Keyframes depend on nothing and nothing queued behind them is ever
+     * shown, so keyframe-only contexts run with minimal queues and no
+     * display delay as well.
+     */
+    if (v4l2va_options.keyframe_only) {
+        context->keyframe_only = true;
+        context->low_latency = true;
+    }
+
+    /*
+     * Slices can only be queued separately if the decoder finds picture
+     * boundaries itself; only H.264/HEVC pictures are split into slices.
+     */
+    if (v4l2va_options.slice_streaming &&
+        (cfg->codec->v4l2_pixfmt == V4L2_PIX_FMT_H264 ||
+         cfg->codec->v4l2_pixfmt == V4L2_PIX_FMT_HEVC)) {
+        if (v4l2_format_flags(drv, cfg->codec->v4l2_pixfmt) & V4L2_FMT_FLAG_CONTINUOUS_BYTESTREAM)
+            context->slice_streaming = true;
+        else
+            LOG("Slice streaming requested but %s decoder needs whole frames",
+                cfg->codec->name);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &context->last_activity);
     pthread_mutex_init(&context->mutex, NULL);
 
     /* Open V4L2 device */
     context->v4l2_fd = v4l2_open_device(drv);
     if (context->v4l2_fd < 0) {
         LOG("Failed to open V4L2 device");
+        pthread_mutex_destroy(&context->mutex);
         free(context);
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
@@ -511,16 +856,62 @@ static VAStatus v4l2_CreateContext(
     /* NOTE: CAPTURE queue is setup later when streaming starts, after SOURCE_CHANGE event */
     if (v4l2_setup_output_queue(context) < 0) {
         LOG("Failed to setup OUTPUT queue");
+        /* Unmaps what was mapped and returns the budget charge */
+        v4l2_release_queues(context);
         v4l2_close_device(drv, context->v4l2_fd);
+        pthread_mutex_destroy(&context->mutex);
         free(context);
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
-    drv->contexts[CONTEXT_INDEX(id)] = context;
+    VAGenericID id = allocate_context_id(drv, context);
+    if (id == VA_INVALID_ID) {
+        v4l2_release_queues(context);
+        v4l2_close_device(drv, context->v4l2_fd);
+        pthread_mutex_destroy(&context->mutex);
+        free(context);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    context->dump = dump_open(context);
+    checksum_init_context(context);
+    pack_init_context(context);
+    framecache_init_context(context);
+
     *context_id = id;
 
     LOG("Created context %d for %s (%dx%d)", id, cfg->codec->name,
         picture_width, picture_height);
+    log_resource_usage(drv);
+    return VA_STATUS_SUCCESS;
+}
+
+/*
+ * Free an MF context. Its members stay valid decode contexts; pictures
+ * they ended for vaMFSubmit are submitted if no other group holds them.
+ */
+static VAStatus mf_destroy(V4L2Driver *drv, int mf_idx)
+{
+    pthread_mutex_lock(&drv->mutex);
+    V4L2MFContext *mf = drv->mf_contexts[mf_idx];
+    if (mf == NULL) {
+        pthread_mutex_unlock(&drv->mutex);
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+    drv->mf_contexts[mf_idx] = NULL;
+    drv->num_mf_contexts--;
+
+    /* Members are only safe to touch while drv->mutex keeps them listed */
+    for (int i = 0; i < mf->num_members; i++) {
+        V4L2Context *member = mf->members[i];
+        pthread_mutex_lock(&member->mutex);
+        if (--member->mf_groups == 0)
+            mf_submit_pending(member);
+        pthread_mutex_unlock(&member->mutex);
+    }
+    free(mf);
+    pthread_mutex_unlock(&drv->mutex);
+
     return VA_STATUS_SUCCESS;
 }
 
@@ -531,56 +922,63 @@ static VAStatus v4l2_DestroyContext(
     V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
     int idx = CONTEXT_INDEX(context_id);
 
-    if (idx < 0 || idx >= MAX_PROFILES || drv->contexts[idx] == NULL)
-        return VA_STATUS_ERROR_INVALID_CONTEXT;
-
-    V4L2Context *context = drv->contexts[idx];
+    /* vaDestroyContext also ends multi-frame contexts */
+    int mf_idx = MF_CONTEXT_INDEX(context_id);
+    if (mf_idx >= 0 && mf_idx < MAX_MF_CONTEXTS)
+        return mf_destroy(drv, mf_idx);
 
-    /* Stop streaming */
-    if (context->streaming_output) {
-        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-        ioctl(context->v4l2_fd, VIDIOC_STREAMOFF, &type);
-        context->streaming_output = false;
-    }
-    if (context->streaming_capture) {
-        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        ioctl(context->v4l2_fd, VIDIOC_STREAMOFF, &type);
-        context->streaming_capture = false;
+    pthread_mutex_lock(&drv->mutex);
+    if (idx < 0 || idx >= MAX_CONTEXTS || drv->contexts[idx] == NULL) {
+        pthread_mutex_unlock(&drv->mutex);
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
     }
 
-    /* Unmap OUTPUT buffers */
-    for (int i = 0; i < context->num_output_buffers; i++) {
-        if (context->output_buffers[i].start != NULL &&
-            context->output_buffers[i].start != MAP_FAILED) {
-            munmap(context->output_buffers[i].start,
-                   context->output_buffers[i].length);
+    V4L2Context *context = drv->contexts[idx];
+    drv->contexts[idx] = NULL;
+    drv->num_contexts--;
+
+    /* Leave any multi-frame groups */
+    for (int i = 0; i < MAX_MF_CONTEXTS; i++) {
+        V4L2MFContext *mf = drv->mf_contexts[i];
+        for (int j = 0; mf && j < mf->num_members; j++) {
+            if (mf->members[j] == context)
+                mf->members[j--] = mf->members[--mf->num_members];
         }
     }
 
-    /* Unmap and close CAPTURE buffers */
-    for (int i = 0; i < context->num_capture_buffers; i++) {
-        if (context->capture_buffers[i].plane0_ptr != NULL) {
-            munmap(context->capture_buffers[i].plane0_ptr,
-                   context->capture_buffers[i].plane0_len);
-        }
-        if (context->capture_buffers[i].plane1_ptr != NULL) {
-            munmap(context->capture_buffers[i].plane1_ptr,
-                   context->capture_buffers[i].plane1_len);
-        }
-        if (context->capture_buffers[i].fd >= 0) {
-            close(context->capture_buffers[i].fd);
+    /* Surfaces outlive their context; drop references to its CAPTURE buffers */
+    for (int i = 0; i < MAX_SURFACES; i++) {
+        V4L2Surface *surface = drv->surfaces[i];
+        if (surface && surface->context == context) {
+            surface->context = NULL;
+            surface->capture_idx = -1;
+            surface->cached_frame = NULL;
         }
     }
+    pthread_mutex_unlock(&drv->mutex);
+
+    /* Unlisted now; wait out any thread that locked it under drv->mutex before */
+    pthread_mutex_lock(&context->mutex);
+    pthread_mutex_unlock(&context->mutex);
+
+    /* Stop streaming, unmap buffers and close exported DMABufs */
+    v4l2_release_queues(context);
 
     if (context->v4l2_fd >= 0) {
         v4l2_close_device(drv, context->v4l2_fd);
     }
 
+    dump_close(context->dump);
+    nal_filter_report(context);
+    framecache_destroy(context);
+    mem_uncharge(drv->dev, context->mem_staging);
     bitstream_free(&context->bitstream);
+    bitstream_free(&context->pack.data);
+    nal_list_free(&context->nal_list);
     pthread_mutex_destroy(&context->mutex);
     free(context);
-    drv->contexts[idx] = NULL;
 
+    log_resource_usage(drv);
     return VA_STATUS_SUCCESS;
 }
 
@@ -595,29 +993,25 @@ static VAStatus v4l2_CreateBuffer(
 {
     V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
 
-    VAGenericID id = allocate_buffer_id(drv);
-    if (id == VA_INVALID_ID)
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
-
-    V4L2Buffer *buffer = calloc(1, sizeof(V4L2Buffer));
+    /* Recycled with its data allocation: no heap traffic once warmed up */
+    size_t bytes = (size_t)size * num_elements;
+    V4L2Buffer *buffer = buffer_get(drv->dev, bytes ? bytes : 1);
     if (buffer == NULL)
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
     buffer->type = type;
     buffer->num_elements = num_elements;
     buffer->element_size = size;
-    buffer->data = malloc(size * num_elements);
-
-    if (buffer->data == NULL) {
-        free(buffer);
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
-    }
 
     if (data != NULL) {
-        memcpy(buffer->data, data, size * num_elements);
+        memcpy(buffer->data, data, bytes);
     }
 
-    drv->buffers[BUFFER_INDEX(id)] = buffer;
+    VAGenericID id = allocate_buffer_id(drv, buffer);
+    if (id == VA_INVALID_ID) {
+        buffer_put(drv->dev, buffer);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
     *buf_id = id;
 
     return VA_STATUS_SUCCESS;
@@ -638,16 +1032,18 @@ static VAStatus v4l2_BufferSetNumElements(
     return VA_STATUS_SUCCESS;
 }
 
-static VAStatus v4l2_MapBuffer(
-    VADriverContextP ctx,
-    VABufferID buf_id,
-    void **pbuf)
+/*
+ * Map a buffer for the application. flags are VA_MAPBUFFER_FLAG_* (0 for
+ * vaMapBuffer); they decide the cache maintenance of CAPTURE mappings.
+ */
+static VAStatus buffer_map(V4L2Driver *drv, V4L2Buffer *buffer, void **pbuf, uint32_t flags)
 {
-    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
-    V4L2Buffer *buffer = get_buffer(drv, buf_id);
-
-    if (buffer == NULL)
-        return VA_STATUS_ERROR_INVALID_BUFFER;
+    /* Images being filled by an asynchronous GetImage are mapped once it is done */
+    if (buffer->readback_seq) {
+        readback_wait(drv->dev, buffer->readback_seq, VA_TIMEOUT_INFINITE);
+        if (buffer->readback_status != VA_STATUS_SUCCESS)
+            return buffer->readback_status;
+    }
 
     /* Handle DeriveImage buffers - need to mmap the V4L2 CAPTURE buffer */
     if (buffer->type == VAImageBufferType && buffer->data == NULL) {
@@ -691,12 +1087,53 @@ static VAStatus v4l2_MapBuffer(
         buffer->element_size = total_size;
         LOG("MapBuffer: Mapped CAPTURE buffer %d at %p, size=%zu",
             capture_idx, mapped, total_size);
+
+        /* Read-only maps only invalidate; nothing to clean on unmap */
+        buffer->sync_flags = DMA_BUF_SYNC_RW;
+#if VA_CHECK_VERSION(1, 21, 0)
+        if (flags == VA_MAPBUFFER_FLAG_READ)
+            buffer->sync_flags = DMA_BUF_SYNC_READ;
+        else if (flags == VA_MAPBUFFER_FLAG_WRITE)
+            buffer->sync_flags = DMA_BUF_SYNC_WRITE;
+#endif
+        v4l2_capture_begin_cpu(context, capture_idx, buffer->sync_flags);
     }
 
     *pbuf = buffer->data;
     return VA_STATUS_SUCCESS;
 }
 
+static VAStatus v4l2_MapBuffer(
+    VADriverContextP ctx,
+    VABufferID buf_id,
+    void **pbuf)
+{
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
+    V4L2Buffer *buffer = get_buffer(drv, buf_id);
+
+    if (buffer == NULL)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    return buffer_map(drv, buffer, pbuf, 0);
+}
+
+#if VA_CHECK_VERSION(1, 21, 0)
+static VAStatus v4l2_MapBuffer2(
+    VADriverContextP ctx,
+    VABufferID buf_id,
+    void **pbuf,
+    uint32_t flags)
+{
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
+    V4L2Buffer *buffer = get_buffer(drv, buf_id);
+
+    if (buffer == NULL)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    return buffer_map(drv, buffer, pbuf, flags);
+}
+#endif
+
 static VAStatus v4l2_UnmapBuffer(
     VADriverContextP ctx,
     VABufferID buf_id)
@@ -709,9 +1146,10 @@ static VAStatus v4l2_UnmapBuffer(
 
     /* Unmap DeriveImage buffers - these are mmap'd directly from V4L2 */
     if (buffer->type == VAImageBufferType && buffer->surface_id != 0 &&
-        buffer->data != NULL) {
+        buffer->data != NULL && !buffer->external) {
         V4L2Surface *surface = get_surface(drv, buffer->surface_id);
         if (surface && surface->context && buffer->capture_idx >= 0) {
+            v4l2_capture_end_cpu(surface->context, buffer->capture_idx, buffer->sync_flags);
             v4l2_requeue_capture(surface->context, buffer->capture_idx);
         }
         munmap(buffer->data, buffer->element_size);
@@ -719,6 +1157,9 @@ static VAStatus v4l2_UnmapBuffer(
         buffer->capture_idx = -1;
         buffer->in_use = false;
         LOG("UnmapBuffer: Unmapped DeriveImage buffer %d", buf_id);
+
+        if (buffer->destroy_pending)
+            v4l2_DestroyBuffer(ctx, buf_id);
     }
 
     return VA_STATUS_SUCCESS;
@@ -730,6 +1171,11 @@ static VAStatus v4l2_DestroyBuffer(
 {
     V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
     int idx = BUFFER_INDEX(buf_id);
+    V4L2Buffer *pending = get_buffer(drv, buf_id);
+
+    /* Never free an image a queued GetImage is still writing */
+    if (pending)
+        readback_wait(drv->dev, pending->readback_seq, VA_TIMEOUT_INFINITE);
 
     pthread_mutex_lock(&drv->mutex);
     if (idx < 0 || idx >= MAX_BUFFERS || drv->buffers[idx] == NULL) {
@@ -737,21 +1183,42 @@ static VAStatus v4l2_DestroyBuffer(
         return VA_STATUS_SUCCESS;
     }
 
-    /* If an image buffer is still marked in use, defer free */
+    /* If an image buffer is still marked in use, defer free to UnmapBuffer */
     if (drv->buffers[idx]->type == VAImageBufferType && drv->buffers[idx]->in_use) {
+        drv->buffers[idx]->destroy_pending = true;
         pthread_mutex_unlock(&drv->mutex);
         LOG("DestroyBuffer: buffer %d still in use, deferring free", buf_id);
         return VA_STATUS_SUCCESS;
     }
 
-    free(drv->buffers[idx]->data);
-    free(drv->buffers[idx]);
+    buffer_free(drv, drv->buffers[idx]);
     drv->buffers[idx] = NULL;
+    drv->num_buffers--;
     pthread_mutex_unlock(&drv->mutex);
 
     return VA_STATUS_SUCCESS;
 }
 
+#if VA_CHECK_VERSION(1, 15, 0)
+/* Completion of an asynchronous GetImage into this buffer */
+static VAStatus v4l2_SyncBuffer(
+    VADriverContextP ctx,
+    VABufferID buf_id,
+    uint64_t timeout_ns)
+{
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
+    V4L2Buffer *buffer = get_buffer(drv, buf_id);
+
+    if (buffer == NULL)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    VAStatus status = readback_wait(drv->dev, buffer->readback_seq, timeout_ns);
+    if (status != VA_STATUS_SUCCESS)
+        return status;
+    return buffer->readback_status;
+}
+#endif
+
 static VAStatus v4l2_BeginPicture(
     VADriverContextP ctx,
     VAContextID context_id,
@@ -768,11 +1235,22 @@ static VAStatus v4l2_BeginPicture(
 
     pthread_mutex_lock(&context->mutex);
 
+    /* Re-acquire V4L2 buffers if the context was suspended while idle */
+    if (idle_resume(context) < 0) {
+        pthread_mutex_unlock(&context->mutex);
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    /* A picture ended for vaMFSubmit but never submitted is decoded now */
+    mf_submit_pending(context);
+
     /* If this surface held a previous capture buffer, return it so decoding can progress */
+    readback_wait(drv->dev, surface->readback_seq, VA_TIMEOUT_INFINITE);
     if (surface->context && surface->capture_idx >= 0) {
         v4l2_requeue_capture(surface->context, surface->capture_idx);
     }
     surface->capture_idx = -1;
+    framecache_release(surface);
 
     /* Reset bitstream buffer for this picture */
     bitstream_reset(&context->bitstream);
@@ -780,10 +1258,16 @@ static VAStatus v4l2_BeginPicture(
     context->last_slice_params = NULL;
     context->last_slice_count = 0;
     context->num_frame_buffers = 0;
+    context->keyframe = false;
+    context->show_frame = true;
+    context->reference = true;
+    context->param_sets_size = 0;
+    context->picture_seq++;
 
     surface->context = context;
     surface->decoded = false;
     surface->no_output = false;
+    surface_clear_error(surface);
 
     pthread_mutex_unlock(&context->mutex);
 
@@ -838,45 +1322,185 @@ static VAStatus v4l2_RenderPicture(
         }
     }
 
+    /*
+     * Slice streaming: hand this call's slices to the decoder right away.
+     * The picture's buffers share one timestamp and never contain data of
+     * another picture, so access units stay intact. The first picture
+     * (stream start waits for SOURCE_CHANGE) and pictures dropped while
+     * resyncing still go through EndPicture.
+     */
+    if (context->slice_streaming && context->streaming_output &&
+        context->bitstream.size > 0 &&
+        (!context->recovery.resync || context->keyframe)) {
+        if (v4l2_queue_bitstream(context, context->bitstream.data,
+                                 context->bitstream.size, context->picture_seq) < 0) {
+            LOG("Failed to queue slice group");
+            v4l2_resync(context, "OUTPUT queue stalled");
+            pthread_mutex_unlock(&context->mutex);
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        bitstream_reset(&context->bitstream);
+    }
+
     pthread_mutex_unlock(&context->mutex);
     return VA_STATUS_SUCCESS;
 }
 
-static VAStatus v4l2_EndPicture(
-    VADriverContextP ctx,
-    VAContextID context_id)
+/*
+ * Hand the picture collected since BeginPicture to the decoder. Called with
+ * context->mutex held. *wait is set when the render target's frame is
+ * expected right behind its bitstream and worth waiting for.
+ */
+static VAStatus picture_submit(V4L2Context *context, bool *wait)
 {
-    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
-    V4L2Context *context = get_context(drv, context_id);
-
-    if (context == NULL)
-        return VA_STATUS_ERROR_INVALID_CONTEXT;
-
-    pthread_mutex_lock(&context->mutex);
+    *wait = false;
 
     /* Allow codec to do any final bitstream preparation */
     if (context->codec && context->codec->prepare_bitstream) {
         context->codec->prepare_bitstream(context);
     }
+    mem_track_staging(context);
 
-    /* Submit bitstream to V4L2 OUTPUT queue */
+    /* Keyframe-only mode: other pictures complete at once, without output */
+    if (context->keyframe_only && !context->keyframe) {
+        if (context->render_target) {
+            context->render_target->decoded = true;
+            context->render_target->no_output = true;
+        }
+        return VA_STATUS_SUCCESS;
+    }
+
+    /* After a decoder error, nothing before the next keyframe can be decoded */
+    if (context->recovery.resync) {
+        if (!context->keyframe) {
+            context->recovery.skipped++;
+            if (context->render_target) {
+                context->render_target->decoded = true;
+                context->render_target->no_output = true;
+                surface_set_error(context->render_target, VADecodeSliceMissing);
+            }
+            return VA_STATUS_SUCCESS;
+        }
+        LOG("Resync: keyframe after %u skipped pictures, decoding resumed",
+            context->recovery.skipped);
+        context->recovery.resync = false;
+    }
+
+    /* Under overload, non-reference pictures never reach the decoder */
+    if (drop_picture(context))
+        return VA_STATUS_SUCCESS;
+
+    /* A picture decoded before (scrubbing, reverse stepping) is shown from memory */
+    if (framecache_lookup(context, context->render_target))
+        return VA_STATUS_SUCCESS;
+
+    /*
+     * Packing: the picture joins the open batch; collect whatever frames
+     * are already done but never wait here, a batch may not be queued yet.
+     */
+    if (context->pack.max_pictures > 0) {
+        bool was_streaming = context->streaming_output;
+        if (pack_add(context, context->render_target) < 0) {
+            LOG("Failed to queue packed pictures");
+            if (was_streaming)
+                v4l2_resync(context, "OUTPUT queue stalled");
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        while (v4l2_dequeue_frame(context, NULL, 0) == 0)
+            ;
+        return VA_STATUS_SUCCESS;
+    }
+
+    /* Submit bitstream to V4L2 OUTPUT queue */
     if (context->bitstream.size > 0) {
+        bool was_streaming = context->streaming_output;
         int ret = v4l2_queue_bitstream(context, context->bitstream.data,
-                                        context->bitstream.size);
+                                        context->bitstream.size, context->picture_seq);
         if (ret < 0) {
             LOG("Failed to queue bitstream");
-            pthread_mutex_unlock(&context->mutex);
+            /* A decoder that stops accepting input mid-stream needs a restart */
+            if (was_streaming)
+                v4l2_resync(context, "OUTPUT queue stalled");
             return VA_STATUS_ERROR_OPERATION_FAILED;
         }
     }
 
+    *wait = context->render_target != NULL;
+    return VA_STATUS_SUCCESS;
+}
+
+/*
+ * How long to wait for a picture's frame after queueing it. Without display
+ * delay the frame comes out right behind its bitstream, so a short wait
+ * suffices; a longer one only stalls on pictures that are never shown.
+ */
+static int picture_wait_ms(const V4L2Context *context)
+{
+    return context->low_latency ? LOW_LATENCY_DEQUEUE_MS : DEQUEUE_TIMEOUT_MS;
+}
+
+/*
+ * Submit the picture of an MF member that vaEndPicture left for vaMFSubmit,
+ * without waiting for its frame. Called with context->mutex held.
+ */
+static void mf_submit_pending(V4L2Context *context)
+{
+    bool wait;
+
+    if (!context->mf_pending)
+        return;
+    context->mf_pending = false;
+    picture_submit(context, &wait);
+}
+
+static VAStatus v4l2_EndPicture(
+    VADriverContextP ctx,
+    VAContextID context_id)
+{
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
+    V4L2Context *context = get_context(drv, context_id);
+    bool wait;
+
+    if (context == NULL)
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+
+    pthread_mutex_lock(&context->mutex);
+
+    /* MF members are submitted, and waited for, by vaMFSubmit */
+    if (context->mf_groups > 0) {
+        context->mf_pending = true;
+        pthread_mutex_unlock(&context->mutex);
+        return VA_STATUS_SUCCESS;
+    }
+
+    VAStatus status = picture_submit(context, &wait);
+
     /* Try to dequeue a decoded frame */
-    if (context->render_target) {
-        v4l2_dequeue_frame(context, context->render_target);
+    if (status == VA_STATUS_SUCCESS && wait) {
+        v4l2_dequeue_frame(context, context->render_target, picture_wait_ms(context));
     }
 
     pthread_mutex_unlock(&context->mutex);
-    return VA_STATUS_SUCCESS;
+    return status;
+}
+
+/*
+ * Is the surface's picture still in its context's open pack batch? Such a
+ * picture is not even queued, so it only decodes once something flushes
+ * the batch.
+ */
+static bool surface_packed(V4L2Surface *surface)
+{
+    V4L2Context *context = surface->context;
+    bool pending = false;
+
+    if (context == NULL || surface->decoded || context->pack.max_pictures == 0)
+        return false;
+
+    pthread_mutex_lock(&context->mutex);
+    pending = pack_pending(context, surface);
+    pthread_mutex_unlock(&context->mutex);
+    return pending;
 }
 
 static VAStatus v4l2_SyncSurface(
@@ -894,8 +1518,9 @@ static VAStatus v4l2_SyncSurface(
     /* If no decode context or already decoded, surface is ready */
     if (surface->context == NULL) {
         surface->decoded = true;
+        VAStatus status = surface->decode_status;
         pthread_mutex_unlock(&surface->mutex);
-        return VA_STATUS_SUCCESS;
+        return status;
     }
 
     /* Try to dequeue from V4L2 with limited retries */
@@ -905,15 +1530,27 @@ static VAStatus v4l2_SyncSurface(
     while (!surface->decoded && retries-- > 0) {
         pthread_mutex_unlock(&surface->mutex);
 
+        struct timespec before, after;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+
         pthread_mutex_lock(&context->mutex);
-        v4l2_dequeue_frame(context, surface);
+        /* A packed picture must leave the open batch before it can decode */
+        if (pack_pending(context, surface))
+            pack_flush(context);
+        /* The wait itself is paced by the context's latency model */
+        v4l2_dequeue_frame(context, surface, DEQUEUE_TIMEOUT_MS);
         pthread_mutex_unlock(&context->mutex);
 
         pthread_mutex_lock(&surface->mutex);
-        if (!surface->decoded) {
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        long waited_us = (after.tv_sec - before.tv_sec) * 1000000 +
+                         (after.tv_nsec - before.tv_nsec) / 1000;
+
+        /* Only back off if the dequeue gave up without waiting (events, errors) */
+        if (!surface->decoded && waited_us < SYNC_BACKOFF_US) {
             struct timespec ts;
             clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_nsec += 10000000;  /* 10ms */
+            ts.tv_nsec += SYNC_BACKOFF_US * 1000L;
             if (ts.tv_nsec >= 1000000000) {
                 ts.tv_sec++;
                 ts.tv_nsec -= 1000000000;
@@ -922,11 +1559,28 @@ static VAStatus v4l2_SyncSurface(
         }
     }
 
-    /* Mark as ready after timeout to prevent hangs */
+    /* Mark as ready after timeout to prevent hangs, but report it as damaged */
+    bool timed_out = !surface->decoded;
+    if (timed_out)
+        surface_set_error(surface, VADecodeSliceMissing);
     surface->decoded = true;
+    VAStatus status = surface->decode_status;
     pthread_mutex_unlock(&surface->mutex);
 
-    return VA_STATUS_SUCCESS;
+    if (timed_out) {
+        /*
+         * A few missing frames are normal while the decoder fills its
+         * reorder queue. Once it has produced output, repeated timeouts
+         * mean it is wedged.
+         */
+        pthread_mutex_lock(&context->mutex);
+        if (context->recovery.have_output &&
+            ++context->recovery.timeouts >= RECOVERY_MAX_TIMEOUTS)
+            v4l2_resync(context, "decoder stopped producing frames");
+        pthread_mutex_unlock(&context->mutex);
+    }
+
+    return status;
 }
 
 static VAStatus v4l2_QuerySurfaceStatus(
@@ -940,17 +1594,42 @@ static VAStatus v4l2_QuerySurfaceStatus(
     if (surface == NULL)
         return VA_STATUS_ERROR_INVALID_SURFACE;
 
+    V4L2Context *context = surface->context;
+    if (!surface->decoded && context != NULL) {
+        pthread_mutex_lock(&context->mutex);
+        if (pack_pending(context, surface)) {
+            /* Batched, not late: queue the batch and collect what is done */
+            pack_flush(context);
+            while (v4l2_dequeue_frame(context, NULL, 0) == 0)
+                ;
+        } else {
+            /* An app polling for a frame that is not there yet is falling behind */
+            drop_hint(context);
+        }
+        pthread_mutex_unlock(&context->mutex);
+    }
+
     *status = surface->decoded ? VASurfaceReady : VASurfaceRendering;
     return VA_STATUS_SUCCESS;
 }
 
 static VAStatus v4l2_QuerySurfaceError(
     VADriverContextP ctx,
-    VASurfaceID surface,
+    VASurfaceID surface_id,
     VAStatus error_status,
     void **error_info)
 {
-    *error_info = NULL;
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
+    V4L2Surface *surface = get_surface(drv, surface_id);
+
+    if (surface == NULL)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    if (error_status != VA_STATUS_ERROR_DECODING_ERROR)
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+
+    /* Array of VASurfaceDecodeMBErrors, terminated by status == -1 */
+    *error_info = surface->mb_errors;
     return VA_STATUS_SUCCESS;
 }
 
@@ -975,11 +1654,14 @@ static VAStatus v4l2_QueryImageFormats(
     VAImageFormat *format_list,
     int *num_formats)
 {
-    /* Support NV12 (main output format from V4L2 decoders) */
+    /* NV12 for 8-bit streams, P010 for 10-bit; readback converts any CAPTURE layout */
     format_list[0].fourcc = VA_FOURCC_NV12;
     format_list[0].byte_order = VA_LSB_FIRST;
     format_list[0].bits_per_pixel = 12;
-    *num_formats = 1;
+    format_list[1].fourcc = VA_FOURCC_P010;
+    format_list[1].byte_order = VA_LSB_FIRST;
+    format_list[1].bits_per_pixel = 24;
+    *num_formats = 2;
 
     return VA_STATUS_SUCCESS;
 }
@@ -993,28 +1675,23 @@ static VAStatus v4l2_CreateImage(
 {
     V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
 
-    /* Allocate a single ID for both image and buffer (simplifies lookup) */
-    VAGenericID id = allocate_buffer_id(drv);
-    if (id == VA_INVALID_ID)
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
-
     memset(image, 0, sizeof(*image));
-    image->image_id = id;
     image->format = *format;
     image->width = width;
     image->height = height;
 
-    if (format->fourcc == VA_FOURCC_NV12) {
+    if (format->fourcc == VA_FOURCC_NV12 || format->fourcc == VA_FOURCC_P010) {
+        int bpp = format->fourcc == VA_FOURCC_P010 ? 2 : 1;
         image->num_planes = 2;
-        image->pitches[0] = width;
-        image->pitches[1] = width;
+        image->pitches[0] = width * bpp;
+        image->pitches[1] = width * bpp;
         image->offsets[0] = 0;
-        image->offsets[1] = width * height;
-        image->data_size = width * height * 3 / 2;
+        image->offsets[1] = width * bpp * height;
+        image->data_size = width * bpp * height * 3 / 2;
     }
 
     /* Create buffer to hold image data */
-    V4L2Buffer *buffer = calloc(1, sizeof(V4L2Buffer));
+    V4L2Buffer *buffer = buffer_get(drv->dev, 0);
     if (buffer == NULL)
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
@@ -1023,18 +1700,68 @@ static VAStatus v4l2_CreateImage(
     buffer->element_size = image->data_size;
     buffer->width = width;
     buffer->height = height;
-    buffer->data = malloc(image->data_size);
-    if (buffer->data == NULL) {
-        free(buffer);
+    buffer->fourcc = format->fourcc;
+    if (image_pool_get(drv->dev, buffer) < 0) {
+        buffer_put(drv->dev, buffer);
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
     }
 
-    drv->buffers[BUFFER_INDEX(id)] = buffer;
+    /* Allocate a single ID for both image and buffer (simplifies lookup) */
+    VAGenericID id = allocate_buffer_id(drv, buffer);
+    if (id == VA_INVALID_ID) {
+        buffer_free(drv, buffer);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    image->image_id = id;
     image->buf = id;  /* Use same ID for buffer */
 
-    LOG("CreateImage: id=%d, %dx%d NV12, data_size=%d",
-        id, width, height, image->data_size);
+    LOG("CreateImage: id=%d, %dx%d %.4s, data_size=%d",
+        id, width, height, (char *)&format->fourcc, image->data_size);
+
+    return VA_STATUS_SUCCESS;
+}
+
+/* Image over the application memory of a user-pointer surface */
+static VAStatus derive_user_image(V4L2Driver *drv, VASurfaceID surface_id,
+                                  V4L2Surface *surface, VAImage *image)
+{
+    if (!surface->decoded)
+        return VA_STATUS_ERROR_SURFACE_BUSY;
+
+    bool p010 = surface->fourcc == V4L2_PIX_FMT_P010;
+
+    memset(image, 0, sizeof(*image));
+    image->format.fourcc = p010 ? VA_FOURCC_P010 : VA_FOURCC_NV12;
+    image->format.byte_order = VA_LSB_FIRST;
+    image->format.bits_per_pixel = p010 ? 24 : 12;
+    image->width = surface->width;
+    image->height = surface->height;
+    image->num_planes = 2;
+    for (int p = 0; p < 2; p++) {
+        image->pitches[p] = surface->user_pitches[p];
+        image->offsets[p] = surface->user_offsets[p];
+    }
+    image->data_size = surface->user_size;
+
+    V4L2Buffer *buffer = buffer_get(drv->dev, 0);
+    if (buffer == NULL)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+    buffer->type = VAImageBufferType;
+    buffer->num_elements = 1;
+    buffer->element_size = image->data_size;
+    buffer->data = surface->user_ptr;
+    buffer->external = true;
+    buffer->surface_id = surface_id;
+    buffer->capture_idx = -1;
 
+    VAGenericID buf_id = allocate_buffer_id(drv, buffer);
+    if (buf_id == VA_INVALID_ID) {
+        buffer_free(drv, buffer);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    image->image_id = buf_id;
+    image->buf = buf_id;
     return VA_STATUS_SUCCESS;
 }
 
@@ -1052,6 +1779,14 @@ static VAStatus v4l2_DeriveImage(
     LOG("DeriveImage: surface=%d, context=%p, capture_idx=%d, decoded=%d",
         surface_id, surface->context, surface->capture_idx, surface->decoded);
 
+    /* User-pointer surfaces already hold the frame in the application's layout */
+    if (surface->user_ptr)
+        return derive_user_image(drv, surface_id, surface, image);
+
+    /* A picture still in the open pack batch is decoded first */
+    if (surface_packed(surface))
+        v4l2_SyncSurface(ctx, surface_id);
+
     /* Surface must have been decoded (associated with a V4L2 CAPTURE buffer) */
     if (surface->context == NULL) {
         LOG("DeriveImage: No context associated with surface");
@@ -1063,28 +1798,45 @@ static VAStatus v4l2_DeriveImage(
         return VA_STATUS_ERROR_SURFACE_BUSY;
     }
 
-    /* Create a buffer to hold the image info */
-    VAGenericID buf_id = allocate_buffer_id(drv);
-    if (buf_id == VA_INVALID_ID)
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    /*
+     * The image is the CAPTURE buffer as the decoder laid it out. It is
+     * mapped as one piece, so multi-planar formats can't be derived; those
+     * are read back with vaGetImage.
+     */
+    const struct v4l2_pix_format_mplane *fmt = &surface->context->capture_fmt;
+    uint32_t fourcc = format_va_fourcc(fmt->pixelformat);
+    if (fourcc == 0 || fmt->num_planes > 1) {
+        LOG("DeriveImage: CAPTURE format %.4s can't be mapped as one image",
+            (char *)&fmt->pixelformat);
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    uint32_t pitch = fmt->plane_fmt[0].bytesperline;
+    uint32_t luma = pitch * fmt->height;
 
-    /* Setup image structure for NV12 format */
     memset(image, 0, sizeof(*image));
-    image->image_id = buf_id;
-    image->format.fourcc = VA_FOURCC_NV12;
+    image->format.fourcc = fourcc;
     image->format.byte_order = VA_LSB_FIRST;
-    image->format.bits_per_pixel = 12;
+    image->format.bits_per_pixel = fourcc == VA_FOURCC_P010 ? 24 : 12;
     image->width = surface->width;
     image->height = surface->height;
-    image->num_planes = 2;
-    image->pitches[0] = surface->width;  /* Y plane stride */
-    image->pitches[1] = surface->width;  /* UV plane stride */
+    image->pitches[0] = pitch;
     image->offsets[0] = 0;
-    image->offsets[1] = surface->width * surface->height;  /* UV offset */
-    image->data_size = surface->width * surface->height * 3 / 2;
+    if (fourcc == VA_FOURCC_I420) {
+        image->num_planes = 3;
+        image->pitches[1] = pitch / 2;
+        image->pitches[2] = pitch / 2;
+        image->offsets[1] = luma;
+        image->offsets[2] = luma + (pitch / 2) * ((fmt->height + 1) / 2);
+    } else {
+        image->num_planes = 2;
+        image->pitches[1] = pitch;
+        image->offsets[1] = luma;
+    }
+    image->data_size = fmt->plane_fmt[0].sizeimage;
 
     /* Create a buffer object to track this */
-    V4L2Buffer *buffer = calloc(1, sizeof(V4L2Buffer));
+    V4L2Buffer *buffer = buffer_get(drv->dev, 0);
     if (buffer == NULL)
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
@@ -1096,11 +1848,16 @@ static VAStatus v4l2_DeriveImage(
     /* Store the surface info for MapBuffer */
     buffer->surface_id = surface_id;
 
-    drv->buffers[BUFFER_INDEX(buf_id)] = buffer;
+    VAGenericID buf_id = allocate_buffer_id(drv, buffer);
+    if (buf_id == VA_INVALID_ID) {
+        buffer_put(drv->dev, buffer);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    image->image_id = buf_id;
     image->buf = buf_id;
 
-    LOG("DeriveImage: Created image %d for surface %d (%dx%d NV12)",
-        buf_id, surface_id, surface->width, surface->height);
+    LOG("DeriveImage: Created image %d for surface %d (%dx%d %.4s)",
+        buf_id, surface_id, surface->width, surface->height, (char *)&fourcc);
 
     return VA_STATUS_SUCCESS;
 }
@@ -1109,7 +1866,8 @@ static VAStatus v4l2_DestroyImage(
     VADriverContextP ctx,
     VAImageID image)
 {
-    return VA_STATUS_SUCCESS;
+    /* Images share their ID with their buffer; its memory goes back to the pool */
+    return v4l2_DestroyBuffer(ctx, image);
 }
 
 static VAStatus v4l2_SetImagePalette(
@@ -1144,6 +1902,46 @@ static VAStatus v4l2_GetImage(
     LOG("GetImage: surface=%d, image=%d, capture_idx=%d, decoded=%d, context=%p",
         surface_id, image_id, surface->capture_idx, surface->decoded, surface->context);
 
+    /* A picture still in the open pack batch is decoded first */
+    if (surface_packed(surface))
+        v4l2_SyncSurface(ctx, surface_id);
+
+    /* The image is laid out as vaCreateImage made it: NV12 or P010, plane after plane */
+    bool p010 = image_buf->fourcc == VA_FOURCC_P010;
+    uint32_t bpp = p010 ? 2 : 1;
+    uint32_t row = image_buf->width * bpp;
+    uint32_t pitches[2] = { row, row };
+    uint32_t offsets[2] = { 0, row * image_buf->height };
+
+    /* User-pointer surfaces: the frame was copied out when it was decoded */
+    if (surface->user_ptr && surface->decoded) {
+        uint32_t fourcc = surface->fourcc == V4L2_PIX_FMT_P010 ? VA_FOURCC_P010 : VA_FOURCC_NV12;
+        if (image_buf->fourcc != fourcc) {
+            LOG("GetImage: image format %.4s does not match the surface's %.4s",
+                (char *)&image_buf->fourcc, (char *)&fourcc);
+            return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+        }
+
+        uint32_t width = image_buf->width < surface->width ? image_buf->width : surface->width;
+        uint32_t height = image_buf->height < surface->height ? image_buf->height : surface->height;
+        uint32_t bytes[2] = { width * bpp, ((width + 1) & ~1u) * bpp };
+        uint32_t rows[2] = { height, (height + 1) / 2 };
+        if (bytes[1] > pitches[1])
+            bytes[1] = pitches[1];
+        if (image_buf->element_size < offsets[1] + (size_t)pitches[1] * rows[1])
+            return VA_STATUS_ERROR_INVALID_IMAGE;
+
+        readback_wait(drv->dev, image_buf->readback_seq, VA_TIMEOUT_INFINITE);
+        for (int p = 0; p < 2; p++) {
+            const uint8_t *src = surface->user_ptr + surface->user_offsets[p];
+            uint8_t *dst = (uint8_t *)image_buf->data + offsets[p];
+            for (uint32_t r = 0; r < rows[p]; r++)
+                memcpy(dst + (size_t)r * pitches[p], src + (size_t)r * surface->user_pitches[p],
+                       bytes[p]);
+        }
+        return VA_STATUS_SUCCESS;
+    }
+
     /* Surface must have been decoded */
     if (!surface->decoded || surface->context == NULL) {
         LOG("GetImage: Surface not decoded yet");
@@ -1152,81 +1950,58 @@ static VAStatus v4l2_GetImage(
 
     V4L2Context *context = surface->context;
 
-    if (surface->capture_idx < 0 || surface->capture_idx >= context->num_capture_buffers) {
-        LOG("GetImage: Invalid capture_idx %d", surface->capture_idx);
-        return VA_STATUS_ERROR_INVALID_SURFACE;
+    /* Readback converts layouts, never bit depths: P010_4L4 reads back as P010 */
+    if (p010 != (format_bpp(context->capture_fmt.pixelformat) == 2)) {
+        LOG("GetImage: image format does not match the %.4s CAPTURE format",
+            (char *)&context->capture_fmt.pixelformat);
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
     }
 
-    /* Get cached mmap or create new one */
-    V4L2MmapBuffer *cap_buf = &context->capture_buffers[surface->capture_idx];
-    void *y_plane = cap_buf->plane0_ptr;
-    void *uv_plane = cap_buf->plane1_ptr;
-
-    if (y_plane == NULL || uv_plane == NULL) {
-        /* Need to mmap the CAPTURE buffer planes */
-        struct v4l2_buffer buf;
-        struct v4l2_plane planes[2];
-        memset(&buf, 0, sizeof(buf));
-        memset(&planes, 0, sizeof(planes));
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = surface->capture_idx;
-        buf.length = 2;  /* NM12 has 2 planes */
-        buf.m.planes = planes;
-
-        if (ioctl(context->v4l2_fd, VIDIOC_QUERYBUF, &buf) < 0) {
-            LOG("GetImage: Failed to query CAPTURE buffer: %s", strerror(errno));
-            return VA_STATUS_ERROR_OPERATION_FAILED;
-        }
-
-        y_plane = mmap(NULL, planes[0].length, PROT_READ, MAP_SHARED,
-                       context->v4l2_fd, planes[0].m.mem_offset);
-        if (y_plane == MAP_FAILED) {
-            LOG("GetImage: Failed to mmap Y plane: %s", strerror(errno));
-            return VA_STATUS_ERROR_OPERATION_FAILED;
+    /* Served from the frame cache: same plane layout, system memory */
+    void *cached_planes[2];
+    size_t cached_lens[2];
+    if (framecache_planes(surface, cached_planes, cached_lens) == 0) {
+        if (drv->dev->readback) {
+            readback_queue(drv->dev, context, surface, image_buf, cached_planes[0], cached_planes[1],
+                           -1, pitches, offsets);
+            return VA_STATUS_SUCCESS;
         }
-
-        uv_plane = mmap(NULL, planes[1].length, PROT_READ, MAP_SHARED,
-                        context->v4l2_fd, planes[1].m.mem_offset);
-        if (uv_plane == MAP_FAILED) {
-            munmap(y_plane, planes[0].length);
-            LOG("GetImage: Failed to mmap UV plane: %s", strerror(errno));
+        if (surface_copy_frame(context, cached_planes[0], cached_planes[1], image_buf->data,
+                               pitches, offsets, image_buf->element_size, image_buf->height) < 0)
             return VA_STATUS_ERROR_OPERATION_FAILED;
-        }
+        return VA_STATUS_SUCCESS;
+    }
 
-        /* Cache the mmap pointers */
-        cap_buf->plane0_ptr = y_plane;
-        cap_buf->plane1_ptr = uv_plane;
-        cap_buf->plane0_len = planes[0].length;
-        cap_buf->plane1_len = planes[1].length;
+    if (surface->capture_idx < 0 || surface->capture_idx >= context->num_capture_buffers) {
+        LOG("GetImage: Invalid capture_idx %d", surface->capture_idx);
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
 
-        LOG("GetImage: Cached mmap for buffer %d (Y=%zu, UV=%zu)",
-            surface->capture_idx, planes[0].length, planes[1].length);
+    if (v4l2_map_capture(context, surface->capture_idx) < 0) {
+        LOG("GetImage: Failed to map CAPTURE buffer %d", surface->capture_idx);
+        return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
     /*
-     * Use the actual V4L2 buffer plane sizes, not calculated surface sizes.
-     * V4L2 may align height (e.g., 720 -> 704) so buffer may be smaller
-     * than expected. Copying surface dimensions would read past buffer end.
+     * Walk the frame in whatever layout the decoder negotiated, visible rows
+     * only: V4L2 may align height (e.g. 720 -> 704 rows of chroma offset),
+     * and the image is sized for the surface, not the coded frame.
      */
-    size_t y_size = cap_buf->plane0_len;
-    size_t uv_size = cap_buf->plane1_len;
-
-    /* Sanity check: ensure we don't overflow image buffer */
-    size_t expected_size = surface->width * surface->height * 3 / 2;
-    if (y_size + uv_size > expected_size) {
-        /* Buffer larger than expected, clamp to surface dimensions */
-        y_size = surface->width * surface->height;
-        uv_size = y_size / 2;
+    V4L2MmapBuffer *cap_buf = &context->capture_buffers[surface->capture_idx];
+    if (drv->dev->readback) {
+        readback_queue(drv->dev, context, surface, image_buf, cap_buf->plane0_ptr, cap_buf->plane1_ptr,
+                       surface->capture_idx, pitches, offsets);
+        return VA_STATUS_SUCCESS;
     }
+    v4l2_capture_begin_cpu(context, surface->capture_idx, DMA_BUF_SYNC_READ);
+    int ret = surface_copy_frame(context, cap_buf->plane0_ptr, cap_buf->plane1_ptr, image_buf->data,
+                                 pitches, offsets, image_buf->element_size, image_buf->height);
+    v4l2_capture_end_cpu(context, surface->capture_idx, DMA_BUF_SYNC_READ);
 
-    LOG("GetImage: Copying Y=%zu, UV=%zu bytes from capture buffer", y_size, uv_size);
-
-    /* Copy Y plane */
-    memcpy(image_buf->data, y_plane, y_size);
-    /* Copy UV plane */
-    memcpy((uint8_t *)image_buf->data + y_size, uv_plane, uv_size);
-
+    if (ret < 0) {
+        LOG("GetImage: Cannot copy CAPTURE format %.4s", (char *)&context->capture_fmt.pixelformat);
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
     return VA_STATUS_SUCCESS;
 }
 
@@ -1295,8 +2070,13 @@ static VAStatus v4l2_QuerySurfaceAttributes(
     VASurfaceAttrib *attrib_list,
     unsigned int *num_attribs)
 {
+    /* The size query must match what the fill below writes */
     if (attrib_list == NULL) {
+#if VA_CHECK_VERSION(1, 12, 0)
+        *num_attribs = 5;
+#else
         *num_attribs = 4;
+#endif
         return VA_STATUS_SUCCESS;
     }
 
@@ -1307,7 +2087,8 @@ static VAStatus v4l2_QuerySurfaceAttributes(
     attrib_list[i].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
     attrib_list[i].value.type = VAGenericValueTypeInteger;
     attrib_list[i].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_VA |
-                                   VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
+                                   VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME |
+                                   VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR;
     i++;
 
     /* Pixel format */
@@ -1330,6 +2111,15 @@ static VAStatus v4l2_QuerySurfaceAttributes(
     attrib_list[i].value.value.i = 4096;
     i++;
 
+#if VA_CHECK_VERSION(1, 12, 0)
+    /* Importers may name the layouts they read; tiled and AFBC need this */
+    attrib_list[i].type = VASurfaceAttribDRMFormatModifiers;
+    attrib_list[i].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attrib_list[i].value.type = VAGenericValueTypePointer;
+    attrib_list[i].value.value.p = NULL;
+    i++;
+#endif
+
     *num_attribs = i;
     return VA_STATUS_SUCCESS;
 }
@@ -1366,18 +2156,207 @@ static VAStatus v4l2_LockSurface(VADriverContextP ctx, VASurfaceID surface,
 static VAStatus v4l2_UnlockSurface(VADriverContextP ctx, VASurfaceID surface)
 { return VA_STATUS_ERROR_UNIMPLEMENTED; }
 
-/* MF (Multi-Frame) stubs */
+/*
+ * MF (Multi-Frame) API: decode contexts grouped so that one vaMFSubmit ends
+ * the current picture of several contexts and waits for all of them at once.
+ */
 static VAStatus v4l2_CreateMFContext(VADriverContextP ctx, VAMFContextID *mf_context)
-{ return VA_STATUS_ERROR_UNIMPLEMENTED; }
+{
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
 
-static VAStatus v4l2_MFAddContext(VADriverContextP ctx, VAMFContextID mf_context, VAContextID context)
-{ return VA_STATUS_ERROR_UNIMPLEMENTED; }
+    V4L2MFContext *mf = calloc(1, sizeof(V4L2MFContext));
+    if (mf == NULL)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
-static VAStatus v4l2_MFReleaseContext(VADriverContextP ctx, VAMFContextID mf_context, VAContextID context)
-{ return VA_STATUS_ERROR_UNIMPLEMENTED; }
+    VAGenericID id = allocate_mf_context_id(drv, mf);
+    if (id == VA_INVALID_ID) {
+        free(mf);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
 
-static VAStatus v4l2_MFSubmit(VADriverContextP ctx, VAMFContextID mf_context, VAContextID *contexts, int num_contexts)
-{ return VA_STATUS_ERROR_UNIMPLEMENTED; }
+    *mf_context = id;
+    LOG("Created MF context %d", id);
+    return VA_STATUS_SUCCESS;
+}
+
+/* Called with drv->mutex held */
+static int mf_find_member(const V4L2MFContext *mf, const V4L2Context *context)
+{
+    for (int i = 0; i < mf->num_members; i++) {
+        if (mf->members[i] == context)
+            return i;
+    }
+    return -1;
+}
+
+static V4L2MFContext *get_mf_context(V4L2Driver *drv, VAMFContextID id)
+{
+    int idx = MF_CONTEXT_INDEX(id);
+    if (idx >= 0 && idx < MAX_MF_CONTEXTS)
+        return drv->mf_contexts[idx];
+    return NULL;
+}
+
+static VAStatus v4l2_MFAddContext(VADriverContextP ctx, VAMFContextID mf_context, VAContextID context_id)
+{
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
+    VAStatus status = VA_STATUS_SUCCESS;
+
+    pthread_mutex_lock(&drv->mutex);
+    V4L2MFContext *mf = get_mf_context(drv, mf_context);
+    V4L2Context *context = get_context(drv, context_id);
+
+    if (mf == NULL) {
+        status = VA_STATUS_ERROR_INVALID_CONTEXT;
+    } else if (context == NULL || context->entrypoint != VAEntrypointVLD) {
+        status = VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
+    } else if (mf_find_member(mf, context) < 0) {
+        mf->members[mf->num_members++] = context;
+        /* EndPicture reads mf_groups under the context's own mutex */
+        pthread_mutex_lock(&context->mutex);
+        context->mf_groups++;
+        pthread_mutex_unlock(&context->mutex);
+    }
+    pthread_mutex_unlock(&drv->mutex);
+
+    return status;
+}
+
+static VAStatus v4l2_MFReleaseContext(VADriverContextP ctx, VAMFContextID mf_context, VAContextID context_id)
+{
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
+    VAStatus status = VA_STATUS_SUCCESS;
+
+    pthread_mutex_lock(&drv->mutex);
+    V4L2MFContext *mf = get_mf_context(drv, mf_context);
+    V4L2Context *context = get_context(drv, context_id);
+    int idx = (mf && context) ? mf_find_member(mf, context) : -1;
+
+    if (idx < 0) {
+        status = VA_STATUS_ERROR_INVALID_CONTEXT;
+    } else {
+        mf->members[idx] = mf->members[--mf->num_members];
+        /* Locked before drv->mutex is dropped, so DestroyContext cannot free it */
+        pthread_mutex_lock(&context->mutex);
+    }
+    pthread_mutex_unlock(&drv->mutex);
+
+    /* Out of its last group, an ended picture no longer waits for vaMFSubmit */
+    if (status == VA_STATUS_SUCCESS) {
+        if (--context->mf_groups == 0)
+            mf_submit_pending(context);
+        pthread_mutex_unlock(&context->mutex);
+    }
+    return status;
+}
+
+/*
+ * Submit the pictures vaEndPicture left pending on every listed context,
+ * then wait for their frames together: all pictures are queued in one pass
+ * and a single poll() covers every member's device. A listed context
+ * without a pending picture has nothing to submit. The members stay locked
+ * throughout, taken under drv->mutex, so none can be destroyed meanwhile.
+ */
+static VAStatus v4l2_MFSubmit(VADriverContextP ctx, VAMFContextID mf_context,
+    VAContextID *contexts, int num_contexts)
+{
+    V4L2Driver *drv = (V4L2Driver *)ctx->pDriverData;
+    V4L2Context *list[MAX_CONTEXTS];
+    V4L2Surface *targets[MAX_CONTEXTS];
+    bool wait[MAX_CONTEXTS];
+    bool locked[MAX_CONTEXTS];
+    VAStatus status = VA_STATUS_SUCCESS;
+    int timeout_ms = 0;
+
+    if (num_contexts <= 0 || num_contexts > MAX_CONTEXTS)
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&drv->mutex);
+    V4L2MFContext *mf = get_mf_context(drv, mf_context);
+    for (int i = 0; i < num_contexts; i++) {
+        list[i] = get_context(drv, contexts[i]);
+        if (mf == NULL || list[i] == NULL || mf_find_member(mf, list[i]) < 0) {
+            pthread_mutex_unlock(&drv->mutex);
+            return VA_STATUS_ERROR_INVALID_CONTEXT;
+        }
+    }
+    /* A context listed twice is locked once */
+    for (int i = 0; i < num_contexts; i++) {
+        locked[i] = true;
+        for (int j = 0; j < i && locked[i]; j++)
+            locked[i] = list[j] != list[i];
+        if (locked[i])
+            pthread_mutex_lock(&list[i]->mutex);
+    }
+    pthread_mutex_unlock(&drv->mutex);
+
+    /* Queue every member's picture */
+    for (int i = 0; i < num_contexts; i++) {
+        V4L2Context *context = list[i];
+
+        if (!context->mf_pending) {
+            wait[i] = false;
+            continue;
+        }
+        context->mf_pending = false;
+        VAStatus ret = picture_submit(context, &wait[i]);
+        targets[i] = context->render_target;
+        if (ret != VA_STATUS_SUCCESS) {
+            status = ret;
+            wait[i] = false;
+        }
+        if (wait[i] && picture_wait_ms(context) > timeout_ms)
+            timeout_ms = picture_wait_ms(context);
+    }
+
+    /* Harvest the frames with one wait across all devices */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (1) {
+        struct pollfd pfds[MAX_CONTEXTS];
+        int owner[MAX_CONTEXTS];
+        int nfds = 0;
+
+        for (int i = 0; i < num_contexts; i++) {
+            if (!wait[i])
+                continue;
+            if (targets[i]->decoded) {
+                wait[i] = false;
+                continue;
+            }
+            pfds[nfds].fd = list[i]->v4l2_fd;
+            pfds[nfds].events = POLLIN;
+            pfds[nfds].revents = 0;
+            owner[nfds++] = i;
+        }
+        if (nfds == 0)
+            break;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 +
+                                       (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (remaining <= 0 || poll(pfds, nfds, remaining) <= 0)
+            break;
+
+        for (int n = 0; n < nfds; n++) {
+            int i = owner[n];
+            if (pfds[n].revents & POLLIN) {
+                v4l2_dequeue_frame(list[i], targets[i], 0);
+            } else if (pfds[n].revents & (POLLERR | POLLHUP)) {
+                /* Nothing can come out of this queue right now; SyncSurface will retry */
+                wait[i] = false;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_contexts; i++) {
+        if (locked[i])
+            pthread_mutex_unlock(&list[i]->mutex);
+    }
+    return status;
+}
 
 static VAStatus v4l2_CreateBuffer2(VADriverContextP ctx, VAContextID context,
     VABufferType type, unsigned int width, unsigned int height,
@@ -1406,38 +2385,97 @@ static VAStatus v4l2_ExportSurfaceHandle(
         return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
     }
 
+    /* Application memory has no dma-buf behind it */
+    if (surface->user_ptr)
+        return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+
+    /* A picture still in the open pack batch is decoded first */
+    if (surface_packed(surface))
+        v4l2_SyncSurface(ctx, surface_id);
+
     if (surface->context == NULL || surface->capture_idx < 0)
         return VA_STATUS_ERROR_INVALID_SURFACE;
 
-    /* Export DMABuf from V4L2 CAPTURE buffer */
-    int fd = v4l2_export_dmabuf(surface->context, surface->capture_idx);
-    if (fd < 0)
+    V4L2Context *context = surface->context;
+    const struct v4l2_pix_format_mplane *fmt = &context->capture_fmt;
+    V4L2ExportFormat info;
+    if (format_export_info(fmt->pixelformat, &info) < 0) {
+        LOG("ExportSurfaceHandle: CAPTURE format %.4s can't be described",
+            (char *)&fmt->pixelformat);
         return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    /* Later CAPTURE negotiations rank formats for export */
+    format_set_consumer(context, CONSUMER_EXPORT);
 
-    if (mem_type == VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME) {
-        /* Simple DRM PRIME export - just return the fd */
-        VADRMPRIMESurfaceDescriptor *desc = (VADRMPRIMESurfaceDescriptor *)descriptor;
-        memset(desc, 0, sizeof(*desc));
-        desc->fourcc = VA_FOURCC_NV12;
-        desc->width = surface->width;
-        desc->height = surface->height;
-        desc->num_objects = 1;
-        desc->objects[0].fd = fd;
-        desc->objects[0].size = surface->width * surface->height * 3 / 2;
-        desc->objects[0].drm_format_modifier = DRM_FORMAT_MOD_LINEAR;
-        desc->num_layers = 2;
-        /* Y plane */
-        desc->layers[0].drm_format = DRM_FORMAT_R8;
-        desc->layers[0].num_planes = 1;
-        desc->layers[0].object_index[0] = 0;
-        desc->layers[0].offset[0] = 0;
-        desc->layers[0].pitch[0] = surface->width;
-        /* UV plane */
-        desc->layers[1].drm_format = DRM_FORMAT_RG88;
-        desc->layers[1].num_planes = 1;
-        desc->layers[1].object_index[0] = 0;
-        desc->layers[1].offset[0] = surface->width * surface->height;
-        desc->layers[1].pitch[0] = surface->width;
+    /*
+     * Export DMABuf from V4L2 CAPTURE buffer, one object per V4L2 plane. The
+     * driver keeps one exported fd per plane; the caller owns (and must
+     * close) its own dups.
+     */
+    VADRMPRIMESurfaceDescriptor *desc = (VADRMPRIMESurfaceDescriptor *)descriptor;
+    memset(desc, 0, sizeof(*desc));
+    desc->num_objects = fmt->num_planes > 1 ? 2 : 1;
+    for (uint32_t i = 0; i < desc->num_objects; i++) {
+        int cached_fd = v4l2_export_plane(context, surface->capture_idx, i);
+        int fd = cached_fd < 0 ? -1 : fcntl(cached_fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) {
+            LOG("ExportSurfaceHandle: Failed to export plane %u", i);
+            for (uint32_t j = 0; j < i; j++)
+                close(desc->objects[j].fd);
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        desc->objects[i].fd = fd;
+        desc->objects[i].size = fmt->plane_fmt[i].sizeimage;
+        desc->objects[i].drm_format_modifier = info.modifier;
+    }
+
+    /*
+     * Colour planes: luma, then chroma in the last object. Compressed
+     * layouts are one opaque plane that only a composed layer describes.
+     */
+    uint32_t fourcc = info.va_fourcc;
+    uint32_t num_planes = info.compressed ? 1 : fourcc == VA_FOURCC_I420 ? 3 : 2;
+    uint32_t pitch = fmt->plane_fmt[0].bytesperline;
+    uint32_t obj[3] = { 0, desc->num_objects - 1, desc->num_objects - 1 };
+    uint32_t offsets[3] = { 0, 0, 0 };
+    uint32_t pitches[3] = { pitch, pitch, pitch / 2 };
+    if (desc->num_objects > 1)
+        pitches[1] = fmt->plane_fmt[1].bytesperline;
+    else
+        offsets[1] = pitch * fmt->height;
+    if (fourcc == VA_FOURCC_I420) {
+        pitches[1] = pitch / 2;
+        offsets[2] = offsets[1] + (pitch / 2) * ((fmt->height + 1) / 2);
+    }
+
+    desc->fourcc = fourcc;
+    desc->width = surface->width;
+    desc->height = surface->height;
+
+    if ((flags & VA_EXPORT_SURFACE_COMPOSED_LAYERS) || info.compressed) {
+        desc->num_layers = 1;
+        desc->layers[0].drm_format = info.drm_format;
+        desc->layers[0].num_planes = num_planes;
+        for (uint32_t p = 0; p < num_planes; p++) {
+            desc->layers[0].object_index[p] = obj[p];
+            desc->layers[0].offset[p] = offsets[p];
+            desc->layers[0].pitch[p] = pitches[p];
+        }
+    } else {
+        desc->num_layers = num_planes;
+        for (uint32_t p = 0; p < num_planes; p++) {
+            if (fourcc == VA_FOURCC_P010)
+                desc->layers[p].drm_format = p == 0 ? DRM_FORMAT_R16 : DRM_FORMAT_GR1616;
+            else if (fourcc == VA_FOURCC_NV12)
+                desc->layers[p].drm_format = p == 0 ? DRM_FORMAT_R8 : DRM_FORMAT_GR88;
+            else
+                desc->layers[p].drm_format = DRM_FORMAT_R8;
+            desc->layers[p].num_planes = 1;
+            desc->layers[p].object_index[0] = obj[p];
+            desc->layers[p].offset[0] = offsets[p];
+            desc->layers[p].pitch[0] = pitches[p];
+        }
     }
 
     return VA_STATUS_SUCCESS;
@@ -1462,8 +2500,14 @@ static const struct VADriverVTable vtable = {
     VTABLE(CreateBuffer),
     VTABLE(BufferSetNumElements),
     VTABLE(MapBuffer),
+#if VA_CHECK_VERSION(1, 21, 0)
+    VTABLE(MapBuffer2),
+#endif
     VTABLE(UnmapBuffer),
     VTABLE(DestroyBuffer),
+#if VA_CHECK_VERSION(1, 15, 0)
+    VTABLE(SyncBuffer),
+#endif
     VTABLE(BeginPicture),
     VTABLE(RenderPicture),
     VTABLE(EndPicture),
@@ -1530,20 +2574,11 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx)
         drv->drm_fd = -1;
     }
 
-    /* Probe V4L2 device capabilities */
-    int fd = v4l2_open_device(drv);
-    if (fd < 0) {
-        LOG("No V4L2 M2M decoder found");
-        free(drv);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-
-    v4l2_probe_capabilities(drv, fd);
-    v4l2_close_device(drv, fd);
-
-    if (drv->num_supported_profiles == 0) {
-        LOG("No supported profiles found");
+    /* Probe results and pools come from the process-wide device */
+    if (registry_acquire(drv) < 0) {
+        pthread_mutex_destroy(&drv->mutex);
         free(drv);
+        ctx->pDriverData = NULL;
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
@@ -1558,6 +2593,8 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx)
 
     *ctx->vtable = vtable;
 
+    idle_start(drv);
+
     LOG("Driver initialized with %d profiles", drv->num_supported_profiles);
     return VA_STATUS_SUCCESS;
 }
@@ -32,20 +32,101 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <linux/videodev2.h>
 
-#define MAX_SURFACES 32
+/* Handle-table sizes; each ID range spans 0x1000, so none may exceed 4095 */
+#define MAX_SURFACES 2048
 #define MAX_BUFFERS 1024
 #define MAX_FRAME_BUFFERS 1024
 #define MAX_PROFILES 16
+#define MAX_CONFIGS 64
+#define MAX_CONTEXTS 64
+#define MAX_MF_CONTEXTS 16
 #define MAX_OUTPUT_BUFFERS 8
 #define MAX_CAPTURE_BUFFERS 16
+#define CAPTURE_MIN_BUFFERS 4   /* If the decoder does not report its minimum */
+#define MAX_MODIFIERS 8         /* DRM format modifiers kept per surface/context */
 #define BITSTREAM_BUFFER_SIZE (4 * 1024 * 1024)  /* 4MB */
 
+/* Low-latency mode: shallow queues, frames handed out as soon as decoded */
+#define LOW_LATENCY_OUTPUT_BUFFERS  2
+#define LOW_LATENCY_CAPTURE_EXTRA   3       /* On top of V4L2_CID_MIN_BUFFERS_FOR_CAPTURE */
+#define LOW_LATENCY_DEQUEUE_MS      50
+#define DEQUEUE_TIMEOUT_MS          500
+#define LATENCY_HISTORY             32      /* Pictures tracked for latency prediction */
+#define SPARE_BUFFERS               64      /* Destroyed VA buffers kept for reuse */
+#define MEM_PRESSURE_IDLE_MS        2000    /* Idle time before suspend when memory is tight */
+
+/* Multi-picture OUTPUT buffers (V4L2VA_PACK_FRAMES) */
+#define PACK_MAX_PICTURES           16
+#define PACK_MAX_BATCHES            (2 * MAX_OUTPUT_BUFFERS)
+
 /* Forward declarations */
 struct V4L2Context;
 struct V4L2Surface;
 struct V4L2Codec;
+struct V4L2Dump;
+struct V4L2FrameCache;
+struct V4L2ImagePool;
+struct V4L2Readback;
+struct V4L2CachedFrame;
+struct pollfd;
+
+/* Decode latency EWMA for one picture type (latency.c) */
+struct V4L2LatencyModel {
+    int64_t         mean_us;
+    int64_t         dev_us;         /* Mean absolute deviation */
+    unsigned int    samples;
+};
+
+/* Who reads a context's decoded frames; decides the CAPTURE format (format.c) */
+typedef enum {
+    CONSUMER_COPY = 0,          /* vaGetImage/vaDeriveImage, user-pointer surfaces */
+    CONSUMER_EXPORT,            /* vaExportSurfaceHandle to GPU or display */
+} V4L2Consumer;
+
+/* Frame checksum algorithms (V4L2VA_CHECKSUM) */
+typedef enum {
+    CHECKSUM_NONE = 0,
+    CHECKSUM_CRC32,
+    CHECKSUM_MD5,
+} V4L2ChecksumType;
+
+/* Frame dropping triggers (V4L2VA_DROP) */
+#define DROP_ON_QUEUE   (1 << 0)    /* Decoder input queue is backing up */
+#define DROP_ON_HINT    (1 << 1)    /* App polls surfaces that are not ready */
+
+/* Tiled CAPTURE layouts for copy consumers (V4L2VA_DETILE) */
+typedef enum {
+    DETILE_AUTO = 0,            /* From a resolution up (detile.c) */
+    DETILE_NEVER,
+    DETILE_ALWAYS,
+} V4L2DetilePolicy;
+
+/* Runtime options, read once from V4L2VA_* environment variables at load */
+typedef struct {
+    const char      *dump_dir;      /* V4L2VA_DUMP: write submitted bitstreams here */
+    V4L2ChecksumType checksum;      /* V4L2VA_CHECKSUM: hash each decoded frame */
+    const char      *checksum_file; /* V4L2VA_CHECKSUM_FILE: hash output (default: log) */
+    unsigned int    idle_timeout_ms; /* V4L2VA_IDLE_TIMEOUT_MS: suspend idle contexts (0 = never) */
+    bool            low_latency;    /* V4L2VA_LOW_LATENCY: no display delay, minimal queues */
+    bool            slice_streaming; /* V4L2VA_SLICE_STREAMING: QBUF slices as they arrive */
+    bool            keyframe_only;  /* V4L2VA_KEYFRAME_ONLY: decode random access points only */
+    int             pack_frames;    /* V4L2VA_PACK_FRAMES: pictures per OUTPUT buffer (VP8/VP9) */
+    unsigned int    drop_policy;    /* V4L2VA_DROP: DROP_ON_* triggers for skipping pictures */
+    int             frame_cache;    /* V4L2VA_FRAME_CACHE: decoded frames kept per context */
+    bool            cached_capture; /* V4L2VA_CACHED_CAPTURE: non-coherent CAPTURE buffers */
+    V4L2DetilePolicy detile;        /* V4L2VA_DETILE: let copy consumers take tiled layouts */
+    bool            mem_budget_set; /* V4L2VA_MEM_BUDGET_MB given (otherwise derived) */
+    unsigned int    mem_budget_mb;  /* V4L2VA_MEM_BUDGET_MB: driver-wide buffer budget, 0 = none */
+    bool            async_getimage; /* V4L2VA_ASYNC_GETIMAGE: copy on a worker, sync on the buffer */
+    bool            nal_filter_off; /* V4L2VA_NAL_FILTER=0: forward every NAL (nalfilter.c) */
+    uint64_t        drop_sei[4];    /* V4L2VA_DROP_SEI: SEI payload types to drop, bit per type */
+} V4L2Options;
+
+extern V4L2Options v4l2va_options;
 
 /* Growable buffer for accumulating bitstream data */
 typedef struct {
@@ -54,6 +135,20 @@ typedef struct {
     size_t      allocated;
 } BitstreamBuffer;
 
+/* NAL units to copy into a bitstream, each behind a start code (buffer.c) */
+typedef struct {
+    const void  *data;
+    size_t      size;
+} V4L2NalRef;
+
+typedef struct {
+    V4L2NalRef  *nals;
+    size_t      *offsets;       /* Output position of each NAL's start code */
+    int         count;
+    int         allocated;
+    size_t      bytes;          /* Output size so far, start codes included */
+} V4L2NalList;
+
 /* VA-API buffer wrapper */
 typedef struct {
     VABufferType    type;
@@ -63,8 +158,17 @@ typedef struct {
     VASurfaceID     surface_id;     /* For DeriveImage buffers */
     uint32_t        width;          /* For image buffers */
     uint32_t        height;         /* For image buffers */
+    uint32_t        fourcc;         /* For image buffers: VA_FOURCC_* */
     int             capture_idx;    /* For image buffers mapped from CAPTURE */
     bool            in_use;         /* For image buffers held by app */
+    bool            destroy_pending; /* DestroyBuffer while mapped; freed on unmap */
+    uint64_t        sync_flags;     /* DMA_BUF_SYNC_* of a mapped non-coherent CAPTURE buffer */
+    bool            external;       /* data is application memory: never freed or unmapped */
+    bool            pooled;         /* data belongs to the image pool (imagepool.c) */
+    size_t          data_mapped;    /* mmap length of pooled data, 0 if malloc'd */
+    size_t          data_capacity;  /* Size of data when the buffer allocated it, else 0 */
+    uint64_t        readback_seq;   /* Last asynchronous GetImage into it (readback.c) */
+    VAStatus        readback_status; /* Outcome of that copy */
 } V4L2Buffer;
 
 /* V4L2 memory-mapped buffer */
@@ -72,6 +176,7 @@ typedef struct {
     void            *start;
     size_t          length;
     int             fd;         /* DMABuf fd for CAPTURE buffers */
+    int             plane1_fd;  /* DMABuf fd of plane 1, only for cache maintenance */
     bool            queued;
     uint32_t        index;
     /* For CAPTURE buffers: cached mmap pointers */
@@ -81,6 +186,16 @@ typedef struct {
     size_t          plane1_len;
 } V4L2MmapBuffer;
 
+/* CPU view of the visible area of a decoded frame, one entry per colour plane */
+typedef struct {
+    uint32_t        fourcc;         /* V4L2 pixel format */
+    int             num_planes;     /* 2 for NV12/P010, 3 for YUV420 */
+    uint8_t         *data[3];
+    uint32_t        pitch[3];       /* Bytes between rows */
+    uint32_t        width[3];       /* Visible bytes per row */
+    uint32_t        height[3];      /* Visible rows */
+} V4L2FrameLayout;
+
 /* Decoded surface (maps to CAPTURE buffer) */
 typedef struct V4L2Surface {
     uint32_t        width;
@@ -90,7 +205,19 @@ typedef struct V4L2Surface {
     int             dmabuf_fd;      /* DMABuf fd for zero-copy */
     bool            decoded;        /* Has valid decoded content */
     bool            no_output;      /* Frame decoded but no CAPTURE output (show_frame=0) */
+    bool            export_hint;    /* Created with a display/export usage hint */
+    uint64_t        modifiers[MAX_MODIFIERS];  /* VASurfaceAttribDRMFormatModifiers, in preference order */
+    int             num_modifiers;
+    VAStatus        decode_status;  /* VA_STATUS_ERROR_DECODING_ERROR if the picture is damaged */
+    VASurfaceDecodeMBErrors mb_errors[2];  /* vaQuerySurfaceError report, status -1 terminated */
     VAImageID       cached_image;   /* Cached image buffer for this surface */
+    uint64_t        cache_key;      /* Frame cache key of the picture rendered into it */
+    struct V4L2CachedFrame *cached_frame;  /* Shows a frame cache entry instead of CAPTURE */
+    uint8_t         *user_ptr;      /* VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR backing, or NULL */
+    uint32_t        user_pitches[2];
+    uint32_t        user_offsets[2];
+    uint32_t        user_size;
+    uint64_t        readback_seq;   /* Last asynchronous GetImage from it (readback.c) */
     pthread_mutex_t mutex;
     pthread_cond_t  cond;
     struct V4L2Context *context;
@@ -125,6 +252,10 @@ typedef struct V4L2Context {
     int                 v4l2_fd;
     bool                streaming_output;
     bool                streaming_capture;
+    bool                low_latency;        /* Decode-order output, minimal buffering */
+    bool                slice_streaming;    /* Queue slice groups from RenderPicture */
+    bool                keyframe_only;      /* Skip everything but keyframes (thumbnails) */
+    uint64_t            picture_seq;        /* Current picture, used as OUTPUT timestamp */
 
     /* OUTPUT queue (compressed bitstream) */
     V4L2MmapBuffer      output_buffers[MAX_OUTPUT_BUFFERS];
@@ -134,15 +265,29 @@ typedef struct V4L2Context {
     /* CAPTURE queue (decoded frames) */
     V4L2MmapBuffer      capture_buffers[MAX_CAPTURE_BUFFERS];
     int                 num_capture_buffers;
+    struct v4l2_pix_format_mplane capture_fmt;  /* Negotiated CAPTURE format */
+    V4L2Consumer        consumer;           /* Ranks CAPTURE formats at negotiation */
+    uint64_t            modifiers[MAX_MODIFIERS];  /* Accepted by the importer; none: linear only */
+    int                 num_modifiers;
+    bool                capture_noncoherent; /* CPU mappings are cached, sync explicitly */
+    uint32_t            visible_width;      /* Display rectangle within capture_fmt */
+    uint32_t            visible_height;
 
     /* Current decode operation */
     V4L2Surface         *render_target;
     BitstreamBuffer     bitstream;
     const V4L2Codec     *codec;
+    bool                keyframe;           /* Set by codec: picture is a random access point */
+    bool                show_frame;         /* Set by codec: picture produces a CAPTURE frame */
+    bool                reference;          /* Set by codec: later pictures may depend on it */
+    size_t              param_sets_size;    /* Set by codec: bitstream starts with parameter sets */
 
     /* Slice data accumulation */
     void                *last_slice_params;
     unsigned int        last_slice_count;
+    V4L2NalList         nal_list;           /* NALs of one slice data buffer (H.264/HEVC) */
+    unsigned int        nal_dropped;        /* NALs left out by the NAL filter */
+    size_t              nal_dropped_bytes;
 
     /* H.264 codec-specific state */
     struct {
@@ -156,6 +301,7 @@ typedef struct V4L2Context {
     /* HEVC codec-specific state */
     struct {
         bool            params_sent;        /* VPS/SPS/PPS sent to decoder */
+        uint8_t         max_temporal_id;    /* Highest TemporalId seen in the stream */
 
         /* Reconstructed parameter sets (from VA-API params) */
         uint8_t         last_vps[64];
@@ -166,6 +312,78 @@ typedef struct V4L2Context {
         size_t          last_pps_size;
     } hevc;
 
+    /* Elementary stream dump (NULL unless V4L2VA_DUMP is set) */
+    struct V4L2Dump     *dump;
+
+    /* Decoded-frame cache (NULL unless V4L2VA_FRAME_CACHE is set) */
+    struct V4L2FrameCache *framecache;
+
+    /* Last asynchronous GetImage from its frames; queues stay until it is done */
+    uint64_t            readback_seq;
+
+    /* Multi-picture OUTPUT buffers (pack.c), max_pictures 0 when disabled */
+    struct {
+        int             max_pictures;
+        BitstreamBuffer data;               /* Open batch, not yet queued */
+        V4L2Surface     *pending[PACK_MAX_PICTURES];
+        int             num_pending;
+        uint64_t        pending_ts;
+        struct timespec first;              /* When the open batch was started */
+        struct {
+            uint64_t    ts;                 /* OUTPUT timestamp of the batch */
+            V4L2Surface *surfaces[PACK_MAX_PICTURES];   /* Shown pictures, in order */
+            int         count;
+            int         next;               /* Next surface to receive a frame */
+        } inflight[PACK_MAX_BATCHES];
+    } pack;
+
+    /* Decoder error recovery */
+    struct {
+        bool            resync;             /* Dropping pictures until the next keyframe */
+        bool            have_output;        /* A frame was dequeued since the last flush */
+        unsigned int    timeouts;           /* Consecutive frames that never came out */
+        unsigned int    skipped;            /* Pictures dropped while resyncing */
+    } recovery;
+
+    /* Overload frame dropping (drop.c) */
+    struct {
+        struct timespec last_hint;          /* App last polled a surface still rendering */
+        bool            hinted;
+        unsigned int    dropped;            /* Non-reference pictures skipped */
+    } drop;
+
+    /* Decode latency prediction (latency.c), model[1] for keyframes */
+    struct {
+        struct {
+            bool        valid;
+            bool        keyframe;
+            uint64_t    ts;                 /* OUTPUT timestamp */
+            int64_t     queued_us;          /* CLOCK_MONOTONIC */
+        } inflight[LATENCY_HISTORY];
+        struct V4L2LatencyModel model[2];
+        uint32_t        width;              /* Resolution the model was learnt at */
+        uint32_t        height;
+    } latency;
+
+    /* Idle power management: queues released while suspended */
+    struct timespec     last_activity;      /* CLOCK_MONOTONIC, last BeginPicture */
+    bool                suspended;
+
+    /* Charged to the driver memory budget (memory.c) */
+    size_t              mem_output;         /* OUTPUT buffers */
+    size_t              mem_capture;        /* CAPTURE buffers */
+    size_t              mem_staging;        /* Bitstream staging buffers */
+
+    /* Frame checksum output (V4L2VA_CHECKSUM) */
+    struct {
+        unsigned int    stream;
+        uint64_t        frames;
+    } checksum;
+
+    /* Multi-frame groups (vaMFAddContext): pictures wait for vaMFSubmit */
+    int                 mf_groups;          /* Groups this context is a member of */
+    bool                mf_pending;         /* Picture ended, not submitted yet */
+
     /* Track buffers used in current frame for cleanup */
     VABufferID          frame_buffers[MAX_FRAME_BUFFERS];
     int                 num_frame_buffers;
@@ -181,18 +399,62 @@ typedef struct {
     const V4L2Codec     *codec;
 } V4L2Config;
 
-/* Main driver state */
+/* Multi-frame context (vaCreateMFContext): contexts submitted together */
+typedef struct {
+    V4L2Context         *members[MAX_CONTEXTS];
+    int                 num_members;
+} V4L2MFContext;
+
+/*
+ * Decoder state shared by every VADisplay of the process (registry.c).
+ * Object tables stay per display in V4L2Driver.
+ */
+typedef struct V4L2Device {
+    int                 refs;               /* Displays using it, under the registry lock */
+
+    /* Probe results, copied into each display's V4L2Driver */
+    char                v4l2_device[64];
+    VAProfile           supported_profiles[MAX_PROFILES];
+    int                 num_supported_profiles;
+    struct {
+        uint32_t        pixfmt;
+        uint32_t        flags;
+    } output_formats[MAX_PROFILES];
+    int                 num_output_formats;
+
+    /* Memory governor (memory.c): decoder buffers and images vs. budget */
+    size_t              mem_budget;         /* 0: unlimited */
+    _Atomic size_t      mem_charged;
+
+    /* Memory of destroyed images, kept for the next CreateImage (imagepool.c) */
+    struct V4L2ImagePool *image_pool;
+
+    /* Destroyed buffers kept for reuse with their data (buffer.c) */
+    V4L2Buffer          *spare_buffers[SPARE_BUFFERS];
+    int                 num_spare_buffers;
+    unsigned int        buffers_allocated;
+    unsigned int        buffers_reused;
+    pthread_mutex_t     spare_mutex;
+
+    /* Asynchronous GetImage worker (readback.c), NULL when disabled */
+    struct V4L2Readback *readback;
+} V4L2Device;
+
+/* Main driver state, one per VADisplay */
 typedef struct V4L2Driver {
     int                 drm_fd;             /* DRM device fd from vaGetDisplayDRM */
     char                v4l2_device[64];    /* e.g., "/dev/video0" */
 
     /* Object storage */
-    V4L2Config          *configs[MAX_PROFILES];
+    V4L2Config          *configs[MAX_CONFIGS];
     int                 num_configs;
 
-    V4L2Context         *contexts[MAX_PROFILES];
+    V4L2Context         *contexts[MAX_CONTEXTS];
     int                 num_contexts;
 
+    V4L2MFContext       *mf_contexts[MAX_MF_CONTEXTS];
+    int                 num_mf_contexts;
+
     V4L2Surface         *surfaces[MAX_SURFACES];
     int                 num_surfaces;
 
@@ -203,13 +465,46 @@ typedef struct V4L2Driver {
     VAProfile           supported_profiles[MAX_PROFILES];
     int                 num_supported_profiles;
 
+    /* Compressed formats on the OUTPUT queue and their V4L2_FMT_FLAG_* */
+    struct {
+        uint32_t        pixfmt;
+        uint32_t        flags;
+    } output_formats[MAX_PROFILES];
+    int                 num_output_formats;
+
+    /* Device resources held by all contexts (for leak tracking) */
+    _Atomic size_t      mapped_bytes;
+    _Atomic int         exported_fds;
+
+    /* State shared with every other display in the process (registry.c) */
+    struct V4L2Device   *dev;
+
+    /* Idle context reaper (idle.c), waits on idle_cond under mutex */
+    pthread_t           idle_thread;
+    pthread_cond_t      idle_cond;
+    bool                idle_running;
+    bool                idle_stop;
+
     pthread_mutex_t     mutex;
 } V4L2Driver;
 
 /* Utility functions */
 void bitstream_append(BitstreamBuffer *bb, const void *data, size_t size);
+int bitstream_reserve(BitstreamBuffer *bb, size_t size);
 void bitstream_reset(BitstreamBuffer *bb);
 void bitstream_free(BitstreamBuffer *bb);
+long ms_since(const struct timespec *ts);
+
+/* Two-pass NAL gather (buffer.c) */
+void nal_list_reset(V4L2NalList *list);
+int nal_list_add(V4L2NalList *list, const void *data, size_t size);
+void nal_list_gather(V4L2NalList *list, BitstreamBuffer *bb);
+void nal_list_free(V4L2NalList *list);
+
+/* Buffer recycling (buffer.c) */
+V4L2Buffer *buffer_get(V4L2Device *dev, size_t size);
+void buffer_put(V4L2Device *dev, V4L2Buffer *buffer);
+void buffer_spares_free(V4L2Device *dev);
 
 /* Logging */
 void v4l2va_log(const char *file, const char *func, int line, const char *fmt, ...);
@@ -219,12 +514,130 @@ void v4l2va_log(const char *file, const char *func, int line, const char *fmt, .
 int v4l2_open_device(V4L2Driver *drv);
 void v4l2_close_device(V4L2Driver *drv, int fd);
 int v4l2_probe_capabilities(V4L2Driver *drv, int fd);
+uint32_t v4l2_format_flags(const V4L2Driver *drv, uint32_t pixfmt);
 int v4l2_setup_output_queue(V4L2Context *ctx);
+int v4l2_alloc_output_buffers(V4L2Context *ctx);
 int v4l2_setup_capture_queue(V4L2Context *ctx);
-int v4l2_queue_bitstream(V4L2Context *ctx, void *data, size_t size);
-int v4l2_dequeue_frame(V4L2Context *ctx, V4L2Surface *surface);
+int v4l2_queue_bitstream(V4L2Context *ctx, void *data, size_t size, uint64_t timestamp);
+int v4l2_dequeue_frame(V4L2Context *ctx, V4L2Surface *surface, int timeout_ms);
 int v4l2_requeue_capture(V4L2Context *ctx, int capture_idx);
 int v4l2_export_dmabuf(V4L2Context *ctx, int capture_idx);
+int v4l2_export_plane(V4L2Context *ctx, int capture_idx, int plane);
+int v4l2_map_capture(V4L2Context *ctx, int capture_idx);
+void v4l2_capture_begin_cpu(V4L2Context *ctx, int capture_idx, uint64_t sync_flags);
+void v4l2_capture_end_cpu(V4L2Context *ctx, int capture_idx, uint64_t sync_flags);
+void v4l2_release_output_queue(V4L2Context *ctx);
+void v4l2_release_queues(V4L2Context *ctx);
+int v4l2_flush(V4L2Context *ctx);
+void v4l2_resync(V4L2Context *ctx, const char *reason);
+int v4l2_output_backlog(V4L2Context *ctx);
+
+/* Surface helpers (surface.c) */
+int surface_frame_layout(V4L2Context *ctx, int capture_idx, V4L2FrameLayout *layout);
+int surface_copy_frame(V4L2Context *ctx, uint8_t *base0, uint8_t *base1, uint8_t *dst,
+                       const uint32_t pitches[2], const uint32_t offsets[2],
+                       size_t size, uint32_t height);
+int surface_write_user(V4L2Context *ctx, V4L2Surface *surface, uint8_t *base0, uint8_t *base1);
+void surface_deliver_user(V4L2Context *ctx, V4L2Surface *surface, int capture_idx);
+void surface_clear_error(V4L2Surface *surface);
+void surface_set_error(V4L2Surface *surface, VADecodeErrorType type);
+
+/* Frame checksums (checksum.c) */
+void checksum_init_context(V4L2Context *ctx);
+void checksum_frame(V4L2Context *ctx, int capture_idx);
+
+/* Bitstream dump (dump.c) */
+struct V4L2Dump *dump_open(const V4L2Context *ctx);
+void dump_write(struct V4L2Dump *dump, const void *data, size_t size);
+void dump_close(struct V4L2Dump *dump);
+void dump_shutdown(void);
+
+/* Multi-picture OUTPUT buffers (pack.c) */
+void pack_init_context(V4L2Context *ctx);
+int pack_add(V4L2Context *ctx, V4L2Surface *surface);
+int pack_flush(V4L2Context *ctx);
+bool pack_pending(const V4L2Context *ctx, const V4L2Surface *surface);
+V4L2Surface *pack_take(V4L2Context *ctx, uint64_t ts);
+void pack_forget(V4L2Context *ctx, const V4L2Surface *surface);
+void pack_reset(V4L2Context *ctx);
+
+/* Overload frame dropping (drop.c) */
+bool drop_picture(V4L2Context *ctx);
+void drop_hint(V4L2Context *ctx);
+
+/* Decoded-frame cache (framecache.c) */
+void framecache_init_context(V4L2Context *ctx);
+void framecache_destroy(V4L2Context *ctx);
+bool framecache_lookup(V4L2Context *ctx, V4L2Surface *surface);
+void framecache_store(V4L2Context *ctx, V4L2Surface *surface, int capture_idx);
+bool framecache_discard(V4L2Context *ctx);
+int framecache_planes(const V4L2Surface *surface, void *planes[2], size_t lens[2]);
+void framecache_release(V4L2Surface *surface);
+
+/* Decode latency prediction (latency.c) */
+void latency_submitted(V4L2Context *ctx, uint64_t ts);
+void latency_completed(V4L2Context *ctx, uint64_t ts);
+void latency_reset(V4L2Context *ctx);
+int latency_poll(V4L2Context *ctx, struct pollfd *pfd, int timeout_ms);
+
+/* How an exported CAPTURE format is described to importers (format.c) */
+typedef struct {
+    uint32_t        va_fourcc;
+    uint64_t        modifier;
+    uint32_t        drm_format;     /* Format of a composed layer */
+    bool            compressed;     /* One opaque plane, no per-plane layers */
+} V4L2ExportFormat;
+
+/* CAPTURE format negotiation (format.c) */
+void format_negotiate(V4L2Context *ctx, struct v4l2_format *fmt);
+uint32_t format_va_fourcc(uint32_t pixfmt);
+uint32_t format_bpp(uint32_t pixfmt);
+int format_export_info(uint32_t pixfmt, V4L2ExportFormat *info);
+void format_set_consumer(V4L2Context *ctx, V4L2Consumer consumer);
+
+/* Tiled CAPTURE readback (detile.c) */
+uint32_t detile_bpp(uint32_t pixfmt);
+bool detile_preferred(uint32_t width, uint32_t height);
+int detile_frame(V4L2Context *ctx, uint8_t *base0, uint8_t *base1, uint8_t *dst,
+                 const uint32_t pitches[2], const uint32_t offsets[2],
+                 size_t size, uint32_t height);
+
+/* Driver-wide memory governor (memory.c) */
+void mem_init(V4L2Device *dev);
+void mem_charge(V4L2Device *dev, size_t bytes);
+void mem_uncharge(V4L2Device *dev, size_t bytes);
+bool mem_pressure(V4L2Device *dev);
+int mem_fit(V4L2Context *ctx, const char *queue, int wanted, int minimum, size_t each);
+void mem_track_staging(V4L2Context *ctx);
+
+/* Image memory pool (imagepool.c) */
+void image_pool_init(V4L2Device *dev);
+int image_pool_get(V4L2Device *dev, V4L2Buffer *buffer);
+void image_pool_put(V4L2Device *dev, V4L2Buffer *buffer);
+void image_pool_destroy(V4L2Device *dev);
+
+/* NAL filtering (nalfilter.c) */
+void nal_filter_set_sei(const char *list);
+bool nal_filter_drop(V4L2Context *ctx, const uint8_t *nal, size_t size);
+void nal_filter_report(V4L2Context *ctx);
+
+/* Asynchronous image readback (readback.c) */
+void readback_start(V4L2Device *dev);
+void readback_stop(V4L2Device *dev);
+void readback_queue(V4L2Device *dev, V4L2Context *ctx, V4L2Surface *surface,
+                    V4L2Buffer *image, uint8_t *base0, uint8_t *base1, int capture_idx,
+                    const uint32_t pitches[2], const uint32_t offsets[2]);
+VAStatus readback_wait(V4L2Device *dev, uint64_t seq, uint64_t timeout_ns);
+bool readback_done(V4L2Device *dev, uint64_t seq);
+
+/* Process-wide device registry (registry.c) */
+int registry_acquire(V4L2Driver *drv);
+void registry_release(V4L2Driver *drv);
+
+/* Idle power management (idle.c) */
+void idle_start(V4L2Driver *drv);
+void idle_stop(V4L2Driver *drv);
+int idle_resume(V4L2Context *ctx);
 
 /* Codec registration */
 extern const V4L2Codec h264_codec;
@@ -10,6 +10,132 @@
 #include <va/va.h>
 #include <string.h>
 
+/*
+ * Handle VP8 picture parameters (only used to spot key frames)
+ */
+static void vp8_handle_picture_params(V4L2Context *ctx, V4L2Buffer *buf)
+{
+    VAPictureParameterBufferVP8 *pic = buf->data;
+
+    /* VA-API inverts the bitstream sense: key_frame == 0 is a key frame */
+    ctx->keyframe = pic->pic_fields.bits.key_frame == 0;
+}
+
+/* Boolean entropy decoder (RFC 6386 section 7), enough to read the frame header */
+typedef struct {
+    const uint8_t *data;
+    const uint8_t *end;
+    uint32_t value;
+    uint32_t range;
+    int bit_count;
+} BoolDecoder;
+
+static void bd_init(BoolDecoder *bd, const uint8_t *data, size_t size)
+{
+    bd->data = data;
+    bd->end = data + size;
+    bd->value = 0;
+    for (int i = 0; i < 2; i++)
+        bd->value = (bd->value << 8) | (bd->data < bd->end ? *bd->data++ : 0);
+    bd->range = 255;
+    bd->bit_count = 0;
+}
+
+static int bd_read_bool(BoolDecoder *bd, int prob)
+{
+    uint32_t split = 1 + (((bd->range - 1) * prob) >> 8);
+    uint32_t bigsplit = split << 8;
+    int bit;
+
+    if (bd->value >= bigsplit) {
+        bit = 1;
+        bd->range -= split;
+        bd->value -= bigsplit;
+    } else {
+        bit = 0;
+        bd->range = split;
+    }
+
+    while (bd->range < 128) {
+        bd->value <<= 1;
+        bd->range <<= 1;
+        if (++bd->bit_count == 8) {
+            bd->bit_count = 0;
+            bd->value |= bd->data < bd->end ? *bd->data++ : 0;
+        }
+    }
+    return bit;
+}
+
+static int bd_read_literal(BoolDecoder *bd, int bits)
+{
+    int val = 0;
+    while (bits--)
+        val = (val << 1) | bd_read_bool(bd, 128);
+    return val;
+}
+
+/* Optional signed value: flag, magnitude, sign */
+static void bd_skip_delta(BoolDecoder *bd, int bits)
+{
+    if (bd_read_literal(bd, 1))
+        bd_read_literal(bd, bits + 1);
+}
+
+/*
+ * True if an inter frame updates any reference buffer or the persistent
+ * probabilities, parsed from the first partition (RFC 6386 section 9.3-9.7).
+ */
+static bool vp8_inter_frame_is_reference(const uint8_t *data, size_t size)
+{
+    BoolDecoder bd;
+
+    if (size <= 3)
+        return true;
+    bd_init(&bd, data + 3, size - 3);       /* Past the 3-byte frame tag */
+
+    if (bd_read_literal(&bd, 1)) {          /* segmentation_enabled */
+        int update_map = bd_read_literal(&bd, 1);
+        if (bd_read_literal(&bd, 1)) {      /* update_segment_feature_data */
+            bd_read_literal(&bd, 1);        /* segment_feature_mode */
+            for (int i = 0; i < 4; i++)
+                bd_skip_delta(&bd, 7);      /* quantizer_update_value */
+            for (int i = 0; i < 4; i++)
+                bd_skip_delta(&bd, 6);      /* loop_filter_update_value */
+        }
+        if (update_map) {
+            for (int i = 0; i < 3; i++) {
+                if (bd_read_literal(&bd, 1))
+                    bd_read_literal(&bd, 8);    /* segment_prob */
+            }
+        }
+    }
+
+    bd_read_literal(&bd, 1 + 6 + 3);        /* filter_type, level, sharpness */
+    if (bd_read_literal(&bd, 1)) {          /* loop_filter_adj_enable */
+        if (bd_read_literal(&bd, 1)) {      /* mode_ref_lf_delta_update */
+            for (int i = 0; i < 8; i++)
+                bd_skip_delta(&bd, 6);      /* ref_frame and mb_mode deltas */
+        }
+    }
+
+    bd_read_literal(&bd, 2);                /* log2_nbr_of_dct_partitions */
+    bd_read_literal(&bd, 7);                /* y_ac_qi */
+    for (int i = 0; i < 5; i++)
+        bd_skip_delta(&bd, 4);              /* y_dc ... uv_ac deltas */
+
+    int refresh_golden = bd_read_literal(&bd, 1);
+    int refresh_alt = bd_read_literal(&bd, 1);
+    int copy_golden = refresh_golden ? 0 : bd_read_literal(&bd, 2);
+    int copy_alt = refresh_alt ? 0 : bd_read_literal(&bd, 2);
+    bd_read_literal(&bd, 2);                /* sign_bias_golden, sign_bias_alternate */
+    int refresh_entropy_probs = bd_read_literal(&bd, 1);
+    int refresh_last = bd_read_literal(&bd, 1);
+
+    return refresh_golden || refresh_alt || copy_golden || copy_alt ||
+           refresh_entropy_probs || refresh_last;
+}
+
 /*
  * Handle VP8 slice data
  * VA-API provides the raw VP8 frame data directly
@@ -23,12 +149,24 @@ static void vp8_handle_slice_data(V4L2Context *ctx, V4L2Buffer *buf)
         return;
     }
 
+    /* Key frame status comes from the picture params; skip copying the rest */
+    if (ctx->keyframe_only && !ctx->keyframe)
+        return;
+
     /* VP8 typically has one slice per frame */
     for (unsigned int i = 0; i < ctx->last_slice_count; i++) {
         VASliceParameterBufferVP8 *sp = &slice_params[i];
 
         /* For VP8, slice_data_offset points to the frame data */
         uint8_t *frame_data = (uint8_t *)buf->data + sp->slice_data_offset;
+
+        /* Frame tag: key_frame(1) version(3) show_frame(1) first_part_size(19) */
+        if (i == 0 && sp->slice_data_size >= 3) {
+            ctx->show_frame = (frame_data[0] >> 4) & 1;
+            /* The header parse only matters to the drop policy */
+            if (v4l2va_options.drop_policy && !ctx->keyframe)
+                ctx->reference = vp8_inter_frame_is_reference(frame_data, sp->slice_data_size);
+        }
         bitstream_append(&ctx->bitstream, frame_data, sp->slice_data_size);
     }
 }
@@ -53,6 +191,7 @@ const V4L2Codec vp8_codec = {
     .v4l2_pixfmt = V4L2_PIX_FMT_VP8,
     .profiles = vp8_profiles,
     .num_profiles = sizeof(vp8_profiles) / sizeof(vp8_profiles[0]),
+    .handle_picture_params = vp8_handle_picture_params,
     .handle_slice_data = vp8_handle_slice_data,
     .prepare_bitstream = vp8_prepare_bitstream,
 };
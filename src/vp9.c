@@ -11,6 +11,66 @@
 #include <va/va.h>
 #include <string.h>
 
+/*
+ * Handle VP9 picture parameters (key frame, show_frame and reference tracking)
+ */
+static void vp9_handle_picture_params(V4L2Context *ctx, V4L2Buffer *buf)
+{
+    VADecPictureParameterBufferVP9 *pic = buf->data;
+
+    ctx->keyframe = pic->pic_fields.bits.frame_type == 0;  /* KEY_FRAME */
+    ctx->show_frame = pic->pic_fields.bits.show_frame;
+
+    /*
+     * Probabilities adapted by this frame persist unless it is error
+     * resilient; the slice handler adds refresh_frame_flags.
+     */
+    ctx->reference = ctx->keyframe || pic->pic_fields.bits.intra_only ||
+                     (pic->pic_fields.bits.refresh_frame_context &&
+                      !pic->pic_fields.bits.error_resilient_mode);
+}
+
+static int vp9_read_bits(const uint8_t *data, size_t size, size_t *pos, int bits)
+{
+    int val = 0;
+    for (int i = 0; i < bits; i++, (*pos)++) {
+        int bit = *pos < size * 8 ? (data[*pos / 8] >> (7 - *pos % 8)) & 1 : 0;
+        val = val << 1 | bit;
+    }
+    return val;
+}
+
+/*
+ * refresh_frame_flags of an inter frame, read from its uncompressed header.
+ * Returns -1 for frames that refresh slots implicitly or are truncated.
+ */
+static int vp9_refresh_frame_flags(const uint8_t *data, size_t size)
+{
+    size_t pos = 2;                                         /* frame_marker */
+    int profile = vp9_read_bits(data, size, &pos, 1);
+    profile |= vp9_read_bits(data, size, &pos, 1) << 1;
+    if (profile == 3)
+        pos++;                                              /* reserved_zero */
+
+    if (vp9_read_bits(data, size, &pos, 1))                 /* show_existing_frame */
+        return 0;
+
+    int frame_type = vp9_read_bits(data, size, &pos, 1);
+    int show_frame = vp9_read_bits(data, size, &pos, 1);
+    int error_resilient_mode = vp9_read_bits(data, size, &pos, 1);
+    if (frame_type == 0)
+        return -1;                                          /* KEY_FRAME */
+
+    int intra_only = show_frame ? 0 : vp9_read_bits(data, size, &pos, 1);
+    if (intra_only)
+        return -1;
+    if (!error_resilient_mode)
+        pos += 2;                                           /* reset_frame_context */
+
+    int flags = vp9_read_bits(data, size, &pos, 8);
+    return pos <= size * 8 ? flags : -1;
+}
+
 /*
  * Handle VP9 slice data
  * VA-API provides the raw VP9 frame data
@@ -24,11 +84,18 @@ static void vp9_handle_slice_data(V4L2Context *ctx, V4L2Buffer *buf)
         return;
     }
 
+    /* Key frame status comes from the picture params; skip copying the rest */
+    if (ctx->keyframe_only && !ctx->keyframe)
+        return;
+
     for (unsigned int i = 0; i < ctx->last_slice_count; i++) {
         VASliceParameterBufferVP9 *sp = &slice_params[i];
 
         /* VP9 frame data */
         uint8_t *frame_data = (uint8_t *)buf->data + sp->slice_data_offset;
+        if (i == 0 && !ctx->reference &&
+            vp9_refresh_frame_flags(frame_data, sp->slice_data_size) != 0)
+            ctx->reference = true;
         bitstream_append(&ctx->bitstream, frame_data, sp->slice_data_size);
     }
 }
@@ -54,6 +121,7 @@ const V4L2Codec vp9_codec = {
     .v4l2_pixfmt = V4L2_PIX_FMT_VP9,
     .profiles = vp9_profiles,
     .num_profiles = sizeof(vp9_profiles) / sizeof(vp9_profiles[0]),
+    .handle_picture_params = vp9_handle_picture_params,
     .handle_slice_data = vp9_handle_slice_data,
     .prepare_bitstream = vp9_prepare_bitstream,
 };
@@ -0,0 +1,192 @@
+/*
+ * Steady-state allocation check for the decode loop
+ *
+ * Drives the driver through its VA entry points the way a player does:
+ * per picture a picture parameter, a slice parameter and a slice data
+ * buffer of varying size, Begin/Render/EndPicture, vaSyncSurface, the
+ * frame read back with vaGetImage and through vaDeriveImage, and the
+ * buffers destroyed again in shuffled order. The decoder is the fake one
+ * in fake-v4l2.c. After a warm-up that has seen the largest picture, the
+ * loop must not allocate: malloc, calloc and realloc are counted through
+ * the linker's --wrap, anonymous mappings (image memory) by the fake.
+ */
+
+#define _GNU_SOURCE
+#include "vabackend.h"
+#include "fake-v4l2.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_WIDTH          320
+#define TEST_HEIGHT         240
+#define TEST_SURFACES       8
+#define TEST_WARMUP         32
+#define TEST_PICTURES       10000
+#define TEST_GOP            30
+#define TEST_MAX_SLICES     16
+#define TEST_MAX_SLICE      (16 * 1024)
+
+VAStatus __vaDriverInit_1_0(VADriverContextP ctx);
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *p, size_t size);
+
+static atomic_ulong allocations;
+
+void *__wrap_malloc(size_t size)
+{
+    atomic_fetch_add(&allocations, 1);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    atomic_fetch_add(&allocations, 1);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    atomic_fetch_add(&allocations, 1);
+    return __real_realloc(p, size);
+}
+
+static unsigned long allocations_now(void)
+{
+    return atomic_load(&allocations) + fake_v4l2_anon_maps();
+}
+
+static unsigned int seed = 1;
+
+static unsigned int next_rand(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+#define CHECK(call) do { \
+        VAStatus status_ = (call); \
+        if (status_ != VA_STATUS_SUCCESS) { \
+            fprintf(stderr, "%s failed: %d\n", #call, status_); \
+            return -1; \
+        } \
+    } while (0)
+
+static VAPictureParameterBufferH264 pic_params;
+static VASliceParameterBufferH264 slice_params[TEST_MAX_SLICES];
+static uint8_t slice_data[TEST_MAX_SLICES * TEST_MAX_SLICE];
+
+/* One picture, from vaBeginPicture until the frame has been read back twice */
+static int decode_picture(VADriverContextP ctx, VAContextID context, VASurfaceID surface,
+                          int n, int slices, size_t slice_size)
+{
+    struct VADriverVTable *vt = ctx->vtable;
+    VABufferID buffers[3];
+
+    for (int i = 0; i < slices; i++) {
+        slice_params[i].slice_data_offset = i * slice_size;
+        slice_params[i].slice_data_size = slice_size;
+        slice_data[i * slice_size] = n % TEST_GOP == 0 ? 0x65 : 0x41;   /* IDR or P slice */
+    }
+
+    CHECK(vt->vaBeginPicture(ctx, context, surface));
+    CHECK(vt->vaCreateBuffer(ctx, context, VAPictureParameterBufferType,
+                             sizeof(pic_params), 1, &pic_params, &buffers[0]));
+    CHECK(vt->vaCreateBuffer(ctx, context, VASliceParameterBufferType,
+                             sizeof(slice_params[0]), slices, slice_params, &buffers[1]));
+    CHECK(vt->vaCreateBuffer(ctx, context, VASliceDataBufferType,
+                             slices * slice_size, 1, slice_data, &buffers[2]));
+    CHECK(vt->vaRenderPicture(ctx, context, buffers, 3));
+    CHECK(vt->vaEndPicture(ctx, context));
+
+    /* The application destroys them in any order */
+    int first = next_rand() % 3;
+    for (int i = 0; i < 3; i++)
+        CHECK(vt->vaDestroyBuffer(ctx, buffers[(first + i) % 3]));
+
+    VASurfaceStatus surface_status;
+    CHECK(vt->vaSyncSurface(ctx, surface));
+    CHECK(vt->vaQuerySurfaceStatus(ctx, surface, &surface_status));
+    if (surface_status != VASurfaceReady) {
+        fprintf(stderr, "picture %d: surface not ready after vaSyncSurface\n", n);
+        return -1;
+    }
+
+    VAImageFormat nv12 = { .fourcc = VA_FOURCC_NV12, .byte_order = VA_LSB_FIRST,
+                           .bits_per_pixel = 12 };
+    VAImage image;
+    CHECK(vt->vaCreateImage(ctx, &nv12, TEST_WIDTH, TEST_HEIGHT, &image));
+    CHECK(vt->vaGetImage(ctx, surface, 0, 0, TEST_WIDTH, TEST_HEIGHT, image.image_id));
+    CHECK(vt->vaDestroyImage(ctx, image.image_id));
+
+    void *pixels;
+    CHECK(vt->vaDeriveImage(ctx, surface, &image));
+    CHECK(vt->vaMapBuffer(ctx, image.buf, &pixels));
+    CHECK(vt->vaUnmapBuffer(ctx, image.buf));
+    CHECK(vt->vaDestroyImage(ctx, image.image_id));
+    return 0;
+}
+
+int main(void)
+{
+    struct VADriverVTable vtable;
+    struct VADriverContext driver;
+    VADriverContextP ctx = &driver;
+    VAConfigID config;
+    VAContextID context;
+    VASurfaceID surfaces[TEST_SURFACES];
+
+    memset(&vtable, 0, sizeof(vtable));
+    memset(&driver, 0, sizeof(driver));
+    driver.vtable = &vtable;
+    if (__vaDriverInit_1_0(ctx) != VA_STATUS_SUCCESS) {
+        fprintf(stderr, "driver init failed\n");
+        return 1;
+    }
+
+    pic_params.picture_width_in_mbs_minus1 = TEST_WIDTH / 16 - 1;
+    pic_params.picture_height_in_mbs_minus1 = TEST_HEIGHT / 16 - 1;
+    pic_params.num_ref_frames = 4;
+    pic_params.seq_fields.bits.frame_mbs_only_flag = 1;
+    pic_params.seq_fields.bits.direct_8x8_inference_flag = 1;
+    pic_params.pic_fields.bits.entropy_coding_mode_flag = 1;
+
+    if (vtable.vaCreateConfig(ctx, VAProfileH264High, VAEntrypointVLD, NULL, 0, &config) ||
+        vtable.vaCreateSurfaces(ctx, TEST_WIDTH, TEST_HEIGHT, VA_RT_FORMAT_YUV420,
+                                TEST_SURFACES, surfaces) ||
+        vtable.vaCreateContext(ctx, config, TEST_WIDTH, TEST_HEIGHT, VA_PROGRESSIVE,
+                               surfaces, TEST_SURFACES, &context)) {
+        fprintf(stderr, "cannot set up an H.264 decode context\n");
+        return 1;
+    }
+
+    int n = 0;
+    for (; n < TEST_WARMUP; n++) {
+        if (decode_picture(ctx, context, surfaces[n % TEST_SURFACES], n,
+                           TEST_MAX_SLICES, TEST_MAX_SLICE) < 0)
+            return 1;
+    }
+
+    unsigned long before = allocations_now();
+    for (; n < TEST_WARMUP + TEST_PICTURES; n++) {
+        int slices = 1 + next_rand() % TEST_MAX_SLICES;
+        size_t slice_size = 1 + next_rand() * (TEST_MAX_SLICE - 1) / 0x7fff;
+        if (decode_picture(ctx, context, surfaces[n % TEST_SURFACES], n, slices, slice_size) < 0)
+            return 1;
+    }
+    unsigned long steady = allocations_now() - before;
+
+    vtable.vaDestroyContext(ctx, context);
+    vtable.vaDestroySurfaces(ctx, surfaces, TEST_SURFACES);
+    vtable.vaDestroyConfig(ctx, config);
+    vtable.vaTerminate(ctx);
+
+    printf("%d pictures after warm-up: %lu allocations\n", TEST_PICTURES, steady);
+    return steady == 0 ? 0 : 1;
+}
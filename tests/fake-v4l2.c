@@ -0,0 +1,435 @@
+/*
+ * Fake V4L2 stateful decoder for the driver tests
+ *
+ * Linked into a test together with the driver sources, with open, ioctl,
+ * mmap and poll wrapped by the linker (--wrap). Opening /dev/video0 gives
+ * a decoder that offers H.264 in and NV12 out and "decodes" every OUTPUT
+ * buffer into the next queued CAPTURE buffer at once, carrying its
+ * timestamp over. It follows the stateful sequence the driver relies on:
+ * SOURCE_CHANGE after the first OUTPUT STREAMON, CAPTURE buffers handed
+ * out in queue order, STREAMOFF returning every buffer of a queue.
+ *
+ * Buffer memory is anonymous: the driver writes bitstream nobody reads
+ * and reads frames nobody wrote, which is all a test of its plumbing
+ * needs. Anything else opened or mapped goes to the real calls.
+ */
+
+#define _GNU_SOURCE
+#include "fake-v4l2.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#define FAKE_DEVICE             "/dev/video0"
+#define FAKE_MAX_BUFFERS        32
+#define FAKE_MIN_CAPTURE        4
+#define FAKE_OUTPUT_SIZE        (1024 * 1024)
+
+int __real_open(const char *path, int flags, ...);
+int __real_ioctl(int fd, unsigned long request, ...);
+void *__real_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __wrap_open(const char *path, int flags, ...);
+int __wrap_ioctl(int fd, unsigned long request, ...);
+void *__wrap_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+/* Buffer indices in the order they were queued or completed */
+typedef struct {
+    int             idx[FAKE_MAX_BUFFERS];
+    unsigned int    head;
+    unsigned int    count;
+} FakeFifo;
+
+typedef struct {
+    unsigned int    count;
+    size_t          size;
+    bool            streaming;
+    FakeFifo        queued;         /* Owned by the decoder */
+    FakeFifo        done;           /* Waiting for DQBUF */
+    struct timeval  timestamp[FAKE_MAX_BUFFERS];
+    uint32_t        bytesused[FAKE_MAX_BUFFERS];
+} FakeQueue;
+
+static struct {
+    pthread_mutex_t mutex;
+    int             fd;
+    struct v4l2_pix_format_mplane output_fmt;
+    struct v4l2_pix_format_mplane capture_fmt;
+    FakeQueue       output;
+    FakeQueue       capture;
+    bool            source_change;
+    struct timeval  pending[FAKE_MAX_BUFFERS];  /* Consumed pictures without a frame yet */
+    unsigned int    pending_head;
+    unsigned int    pending_count;
+    atomic_ulong    anon_maps;
+} fake = { .mutex = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static void fifo_push(FakeFifo *f, int idx)
+{
+    if (f->count < FAKE_MAX_BUFFERS)
+        f->idx[(f->head + f->count++) % FAKE_MAX_BUFFERS] = idx;
+}
+
+static int fifo_pop(FakeFifo *f)
+{
+    if (f->count == 0)
+        return -1;
+    int idx = f->idx[f->head];
+    f->head = (f->head + 1) % FAKE_MAX_BUFFERS;
+    f->count--;
+    return idx;
+}
+
+static bool fifo_contains(const FakeFifo *f, int idx)
+{
+    for (unsigned int i = 0; i < f->count; i++) {
+        if (f->idx[(f->head + i) % FAKE_MAX_BUFFERS] == idx)
+            return true;
+    }
+    return false;
+}
+
+static FakeQueue *queue_for(uint32_t type)
+{
+    if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+        return &fake.output;
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+        return &fake.capture;
+    return NULL;
+}
+
+static void set_capture_format(uint32_t width, uint32_t height)
+{
+    struct v4l2_pix_format_mplane *f = &fake.capture_fmt;
+
+    memset(f, 0, sizeof(*f));
+    f->width = (width + 15) & ~15u;
+    f->height = (height + 15) & ~15u;
+    f->pixelformat = V4L2_PIX_FMT_NV12;
+    f->num_planes = 1;
+    f->plane_fmt[0].bytesperline = f->width;
+    f->plane_fmt[0].sizeimage = f->width * f->height * 3 / 2;
+}
+
+/* Consume queued bitstream and turn it into frames while there is room */
+static void decode(void)
+{
+    if (fake.output.streaming) {
+        int idx;
+        while ((idx = fifo_pop(&fake.output.queued)) >= 0) {
+            if (fake.pending_count < FAKE_MAX_BUFFERS) {
+                unsigned int slot = (fake.pending_head + fake.pending_count++) % FAKE_MAX_BUFFERS;
+                fake.pending[slot] = fake.output.timestamp[idx];
+            }
+            fifo_push(&fake.output.done, idx);
+        }
+    }
+
+    if (!fake.capture.streaming)
+        return;
+    while (fake.pending_count > 0 && fake.capture.queued.count > 0) {
+        int idx = fifo_pop(&fake.capture.queued);
+        fake.capture.timestamp[idx] = fake.pending[fake.pending_head];
+        fake.capture.bytesused[idx] = fake.capture_fmt.plane_fmt[0].sizeimage;
+        fake.pending_head = (fake.pending_head + 1) % FAKE_MAX_BUFFERS;
+        fake.pending_count--;
+        fifo_push(&fake.capture.done, idx);
+    }
+}
+
+static void queue_reset(FakeQueue *q)
+{
+    memset(&q->queued, 0, sizeof(q->queued));
+    memset(&q->done, 0, sizeof(q->done));
+}
+
+static int fake_reqbufs(struct v4l2_requestbuffers *req)
+{
+    FakeQueue *q = queue_for(req->type);
+    if (q == NULL || req->memory != V4L2_MEMORY_MMAP || q->streaming)
+        return -EINVAL;
+
+    queue_reset(q);
+    if (req->count > FAKE_MAX_BUFFERS)
+        req->count = FAKE_MAX_BUFFERS;
+    q->count = req->count;
+    q->size = q == &fake.output ? fake.output_fmt.plane_fmt[0].sizeimage
+                                : fake.capture_fmt.plane_fmt[0].sizeimage;
+    req->capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP;
+    req->flags = 0;
+    return 0;
+}
+
+static int fake_querybuf(struct v4l2_buffer *buf)
+{
+    FakeQueue *q = queue_for(buf->type);
+    if (q == NULL || buf->index >= q->count || buf->length < 1)
+        return -EINVAL;
+
+    buf->length = 1;
+    buf->m.planes[0].length = q->size;
+    buf->m.planes[0].m.mem_offset = (q == &fake.capture ? 0x10000000 : 0) + buf->index * q->size;
+    return 0;
+}
+
+static int fake_qbuf(struct v4l2_buffer *buf)
+{
+    FakeQueue *q = queue_for(buf->type);
+    if (q == NULL || buf->index >= q->count ||
+        fifo_contains(&q->queued, buf->index) || fifo_contains(&q->done, buf->index))
+        return -EINVAL;
+
+    q->timestamp[buf->index] = buf->timestamp;
+    q->bytesused[buf->index] = buf->length > 0 ? buf->m.planes[0].bytesused : 0;
+    fifo_push(&q->queued, buf->index);
+    decode();
+    return 0;
+}
+
+static int fake_dqbuf(struct v4l2_buffer *buf)
+{
+    FakeQueue *q = queue_for(buf->type);
+    if (q == NULL)
+        return -EINVAL;
+
+    int idx = fifo_pop(&q->done);
+    if (idx < 0)
+        return -EAGAIN;
+
+    buf->index = idx;
+    buf->flags = 0;
+    buf->timestamp = q->timestamp[idx];
+    if (buf->length > 0) {
+        buf->m.planes[0].bytesused = q->bytesused[idx];
+        buf->m.planes[0].length = q->size;
+    }
+    buf->length = 1;
+    return 0;
+}
+
+static int fake_stream(uint32_t type, bool on)
+{
+    FakeQueue *q = queue_for(type);
+    if (q == NULL)
+        return -EINVAL;
+
+    if (!on) {
+        /* Every buffer comes back to the application, nothing is completed */
+        queue_reset(q);
+        if (q == &fake.output)
+            fake.pending_count = 0;
+    } else if (q == &fake.output && fake.capture.count == 0) {
+        fake.source_change = true;
+    }
+    q->streaming = on;
+    decode();
+    return 0;
+}
+
+static int fake_g_fmt(struct v4l2_format *fmt)
+{
+    if (fmt->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+        fmt->fmt.pix_mp = fake.output_fmt;
+    else if (fmt->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+        fmt->fmt.pix_mp = fake.capture_fmt;
+    else
+        return -EINVAL;
+    return 0;
+}
+
+static int fake_s_fmt(struct v4l2_format *fmt)
+{
+    if (fmt->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+        if (fmt->fmt.pix_mp.pixelformat != V4L2_PIX_FMT_H264 || fake.output.count > 0)
+            return -EINVAL;
+        struct v4l2_pix_format_mplane *f = &fmt->fmt.pix_mp;
+        f->num_planes = 1;
+        if (f->plane_fmt[0].sizeimage == 0)
+            f->plane_fmt[0].sizeimage = FAKE_OUTPUT_SIZE;
+        fake.output_fmt = *f;
+        set_capture_format(f->width, f->height);
+        return 0;
+    }
+    if (fmt->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        /* NV12 is all there is; S_FMT settles on it like a real driver would */
+        if (fake.capture.count > 0)
+            return -EBUSY;
+        fmt->fmt.pix_mp = fake.capture_fmt;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+static int fake_enum_fmt(struct v4l2_fmtdesc *desc)
+{
+    if (desc->index > 0)
+        return -EINVAL;
+    if (desc->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+        desc->pixelformat = V4L2_PIX_FMT_H264;
+        desc->flags = V4L2_FMT_FLAG_COMPRESSED | V4L2_FMT_FLAG_DYN_RESOLUTION;
+        strcpy((char *)desc->description, "H.264");
+    } else if (desc->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        desc->pixelformat = V4L2_PIX_FMT_NV12;
+        desc->flags = 0;
+        strcpy((char *)desc->description, "Y/UV 4:2:0");
+    } else {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int fake_ioctl(unsigned long request, void *arg)
+{
+    switch (request) {
+    case VIDIOC_QUERYCAP: {
+        struct v4l2_capability *cap = arg;
+        memset(cap, 0, sizeof(*cap));
+        strcpy((char *)cap->driver, "fake");
+        strcpy((char *)cap->card, "fake stateful decoder");
+        cap->capabilities = V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
+        cap->device_caps = cap->capabilities;
+        return 0;
+    }
+    case VIDIOC_ENUM_FMT:
+        return fake_enum_fmt(arg);
+    case VIDIOC_G_FMT:
+        return fake_g_fmt(arg);
+    case VIDIOC_S_FMT:
+        return fake_s_fmt(arg);
+    case VIDIOC_G_SELECTION: {
+        struct v4l2_selection *sel = arg;
+        memset(&sel->r, 0, sizeof(sel->r));
+        sel->r.width = fake.output_fmt.width;
+        sel->r.height = fake.output_fmt.height;
+        return 0;
+    }
+    case VIDIOC_G_CTRL: {
+        struct v4l2_control *ctrl = arg;
+        if (ctrl->id != V4L2_CID_MIN_BUFFERS_FOR_CAPTURE)
+            return -EINVAL;
+        ctrl->value = FAKE_MIN_CAPTURE;
+        return 0;
+    }
+    case VIDIOC_REQBUFS:
+        return fake_reqbufs(arg);
+    case VIDIOC_QUERYBUF:
+        return fake_querybuf(arg);
+    case VIDIOC_QBUF:
+        return fake_qbuf(arg);
+    case VIDIOC_DQBUF:
+        return fake_dqbuf(arg);
+    case VIDIOC_STREAMON:
+        return fake_stream(*(uint32_t *)arg, true);
+    case VIDIOC_STREAMOFF:
+        return fake_stream(*(uint32_t *)arg, false);
+    case VIDIOC_SUBSCRIBE_EVENT:
+        return 0;
+    case VIDIOC_DQEVENT: {
+        struct v4l2_event *ev = arg;
+        if (!fake.source_change)
+            return -ENOENT;
+        memset(ev, 0, sizeof(*ev));
+        ev->type = V4L2_EVENT_SOURCE_CHANGE;
+        ev->u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION;
+        fake.source_change = false;
+        return 0;
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
+int __wrap_open(const char *path, int flags, ...)
+{
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = (flags & O_CREAT) ? va_arg(args, mode_t) : 0;
+    va_end(args);
+
+    if (strcmp(path, FAKE_DEVICE) != 0)
+        return __real_open(path, flags, mode);
+
+    /* A real fd, so that close() and fd bookkeeping just work */
+    int fd = __real_open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return fd;
+
+    pthread_mutex_lock(&fake.mutex);
+    memset(&fake.output_fmt, 0, sizeof(fake.output_fmt));
+    memset(&fake.capture_fmt, 0, sizeof(fake.capture_fmt));
+    memset(&fake.output, 0, sizeof(fake.output));
+    memset(&fake.capture, 0, sizeof(fake.capture));
+    fake.source_change = false;
+    fake.pending_count = 0;
+    fake.fd = fd;
+    pthread_mutex_unlock(&fake.mutex);
+    return fd;
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    va_start(args, request);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+
+    pthread_mutex_lock(&fake.mutex);
+    if (fd != fake.fd) {
+        pthread_mutex_unlock(&fake.mutex);
+        return __real_ioctl(fd, request, arg);
+    }
+    int ret = fake_ioctl(request, arg);
+    pthread_mutex_unlock(&fake.mutex);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+void *__wrap_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+    if (fd >= 0 && fd == fake.fd)
+        return __real_mmap(NULL, len, prot, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (flags & MAP_ANONYMOUS)
+        atomic_fetch_add(&fake.anon_maps, 1);
+    return __real_mmap(addr, len, prot, flags, fd, offset);
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    pthread_mutex_lock(&fake.mutex);
+    if (nfds != 1 || fds[0].fd != fake.fd) {
+        pthread_mutex_unlock(&fake.mutex);
+        return __real_poll(fds, nfds, timeout);
+    }
+
+    /* Frames appear only while the driver queues, so there is never anything to wait for */
+    short revents = 0;
+    if (fake.capture.done.count > 0)
+        revents |= POLLIN | POLLRDNORM;
+    if (fake.output.done.count > 0)
+        revents |= POLLOUT | POLLWRNORM;
+    if (fake.source_change)
+        revents |= POLLPRI;
+    fds[0].revents = revents & (fds[0].events | POLLERR | POLLHUP);
+    pthread_mutex_unlock(&fake.mutex);
+    return fds[0].revents ? 1 : 0;
+}
+
+unsigned long fake_v4l2_anon_maps(void)
+{
+    return atomic_load(&fake.anon_maps);
+}
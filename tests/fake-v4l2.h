@@ -0,0 +1,13 @@
+/*
+ * Fake V4L2 stateful decoder for the driver tests (fake-v4l2.c)
+ *
+ * Link with -Wl,--wrap=open,--wrap=ioctl,--wrap=mmap,--wrap=poll.
+ */
+
+#ifndef FAKE_V4L2_H
+#define FAKE_V4L2_H
+
+/* Anonymous mappings the code under test made (image memory and the like) */
+unsigned long fake_v4l2_anon_maps(void);
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Decode latency benchmark for VA-API to V4L2 stateful backend
+ *
+ * Feeds one stream through FFmpeg's VAAPI hwaccel, paced like a live
+ * source, and measures for every frame the time from handing its packet
+ * to the decoder until its pixels are in system memory (vaapi-copy, the
+ * way players read frames back). Prints the latency distribution, so
+ * V4L2VA_LOW_LATENCY and the LOW_LATENCY_* defaults can be compared on
+ * the same clip:
+ *
+ *   v4l2va-latency [-r fps] [-n frames] [-d device] FILE
+ *
+ * -r paces packets at the given rate (default: the stream's frame rate,
+ * 0 feeds as fast as the decoder takes them).
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
+
+#define LATENCY_MAX_INFLIGHT    64
+
+typedef struct {
+    int64_t     pts;
+    int64_t     sent_us;
+    bool        valid;
+} LatencyPacket;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(int64_t t)
+{
+    int64_t wait = t - now_us();
+    if (wait <= 0)
+        return;
+    struct timespec ts = { wait / 1000000, (wait % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static enum AVPixelFormat get_vaapi_format(AVCodecContext *dec, const enum AVPixelFormat *fmts)
+{
+    for (; *fmts != AV_PIX_FMT_NONE; fmts++) {
+        if (*fmts == AV_PIX_FMT_VAAPI)
+            return *fmts;
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const int64_t *sorted, int n, int p)
+{
+    int i = (int)((int64_t)(n - 1) * p / 100);
+    return sorted[i] / 1000.0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: v4l2va-latency [-r fps] [-n frames] [-d device] FILE\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = "/dev/dri/renderD128";
+    double fps = -1;
+    int max_frames = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:d:")) != -1) {
+        switch (opt) {
+        case 'r': fps = atof(optarg); break;
+        case 'n': max_frames = atoi(optarg); break;
+        case 'd': device = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || max_frames < 1)
+        usage();
+    const char *file = argv[optind];
+
+    AVFormatContext *fmt = NULL;
+    AVBufferRef *hw = NULL;
+    const AVCodec *codec;
+    if (avformat_open_input(&fmt, file, NULL, NULL) < 0 ||
+        avformat_find_stream_info(fmt, NULL) < 0) {
+        fprintf(stderr, "latency: cannot open %s\n", file);
+        return 1;
+    }
+    int video = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (video < 0) {
+        fprintf(stderr, "latency: no video stream in %s\n", file);
+        return 1;
+    }
+    if (av_hwdevice_ctx_create(&hw, AV_HWDEVICE_TYPE_VAAPI, device, NULL, 0) < 0) {
+        fprintf(stderr, "latency: cannot open VAAPI device %s\n", device);
+        return 1;
+    }
+
+    AVCodecContext *dec = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(dec, fmt->streams[video]->codecpar);
+    dec->hw_device_ctx = av_buffer_ref(hw);
+    dec->get_format = get_vaapi_format;
+    if (avcodec_open2(dec, codec, NULL) < 0) {
+        fprintf(stderr, "latency: cannot open decoder\n");
+        return 1;
+    }
+
+    if (fps < 0) {
+        AVRational rate = fmt->streams[video]->avg_frame_rate;
+        fps = rate.num && rate.den ? av_q2d(rate) : 30;
+    }
+
+    LatencyPacket inflight[LATENCY_MAX_INFLIGHT] = { 0 };
+    int64_t *latency = calloc(max_frames, sizeof(*latency));
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *sw = av_frame_alloc();
+    int frames = 0, packets = 0, lost = 0;
+    int64_t start = now_us();
+
+    while (frames < max_frames && av_read_frame(fmt, pkt) >= 0) {
+        if (pkt->stream_index != video) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        /* A live source delivers one picture per frame interval */
+        if (fps > 0)
+            sleep_until_us(start + (int64_t)(packets * 1000000 / fps));
+
+        LatencyPacket *slot = &inflight[packets % LATENCY_MAX_INFLIGHT];
+        slot->pts = pkt->pts;
+        slot->sent_us = now_us();
+        slot->valid = true;
+        packets++;
+
+        int ret = avcodec_send_packet(dec, pkt);
+        av_packet_unref(pkt);
+        while (ret >= 0 && frames < max_frames) {
+            ret = avcodec_receive_frame(dec, frame);
+            if (ret < 0)
+                break;
+
+            /* Latency ends when the pixels are in memory */
+            if (av_hwframe_transfer_data(sw, frame, 0) < 0) {
+                fprintf(stderr, "latency: readback failed\n");
+                return 1;
+            }
+            int64_t done = now_us();
+
+            int i;
+            for (i = 0; i < LATENCY_MAX_INFLIGHT; i++) {
+                if (inflight[i].valid && inflight[i].pts == frame->pts)
+                    break;
+            }
+            if (i < LATENCY_MAX_INFLIGHT) {
+                latency[frames++] = done - inflight[i].sent_us;
+                inflight[i].valid = false;
+            } else {
+                lost++;
+            }
+            av_frame_unref(sw);
+            av_frame_unref(frame);
+        }
+        if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            fprintf(stderr, "latency: decode error\n");
+            return 1;
+        }
+    }
+    double elapsed = (now_us() - start) / 1e6;
+
+    if (frames == 0) {
+        fprintf(stderr, "latency: no frames decoded\n");
+        return 1;
+    }
+
+    int64_t sum = 0;
+    for (int i = 0; i < frames; i++)
+        sum += latency[i];
+    qsort(latency, frames, sizeof(*latency), compare_us);
+
+    printf("%s: %d frames at %.1f fps pacing, %.1f fps decoded\n",
+           file, frames, fps, frames / elapsed);
+    printf("latency ms: mean %.2f  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f\n",
+           sum / 1000.0 / frames, percentile_ms(latency, frames, 50),
+           percentile_ms(latency, frames, 95), percentile_ms(latency, frames, 99),
+           latency[frames - 1] / 1000.0);
+    if (lost)
+        printf("%d frames without a matching packet (no pts) left out\n", lost);
+
+    av_frame_free(&sw);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    free(latency);
+    avcodec_free_context(&dec);
+    av_buffer_unref(&hw);
+    avformat_close_input(&fmt);
+    return 0;
+}
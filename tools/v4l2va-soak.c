@@ -0,0 +1,369 @@
+/*
+ * Soak and scaling harness for VA-API to V4L2 stateful backend
+ *
+ * Long-running clients (an NVR with dozens of cameras per process) keep
+ * many decode contexts open for weeks while streams come and go. This
+ * tool reproduces that load through FFmpeg's VAAPI hwaccel: N streams
+ * spread over T threads share one VADisplay, each decoding a randomly
+ * chosen input file for a random number of frames, seeking now and then,
+ * and closing to reopen another file, so contexts are destroyed and
+ * recreated at the mixed codecs and resolutions of the inputs. Every
+ * decoded frame is exported as DRM PRIME (vaExportSurfaceHandle) and
+ * released again.
+ *
+ * Every report interval it prints open files, mapped memory, live
+ * contexts and the decode time per frame. The first interval after the
+ * warm-up is the baseline; the run fails if the fd count grows past it by
+ * more than the allowed slack, or if any open, decode or export fails.
+ * The driver's own handle-table occupancy is logged on each context
+ * create and destroy with V4L2VA_LOG=1 ("Resources:" lines).
+ *
+ *   v4l2va-soak [-n streams] [-t threads] [-d seconds] [-i interval]
+ *               [-f fd_slack] [-r device] FILE...
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
+
+#define SOAK_MAX_STREAMS        256
+#define SOAK_MIN_FRAMES         30
+#define SOAK_MAX_FRAMES         600
+#define SOAK_SEEK_ONE_IN        200     /* Chance of a seek per packet */
+
+typedef struct {
+    AVFormatContext     *fmt;
+    AVCodecContext      *dec;
+    int                 video;
+    int                 frames_left;
+} SoakStream;
+
+typedef struct {
+    int                 first;          /* Streams first, first + step, ... */
+    int                 step;
+    unsigned int        seed;
+} SoakThread;
+
+static struct {
+    char                **files;
+    int                 num_files;
+    int                 num_streams;
+    AVBufferRef         *device;
+    atomic_bool         stop;
+} soak;
+
+static struct {
+    atomic_int          live;           /* Open decoders (VA contexts) */
+    atomic_ulong        opens;
+    atomic_ulong        seeks;
+    atomic_ulong        frames;
+    atomic_ulong        errors;
+    atomic_ulong        decode_us;      /* Time in send/receive, this interval */
+    atomic_ulong        decode_frames;
+    atomic_ulong        decode_max_us;
+} stats;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fail(const char *what, const char *file, int err)
+{
+    char msg[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(err, msg, sizeof(msg));
+    fprintf(stderr, "soak: %s %s: %s\n", what, file, msg);
+    atomic_fetch_add(&stats.errors, 1);
+}
+
+static int count_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    int n = 0;
+
+    if (dir == NULL)
+        return -1;
+    while (readdir(dir))
+        n++;
+    closedir(dir);
+    return n - 3;   /* ".", ".." and the directory itself */
+}
+
+/* Resident set size in KB */
+static long rss_kb(void)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[128];
+    long kb = -1;
+
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+static enum AVPixelFormat get_vaapi_format(AVCodecContext *dec, const enum AVPixelFormat *fmts)
+{
+    for (; *fmts != AV_PIX_FMT_NONE; fmts++) {
+        if (*fmts == AV_PIX_FMT_VAAPI)
+            return *fmts;
+    }
+    /* Never fall back to software decoding: that hides driver failures */
+    return AV_PIX_FMT_NONE;
+}
+
+static void stream_close(SoakStream *s)
+{
+    if (s->dec) {
+        avcodec_free_context(&s->dec);
+        atomic_fetch_sub(&stats.live, 1);
+    }
+    avformat_close_input(&s->fmt);
+}
+
+static int stream_open(SoakStream *s, unsigned int *seed)
+{
+    const char *file = soak.files[rand_r(seed) % soak.num_files];
+    const AVCodec *codec;
+    int ret;
+
+    ret = avformat_open_input(&s->fmt, file, NULL, NULL);
+    if (ret < 0) {
+        fail("cannot open", file, ret);
+        return -1;
+    }
+    avformat_find_stream_info(s->fmt, NULL);
+
+    s->video = av_find_best_stream(s->fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (s->video < 0) {
+        fail("no video stream in", file, s->video);
+        stream_close(s);
+        return -1;
+    }
+
+    s->dec = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(s->dec, s->fmt->streams[s->video]->codecpar);
+    s->dec->hw_device_ctx = av_buffer_ref(soak.device);
+    s->dec->get_format = get_vaapi_format;
+    atomic_fetch_add(&stats.live, 1);
+
+    ret = avcodec_open2(s->dec, codec, NULL);
+    if (ret < 0) {
+        fail("cannot open decoder for", file, ret);
+        stream_close(s);
+        return -1;
+    }
+
+    s->frames_left = SOAK_MIN_FRAMES + rand_r(seed) % (SOAK_MAX_FRAMES - SOAK_MIN_FRAMES);
+    atomic_fetch_add(&stats.opens, 1);
+    return 0;
+}
+
+/* Export a decoded frame as DRM PRIME and let go of it again */
+static void frame_export(const SoakStream *s, const AVFrame *frame, AVFrame *drm)
+{
+    drm->format = AV_PIX_FMT_DRM_PRIME;
+    int ret = av_hwframe_map(drm, frame, AV_HWFRAME_MAP_READ);
+    if (ret < 0)
+        fail("cannot export frame of", s->fmt->url, ret);
+    av_frame_unref(drm);
+}
+
+static void latency_add(int64_t us, int frames)
+{
+    atomic_fetch_add(&stats.decode_us, us);
+    atomic_fetch_add(&stats.decode_frames, frames);
+
+    unsigned long per_frame = us / frames;
+    unsigned long max = atomic_load(&stats.decode_max_us);
+    while (per_frame > max && !atomic_compare_exchange_weak(&stats.decode_max_us, &max, per_frame))
+        ;
+}
+
+/* Feed one packet; reopens the stream once it is done or broken */
+static void stream_step(SoakStream *s, AVPacket *pkt, AVFrame *frame, AVFrame *drm,
+                        unsigned int *seed)
+{
+    if (s->dec == NULL && stream_open(s, seed) < 0)
+        return;
+
+    if (rand_r(seed) % SOAK_SEEK_ONE_IN == 0 && s->fmt->duration > 0) {
+        int64_t ts = (int64_t)(rand_r(seed) / (RAND_MAX + 1.0) * s->fmt->duration);
+        if (av_seek_frame(s->fmt, -1, ts, AVSEEK_FLAG_BACKWARD) >= 0) {
+            avcodec_flush_buffers(s->dec);
+            atomic_fetch_add(&stats.seeks, 1);
+        }
+    }
+
+    int ret = av_read_frame(s->fmt, pkt);
+    if (ret < 0) {
+        stream_close(s);
+        return;
+    }
+    if (pkt->stream_index != s->video) {
+        av_packet_unref(pkt);
+        return;
+    }
+
+    int64_t start = now_us();
+    int frames = 0;
+    ret = avcodec_send_packet(s->dec, pkt);
+    av_packet_unref(pkt);
+    while (ret >= 0) {
+        ret = avcodec_receive_frame(s->dec, frame);
+        if (ret < 0)
+            break;
+        frames++;
+        frame_export(s, frame, drm);
+        av_frame_unref(frame);
+    }
+    if (frames > 0) {
+        latency_add(now_us() - start, frames);
+        atomic_fetch_add(&stats.frames, frames);
+        s->frames_left -= frames;
+    }
+
+    if (ret < 0 && ret != AVERROR(EAGAIN)) {
+        fail("decode error in", s->fmt->url, ret);
+        stream_close(s);
+    } else if (s->frames_left <= 0) {
+        stream_close(s);
+    }
+}
+
+static void *soak_thread(void *arg)
+{
+    SoakThread *t = arg;
+    SoakStream streams[SOAK_MAX_STREAMS] = { 0 };
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *drm = av_frame_alloc();
+
+    while (!atomic_load(&soak.stop)) {
+        for (int i = t->first; i < soak.num_streams; i += t->step)
+            stream_step(&streams[i], pkt, frame, drm, &t->seed);
+    }
+
+    for (int i = t->first; i < soak.num_streams; i += t->step)
+        stream_close(&streams[i]);
+    av_frame_free(&drm);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: v4l2va-soak [-n streams] [-t threads] [-d seconds] [-i interval]\n"
+            "                   [-f fd_slack] [-r device] FILE...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = "/dev/dri/renderD128";
+    int num_threads = 4;
+    int duration = 60;
+    int interval = 10;
+    int fd_slack = 64;
+    int opt;
+
+    soak.num_streams = 16;
+    while ((opt = getopt(argc, argv, "n:t:d:i:f:r:")) != -1) {
+        switch (opt) {
+        case 'n': soak.num_streams = atoi(optarg); break;
+        case 't': num_threads = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 'f': fd_slack = atoi(optarg); break;
+        case 'r': device = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind >= argc || soak.num_streams < 1 || soak.num_streams > SOAK_MAX_STREAMS ||
+        num_threads < 1 || interval < 1)
+        usage();
+    if (num_threads > soak.num_streams)
+        num_threads = soak.num_streams;
+    soak.files = argv + optind;
+    soak.num_files = argc - optind;
+
+    int ret = av_hwdevice_ctx_create(&soak.device, AV_HWDEVICE_TYPE_VAAPI, device, NULL, 0);
+    if (ret < 0) {
+        fail("cannot open VAAPI device", device, ret);
+        return 1;
+    }
+
+    printf("soak: %d streams on %d threads, %d input files, %d s\n",
+           soak.num_streams, num_threads, soak.num_files, duration);
+
+    pthread_t threads[SOAK_MAX_STREAMS];
+    SoakThread args[SOAK_MAX_STREAMS];
+    for (int i = 0; i < num_threads; i++) {
+        args[i].first = i;
+        args[i].step = num_threads;
+        args[i].seed = (unsigned int)time(NULL) + i;
+        pthread_create(&threads[i], NULL, soak_thread, &args[i]);
+    }
+
+    int base_fds = -1;
+    double base_ms = 0;
+    bool fd_leak = false;
+    for (int elapsed = interval; elapsed <= duration; elapsed += interval) {
+        sleep(interval);
+
+        unsigned long us = atomic_exchange(&stats.decode_us, 0);
+        unsigned long n = atomic_exchange(&stats.decode_frames, 0);
+        unsigned long max = atomic_exchange(&stats.decode_max_us, 0);
+        double avg_ms = n ? us / 1000.0 / n : 0;
+        int fds = count_fds();
+
+        /* The first interval warms up pools and caches; later ones are compared to it */
+        if (base_fds < 0) {
+            base_fds = fds;
+            base_ms = avg_ms;
+        } else if (fds > base_fds + fd_slack) {
+            fd_leak = true;
+        }
+
+        printf("soak: %5d s  live=%d opens=%lu seeks=%lu frames=%lu errors=%lu "
+               "fds=%d (%+d) rss=%ld KB  decode %.2f ms/frame (x%.2f) max %.2f ms\n",
+               elapsed, atomic_load(&stats.live), atomic_load(&stats.opens),
+               atomic_load(&stats.seeks), atomic_load(&stats.frames),
+               atomic_load(&stats.errors), fds, fds - base_fds, rss_kb(),
+               avg_ms, base_ms > 0 ? avg_ms / base_ms : 1.0, max / 1000.0);
+        fflush(stdout);
+    }
+
+    atomic_store(&soak.stop, true);
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    av_buffer_unref(&soak.device);
+
+    unsigned long errors = atomic_load(&stats.errors);
+    if (fd_leak)
+        fprintf(stderr, "soak: FAIL: fd count grew by more than %d\n", fd_slack);
+    if (errors)
+        fprintf(stderr, "soak: FAIL: %lu errors\n", errors);
+    return fd_leak || errors ? 1 : 0;
+}